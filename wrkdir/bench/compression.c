@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+// Times deflating sets of objects at fixed levels and with the sampling
+// heuristic, to pick core.compression for a given mix of content
+
+#define BENCH_OBJECT_SIZE (256 * 1024)
+#define BENCH_OBJECTS 128
+
+struct bench_mode {
+    const char *name;
+    int level;
+    int sample;
+};
+
+static const struct bench_mode modes[] = {
+    {"0", Z_NO_COMPRESSION, 0},
+    {"1", Z_BEST_SPEED, 0},
+    {"6", Z_DEFAULT_COMPRESSION, 0},
+    {"9", Z_BEST_COMPRESSION, 0},
+    {"6+sample", Z_DEFAULT_COMPRESSION, 1},
+    {"9+sample", Z_BEST_COMPRESSION, 1},
+};
+
+static unsigned long long next_random(unsigned long long *state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+// Source-like text made of a small vocabulary
+static void fill_text(unsigned char *buf, size_t len,
+                      unsigned long long *state) {
+    static const char *words[] = {
+        "int ",    "return ", "if (",   ") {\n", "    ",   "size_t ",
+        "char *",  "len",     " = ",    ";\n",   "}\n",    "buf",
+        "struct ", "free(",   "NULL",   ", ",    "data",   "0",
+        "while (", "+= ",     "stream", "->",    "hash",   "// ",
+    };
+    size_t n = sizeof(words) / sizeof(*words), pos = 0;
+    while (pos < len) {
+        const char *word = words[next_random(state) % n];
+        size_t word_len = strlen(word);
+        if (word_len > len - pos)
+            word_len = len - pos;
+        memcpy(buf + pos, word, word_len);
+        pos += word_len;
+    }
+}
+
+// Stands in for archives, images and other already compressed content
+static void fill_random(unsigned char *buf, size_t len,
+                        unsigned long long *state) {
+    for (size_t i = 0; i < len; i++)
+        buf[i] = next_random(state);
+}
+
+static void fill_mixed(unsigned char *buf, size_t len,
+                       unsigned long long *state) {
+    if (next_random(state) % 2)
+        fill_text(buf, len, state);
+    else
+        fill_random(buf, len, state);
+}
+
+struct bench_data {
+    const char *name;
+    void (*fill)(unsigned char *, size_t, unsigned long long *);
+};
+
+static const struct bench_data datasets[] = {
+    {"text", fill_text},
+    {"random", fill_random},
+    {"mixed", fill_mixed},
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_mode(const struct bench_mode *mode, unsigned char **objects,
+                    unsigned char *out, uLong out_size) {
+    size_t total_in = 0, total_out = 0;
+    double start = now();
+    for (int i = 0; i < BENCH_OBJECTS; i++) {
+        int level = mode->level;
+        if (mode->sample)
+            level =
+                pick_compression_level(level, objects[i], BENCH_OBJECT_SIZE);
+
+        uLongf out_len = out_size;
+        if (compress2(out, &out_len, objects[i], BENCH_OBJECT_SIZE, level) !=
+            Z_OK) {
+            fprintf(stderr, "compress2 failed at level %d\n", level);
+            return 1;
+        }
+        total_in += BENCH_OBJECT_SIZE;
+        total_out += out_len;
+    }
+    double elapsed = now() - start;
+
+    printf("  %-10s %9.1f MB/s %8.1f%% %8.3f s\n", mode->name,
+           total_in / elapsed / 1e6, 100.0 * total_out / total_in, elapsed);
+
+    return 0;
+}
+
+int main(void) {
+    uLong out_size = compressBound(BENCH_OBJECT_SIZE);
+    unsigned char *out = malloc(out_size);
+    unsigned char *objects[BENCH_OBJECTS];
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        objects[i] = malloc(BENCH_OBJECT_SIZE);
+
+    printf("%d objects of %d KiB per set\n", BENCH_OBJECTS,
+           BENCH_OBJECT_SIZE / 1024);
+
+    int ret = 0;
+    for (size_t d = 0; !ret && d < sizeof(datasets) / sizeof(*datasets);
+         d++) {
+        unsigned long long state = 1;
+        for (int i = 0; i < BENCH_OBJECTS; i++)
+            datasets[d].fill(objects[i], BENCH_OBJECT_SIZE, &state);
+
+        printf("%s\n  %-10s %14s %9s %10s\n", datasets[d].name, "level",
+               "throughput", "size", "time");
+        for (size_t m = 0; !ret && m < sizeof(modes) / sizeof(*modes); m++)
+            ret = run_mode(&modes[m], objects, out, out_size);
+    }
+
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        free(objects[i]);
+    free(out);
+
+    return ret;
+}
@@ -1,3 +1,4 @@
+#include <openssl/evp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,33 +8,146 @@
 #include <zlib.h>
 
 #include "blob.h"
-#include "openssl/sha.h"
+#include "compress.h"
+#include "hash.h"
+#include "object.h"
+#include "tree.h"
 
-unsigned char *blob_and_hash_file(char *filepath, long *size) {
-    char *blob = blob_file(filepath, (size_t *)size);
+int blob_and_hash_file(char *filepath, unsigned char *sha1) {
+    return stream_blob(filepath, sha1, 0);
+}
+
+struct blob_reader {
+    FILE *file;
+    char *filepath;
+    off_t size;
+    char header[OBJECT_HEADER_MAX];
+    int header_len;
+    unsigned char *in;
+};
+
+// Reads the file from its current position and hashes it as a blob, also
+// deflating the content into object when a stream is given
+static int read_blob(struct blob_reader *reader, z_stream *stream,
+                     unsigned char *out, FILE *object, unsigned char *sha1) {
+    EVP_MD_CTX *ctx = hash_ctx_new();
+    EVP_DigestUpdate(ctx, reader->header, reader->header_len);
+
+    off_t total = 0;
+    size_t len;
+    int ret = 0;
+    while (!ret &&
+           (len = fread(reader->in, 1, BLOB_CHUNK_SIZE, reader->file)) > 0) {
+        total += len;
+        EVP_DigestUpdate(ctx, reader->in, len);
+
+        if (stream) {
+            stream->next_in = reader->in;
+            stream->avail_in = len;
+            ret = deflate_object_chunk(stream, out, object, Z_NO_FLUSH);
+        }
+    }
+
+    if (!ret && (ferror(reader->file) || total != reader->size)) {
+        fprintf(stderr, "%s changed while it was being read\n",
+                reader->filepath);
+        ret = 1;
+    }
+
+    hash_ctx_final(ctx, sha1);
+    EVP_MD_CTX_free(ctx);
+
+    return ret;
+}
+
+// Streams a file that is not yet in the object store through deflate into a
+// temporary object, hashing it again to catch changes since the first pass.
+// The compression level is picked from the first block of the file.
+static int write_blob(struct blob_reader *reader, const unsigned char *sha1) {
+    size_t sample_len =
+        fread(reader->in, 1, COMPRESSION_SAMPLE_SIZE, reader->file);
+    int level = object_compression_level(reader->in, sample_len);
+    rewind(reader->file);
 
-    unsigned char hash[20];
-    return SHA1((unsigned char *)blob, *size, hash);
+    char hash[GIT_MAX_HEXSZ + 1], tmp_path[OBJECT_PATH_MAX];
+    sha1_to_hex(sha1, hash);
+    FILE *object = create_tmp_object(hash, tmp_path, sizeof(tmp_path));
+    if (!object)
+        return 1;
+
+    unsigned char *out = malloc(OBJECT_CHUNK_SIZE);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, level);
+
+    stream.next_in = (Bytef *)reader->header;
+    stream.avail_in = reader->header_len;
+    int ret = deflate_object_chunk(&stream, out, object, Z_NO_FLUSH);
+
+    unsigned char check[GIT_MAX_RAWSZ];
+    if (!ret)
+        ret = read_blob(reader, &stream, out, object, check);
+    if (!ret)
+        ret = deflate_object_chunk(&stream, out, object, Z_FINISH);
+    if (!ret && memcmp(check, sha1, hash_algo()->rawsz) != 0) {
+        fprintf(stderr, "%s changed while it was being read\n",
+                reader->filepath);
+        ret = 1;
+    }
+
+    deflateEnd(&stream);
+    free(out);
+
+    return commit_tmp_object(object, tmp_path, hash, ret);
 }
 
-// TODO: these are almost the same function, refactor
-char *blob_file(char *filepath, size_t *size) {
-    FILE *file = fopen(filepath, "r");
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char *data = malloc(*size);
-    if (data)
-        fread(data, 1, *size, file);
-    fclose(file);
-
-    unsigned long ucompSize = *size + 10;
-    char *blob = malloc(ucompSize);
-    sprintf(blob, "blob %ld\\0", *size);
-    memcpy(blob + 10, data, *size);
-    free(data);
-
-    *size = ucompSize;
-
-    return blob;
+// Hashes the file as a blob object and, when write is set, stores it unless
+// the object already exists. Files that fit in one chunk are read once and
+// written with write_object(), bigger ones are hashed first and only streamed
+// through deflate when the object is new, so memory stays at a couple of
+// chunks regardless of file size.
+int stream_blob(char *filepath, unsigned char *sha1, int write) {
+    struct blob_reader reader;
+    struct stat file_stat;
+    if (stat(filepath, &file_stat) != 0) {
+        perror(filepath);
+        return 1;
+    }
+
+    reader.file = fopen(filepath, "rb");
+    if (!reader.file) {
+        perror(filepath);
+        return 1;
+    }
+    reader.filepath = filepath;
+    reader.size = file_stat.st_size;
+    reader.in = malloc(BLOB_CHUNK_SIZE);
+
+    int ret = 0;
+    if (reader.size <= BLOB_CHUNK_SIZE) {
+        size_t len = fread(reader.in, 1, BLOB_CHUNK_SIZE, reader.file);
+        if (ferror(reader.file) || (off_t)len != reader.size) {
+            fprintf(stderr, "%s changed while it was being read\n",
+                    filepath);
+            ret = 1;
+        } else if (write) {
+            ret = write_object("blob", reader.in, len, sha1);
+        } else {
+            hash_object_data("blob", reader.in, len, sha1);
+        }
+    } else {
+        reader.header_len =
+            format_object_header(reader.header, "blob", reader.size);
+        ret = read_blob(&reader, NULL, NULL, NULL, sha1);
+
+        if (!ret && write && !has_object(sha1)) {
+            rewind(reader.file);
+            ret = write_blob(&reader, sha1);
+        }
+    }
+
+    fclose(reader.file);
+    free(reader.in);
+
+    return ret;
 }
@@ -1,6 +1,7 @@
 #ifndef BLOB_H
 #define BLOB_H
 
+#include <openssl/evp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,7 +10,12 @@
 #include <unistd.h>
 #include <zlib.h>
 
-unsigned char *blob_and_hash_file(char *filepath, long *size);
-char *blob_file(char *filepath, size_t *size);
+// Size of the read and deflate buffers used when streaming a file into an
+// object, peak memory stays at a couple of these regardless of file size
+#define BLOB_CHUNK_SIZE (128 * 1024)
+
+int blob_and_hash_file(char *filepath, unsigned char *sha1);
+
+int stream_blob(char *filepath, unsigned char *sha1, int write);
 
 #endif
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache-tree.h"
+#include "index.h"
+#include "object.h"
+#include "tree.h"
+
+struct cache_tree *cache_tree_new(void) {
+    struct cache_tree *tree = calloc(1, sizeof(struct cache_tree));
+    tree->entry_count = -1;
+
+    return tree;
+}
+
+void cache_tree_free(struct cache_tree *tree) {
+    if (!tree)
+        return;
+
+    for (int i = 0; i < tree->num_subtrees; i++) {
+        cache_tree_free(tree->subtrees[i]->tree);
+        free(tree->subtrees[i]);
+    }
+    free(tree->subtrees);
+    free(tree);
+}
+
+// Subtrees are kept sorted by name, returns the position of name or
+// -(insert position) - 1 when there is no such subtree
+static int subtree_pos(struct cache_tree *tree, const char *name,
+                       size_t len) {
+    int low = 0, high = tree->num_subtrees;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        struct cache_tree_sub *sub = tree->subtrees[mid];
+        size_t min = sub->name_len < len ? sub->name_len : len;
+        int cmp = memcmp(sub->name, name, min);
+        if (cmp == 0)
+            cmp = sub->name_len < len ? -1 : sub->name_len > len;
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return -low - 1;
+}
+
+static struct cache_tree_sub *find_subtree(struct cache_tree *tree,
+                                           const char *name, size_t len,
+                                           int create) {
+    int pos = subtree_pos(tree, name, len);
+    if (pos >= 0)
+        return tree->subtrees[pos];
+    if (!create)
+        return NULL;
+
+    if (tree->num_subtrees == tree->alloc_subtrees) {
+        tree->alloc_subtrees =
+            tree->alloc_subtrees ? tree->alloc_subtrees * 2 : 8;
+        tree->subtrees = realloc(tree->subtrees, tree->alloc_subtrees *
+                                                     sizeof(*tree->subtrees));
+    }
+
+    struct cache_tree_sub *sub = malloc(sizeof(*sub) + len + 1);
+    sub->tree = cache_tree_new();
+    sub->used = 0;
+    sub->name_len = len;
+    memcpy(sub->name, name, len);
+    sub->name[len] = '\0';
+
+    pos = -pos - 1;
+    memmove(tree->subtrees + pos + 1, tree->subtrees + pos,
+            (tree->num_subtrees - pos) * sizeof(*tree->subtrees));
+    tree->subtrees[pos] = sub;
+    tree->num_subtrees++;
+
+    return sub;
+}
+
+// Returns the cached tree of the directory name directly below tree, NULL
+// when there is none
+struct cache_tree *cache_tree_find(struct cache_tree *tree, const char *name,
+                                   size_t len) {
+    struct cache_tree_sub *sub = tree ? find_subtree(tree, name, len, 0) : NULL;
+    return sub ? sub->tree : NULL;
+}
+
+// Marks every directory from the root down to the one holding path as
+// changed, directories elsewhere keep their hashes
+void cache_tree_invalidate_path(struct cache_tree *tree, const char *path) {
+    while (tree) {
+        tree->entry_count = -1;
+
+        const char *slash = strchr(path, '/');
+        if (!slash)
+            return;
+
+        struct cache_tree_sub *sub =
+            find_subtree(tree, path, slash - path, 0);
+        tree = sub ? sub->tree : NULL;
+        path = slash + 1;
+    }
+}
+
+// Brings the tree for the directory base, whose entries start at index
+// position start, up to date. Returns the number of index entries below it
+// or -1 if a tree could not be written.
+static int update_one(struct cache_tree *tree, struct git_index *index,
+                      const char *base, size_t base_len, size_t start,
+                      int *trees_written) {
+    if (tree->entry_count >= 0)
+        return tree->entry_count;
+
+    for (int i = 0; i < tree->num_subtrees; i++)
+        tree->subtrees[i]->used = 0;
+
+    // Bring subdirectories up to date first, their hashes go into this tree
+    size_t num_entries = index->header.entries;
+    size_t end = start, num_tree_entries = 0;
+    while (end < num_entries) {
+        char *path = index_entry_path(index, &index->entries[end]);
+        if (strncmp(path, base, base_len) != 0)
+            break;
+
+        num_tree_entries++;
+        char *slash = strchr(path + base_len, '/');
+        if (!slash) {
+            end++;
+            continue;
+        }
+
+        struct cache_tree_sub *sub =
+            find_subtree(tree, path + base_len, slash - path - base_len, 1);
+        sub->used = 1;
+        int count = update_one(sub->tree, index, path, slash - path + 1, end,
+                               trees_written);
+        if (count < 0)
+            return -1;
+        end += count;
+    }
+
+    struct git_tree_entry *tree_entries =
+        malloc((num_tree_entries + 1) * sizeof(struct git_tree_entry));
+    size_t n = 0;
+    for (size_t i = start; i < end; n++) {
+        char *name = index_entry_path(index, &index->entries[i]) + base_len;
+        char *slash = strchr(name, '/');
+        struct git_tree_entry *entry = &tree_entries[n];
+        entry->path = name;
+
+        if (slash) {
+            struct cache_tree_sub *sub =
+                find_subtree(tree, name, slash - name, 0);
+            entry->mode = 40000;
+            entry->path_len = slash - name;
+            entry->sha1 = sub->tree->sha1;
+            i += sub->tree->entry_count;
+        } else {
+            entry->mode = index->entries[i].mode;
+            entry->path_len = strlen(name);
+            entry->sha1 = index->entries[i].sha1;
+            i++;
+        }
+    }
+
+    size_t size;
+    char *content = create_tree(tree_entries, n, &size);
+    int ret = write_object("tree", content, size, tree->sha1);
+    free(content);
+    free(tree_entries);
+    if (ret)
+        return -1;
+
+    // Directories that no longer have entries are dropped
+    int kept = 0;
+    for (int i = 0; i < tree->num_subtrees; i++) {
+        struct cache_tree_sub *sub = tree->subtrees[i];
+        if (sub->used) {
+            tree->subtrees[kept++] = sub;
+        } else {
+            cache_tree_free(sub->tree);
+            free(sub);
+        }
+    }
+    tree->num_subtrees = kept;
+
+    tree->entry_count = end - start;
+    (*trees_written)++;
+
+    return tree->entry_count;
+}
+
+// Writes the trees of every invalidated directory of the sorted index, the
+// root's hash ends up in index->cache_tree->sha1
+int cache_tree_update(struct git_index *index, int *trees_written) {
+    return update_one(index->cache_tree, index, "", 0, 0, trees_written) < 0;
+}
+
+struct buffer {
+    char *data;
+    size_t len;
+    size_t alloc;
+};
+
+static void buffer_add(struct buffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->alloc) {
+        buf->alloc = (buf->len + len) * 2;
+        buf->data = realloc(buf->data, buf->alloc);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+// Each directory is "<name>\0<entry count> <subtree count>\n" followed by its
+// hash when it is valid, then its subdirectories in the same form
+static void serialize_cache_tree(struct buffer *buf, struct cache_tree *tree,
+                                 const char *name, size_t name_len) {
+    char counts[32];
+    int len = snprintf(counts, sizeof(counts), "%d %d\n", tree->entry_count,
+                       tree->num_subtrees);
+
+    buffer_add(buf, name, name_len);
+    buffer_add(buf, "", 1);
+    buffer_add(buf, counts, len);
+    if (tree->entry_count >= 0)
+        buffer_add(buf, tree->sha1, hash_algo()->rawsz);
+
+    for (int i = 0; i < tree->num_subtrees; i++) {
+        struct cache_tree_sub *sub = tree->subtrees[i];
+        serialize_cache_tree(buf, sub->tree, sub->name, sub->name_len);
+    }
+}
+
+void write_cache_tree_extension(struct hashfile *f, struct cache_tree *tree) {
+    struct buffer buf = {NULL, 0, 0};
+    serialize_cache_tree(&buf, tree, "", 0);
+
+    hashfile_write(f, "TREE", 4);
+    hashfile_be32(f, buf.len);
+    hashfile_write(f, buf.data, buf.len);
+
+    free(buf.data);
+}
+
+static struct cache_tree *read_one(const unsigned char **data, size_t *size,
+                                   const char **name, size_t *name_len) {
+    const unsigned char *nul = memchr(*data, '\0', *size);
+    const unsigned char *newline =
+        nul ? memchr(nul, '\n', *size - (nul - *data)) : NULL;
+    if (!newline)
+        return NULL;
+
+    *name = (const char *)*data;
+    *name_len = nul - *data;
+
+    int entry_count, num_subtrees;
+    if (sscanf((const char *)nul + 1, "%d %d", &entry_count,
+               &num_subtrees) != 2 ||
+        num_subtrees < 0)
+        return NULL;
+
+    *size -= newline + 1 - *data;
+    *data = newline + 1;
+
+    struct cache_tree *tree = cache_tree_new();
+    tree->entry_count = entry_count;
+    if (entry_count >= 0) {
+        size_t rawsz = hash_algo()->rawsz;
+        if (*size < rawsz) {
+            cache_tree_free(tree);
+            return NULL;
+        }
+        memcpy(tree->sha1, *data, rawsz);
+        *data += rawsz;
+        *size -= rawsz;
+    }
+
+    for (int i = 0; i < num_subtrees; i++) {
+        const char *sub_name;
+        size_t sub_len;
+        struct cache_tree *subtree = read_one(data, size, &sub_name, &sub_len);
+        if (!subtree) {
+            cache_tree_free(tree);
+            return NULL;
+        }
+
+        struct cache_tree_sub *sub = find_subtree(tree, sub_name, sub_len, 1);
+        cache_tree_free(sub->tree);
+        sub->tree = subtree;
+    }
+
+    return tree;
+}
+
+// Parses the TREE extension, returns NULL if it is malformed in which case
+// every tree is simply rebuilt on the next write-tree
+struct cache_tree *read_cache_tree(const unsigned char *data, size_t size) {
+    const char *name;
+    size_t name_len;
+    struct cache_tree *tree = read_one(&data, &size, &name, &name_len);
+    if (tree && (name_len != 0 || size != 0)) {
+        cache_tree_free(tree);
+        return NULL;
+    }
+
+    return tree;
+}
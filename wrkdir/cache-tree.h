@@ -0,0 +1,44 @@
+#ifndef CACHE_TREE_H
+#define CACHE_TREE_H
+
+#include <stddef.h>
+
+#include "hash.h"
+#include "hashfile.h"
+
+struct git_index;
+
+// Tree hashes of every directory in the index as of the last write-tree,
+// persisted as the index's TREE extension. A directory whose entry_count is
+// -1 has changed since and has to be rebuilt.
+struct cache_tree {
+    int entry_count;
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    struct cache_tree_sub **subtrees;
+    int num_subtrees;
+    int alloc_subtrees;
+};
+
+struct cache_tree_sub {
+    struct cache_tree *tree;
+    int used;
+    size_t name_len;
+    char name[];
+};
+
+struct cache_tree *cache_tree_new(void);
+
+void cache_tree_free(struct cache_tree *tree);
+
+struct cache_tree *cache_tree_find(struct cache_tree *tree, const char *name,
+                                   size_t len);
+
+void cache_tree_invalidate_path(struct cache_tree *tree, const char *path);
+
+int cache_tree_update(struct git_index *index, int *trees_written);
+
+void write_cache_tree_extension(struct hashfile *f, struct cache_tree *tree);
+
+struct cache_tree *read_cache_tree(const unsigned char *data, size_t size);
+
+#endif
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cat-file.h"
+#include "hash.h"
+#include "object.h"
+#include "packfile.h"
+#include "tree.h"
+
+struct batch_input {
+    char *buf;
+    size_t pos;
+    size_t len;
+};
+
+// Reads the next line of stdin into line, dropping whatever does not fit.
+// Output is flushed before blocking on input so a caller that waits for each
+// answer before sending the next request is never left hanging. Returns -1
+// at the end of input.
+static int read_batch_line(struct batch_input *in, char *line, size_t cap) {
+    size_t len = 0;
+    int got = 0;
+    for (;;) {
+        if (in->pos == in->len) {
+            fflush(stdout);
+            ssize_t n = read(STDIN_FILENO, in->buf, BATCH_BUFFER_SIZE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            in->pos = 0;
+            in->len = n;
+        }
+
+        char c = in->buf[in->pos++];
+        got = 1;
+        if (c == '\n')
+            break;
+        if (len + 1 < cap)
+            line[len++] = c;
+    }
+
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' '))
+        len--;
+    line[len] = '\0';
+
+    return got ? 0 : -1;
+}
+
+// Prints "<hash> <type> <size>" and, with contents set, the object followed
+// by a newline. Loose objects are streamed through the one object stream
+// shared by the whole batch.
+static int batch_object(char *hash, int contents, struct object_stream *os,
+                        unsigned char *buf) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    int type;
+    size_t size;
+    if (strlen(hash) == hash_algo()->hexsz && !hex_to_sha1(hash, sha1) &&
+        !packed_object_info(sha1, &type, &size)) {
+        printf("%s %s %zu\n", hash, type_name(type), size);
+        if (!contents)
+            return 0;
+
+        unsigned char *data = read_packed_object(sha1, &type, &size);
+        if (!data)
+            return 1;
+        fwrite(data, 1, size, stdout);
+        putchar('\n');
+        free(data);
+
+        return 0;
+    }
+
+    int ret = reopen_object_stream(os, hash);
+    if (ret > 0) {
+        printf("%s missing\n", hash);
+        return 0;
+    }
+    if (ret < 0)
+        return 1;
+
+    printf("%s %s %zu\n", hash, os->type, os->size);
+    if (!contents)
+        return 0;
+
+    ssize_t len;
+    while ((len = read_object_stream(os, buf, OBJECT_CHUNK_SIZE)) > 0)
+        fwrite(buf, 1, len, stdout);
+    if (len < 0) {
+        fprintf(stderr, "Corrupt object %s\n", hash);
+        return 1;
+    }
+    putchar('\n');
+
+    return 0;
+}
+
+// Answers one object name per line of stdin until it ends, all through the
+// same output buffer, inflate state and pack mappings
+int cat_file_batch(int contents) {
+    static char out_buf[BATCH_BUFFER_SIZE];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    struct batch_input in = {malloc(BATCH_BUFFER_SIZE), 0, 0};
+    unsigned char *buf = malloc(OBJECT_CHUNK_SIZE);
+    struct object_stream os;
+    init_object_stream(&os);
+
+    char line[1024];
+    int ret = 0;
+    while (!ret && read_batch_line(&in, line, sizeof(line)) == 0) {
+        if (line[0] == '\0')
+            continue;
+        ret = batch_object(line, contents, &os, buf);
+    }
+
+    close_object_stream(&os);
+    free(buf);
+    free(in.buf);
+    if (fflush(stdout) != 0)
+        ret = 1;
+
+    return ret;
+}
+
+int cat_file(int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[2], "--batch"))
+        return cat_file_batch(1);
+    if (argc == 3 && !strcmp(argv[2], "--batch-check"))
+        return cat_file_batch(0);
+
+    if (argc != 3 || argv[2][0] == '-') {
+        fprintf(stderr, "Usage: %s cat-file <hash>\n", argv[0]);
+        fprintf(stderr, "       %s cat-file (--batch | --batch-check)\n",
+                argv[0]);
+        return 1;
+    }
+
+    return stream_object(argv[2], stdout);
+}
@@ -0,0 +1,13 @@
+#ifndef CAT_FILE_H
+#define CAT_FILE_H
+
+#include <stddef.h>
+
+// Input is read and output buffered in chunks of this size in batch mode
+#define BATCH_BUFFER_SIZE (128 * 1024)
+
+int cat_file_batch(int contents);
+
+int cat_file(int argc, char **argv);
+
+#endif
@@ -0,0 +1,897 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "blob.h"
+#include "cache-tree.h"
+#include "checkout.h"
+#include "commit.h"
+#include "diff-tree.h"
+#include "fsmonitor.h"
+#include "hashfile.h"
+#include "ignore.h"
+#include "index.h"
+#include "object.h"
+#include "revision.h"
+#include "thread-pool.h"
+#include "tree.h"
+#include "untracked-cache.h"
+
+// A directory files are written into. fd is opened relative to the parent's
+// and is -1 when it could not be, files then go in by their full path.
+struct checkout_dir {
+    char *path;
+    size_t len;
+    int fd;
+};
+
+// One file to write, entry is its position in the new index
+struct checkout_job {
+    size_t entry;
+    char *path;
+    size_t dir;
+    int failed;
+};
+
+// A path where the index differs from HEAD, with what HEAD has there. mode
+// is 0 when HEAD does not have the path.
+struct staged_path {
+    char *path;
+    uint32_t mode;
+    unsigned char sha1[GIT_MAX_RAWSZ];
+};
+
+struct path_list {
+    char **paths;
+    size_t num;
+    size_t alloc;
+};
+
+// entries is the new index being built in path order while the target
+// tree is walked alongside the old one. removed holds the paths of old
+// entries that go away, modified and untracked the paths checkout refuses
+// to overwrite. expendable holds ignored files in directories a file takes
+// the place of, and their directories with a trailing '/' after what they
+// contain. staged holds the paths the index changes from HEAD, sorted, and
+// kept the ones of those carried over as the target matches HEAD there.
+struct checkout_state {
+    struct git_index index;
+    struct git_index_entry *entries;
+    size_t num_entries;
+    size_t alloc_entries;
+    struct checkout_job *jobs;
+    size_t num_jobs;
+    size_t alloc_jobs;
+    struct checkout_dir *dirs;
+    size_t num_dirs;
+    struct path_list removed;
+    struct path_list modified;
+    struct path_list untracked;
+    struct path_list expendable;
+    struct staged_path *staged;
+    size_t num_staged;
+    size_t alloc_staged;
+    struct path_list kept;
+    struct ignore_tree *ignores;
+};
+
+static void push_path(struct path_list *list, char *path) {
+    if (list->num == list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 64;
+        list->paths = realloc(list->paths, list->alloc * sizeof(char *));
+    }
+    list->paths[list->num++] = path;
+}
+
+static void clear_paths(struct path_list *list) {
+    for (size_t i = 0; i < list->num; i++)
+        free(list->paths[i]);
+    free(list->paths);
+}
+
+static char *join_path(const char *base, size_t base_len, const char *name,
+                       size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    char *path = malloc(base_len + len + suffix_len + 1);
+    memcpy(path, base, base_len);
+    memcpy(path + base_len, name, len);
+    memcpy(path + base_len + len, suffix, suffix_len + 1);
+
+    return path;
+}
+
+static struct git_index_entry *push_entry(struct checkout_state *s) {
+    if (s->num_entries == s->alloc_entries) {
+        s->alloc_entries = s->alloc_entries ? s->alloc_entries * 2 : 1024;
+        s->entries =
+            realloc(s->entries, s->alloc_entries * sizeof(*s->entries));
+    }
+
+    return &s->entries[s->num_entries++];
+}
+
+static int add_staged_path(const struct tree_change *change, void *data) {
+    struct checkout_state *s = data;
+    if (s->num_staged == s->alloc_staged) {
+        s->alloc_staged = s->alloc_staged ? s->alloc_staged * 2 : 64;
+        s->staged = realloc(s->staged, s->alloc_staged * sizeof(*s->staged));
+    }
+    struct staged_path *staged = &s->staged[s->num_staged++];
+    staged->path = strdup(change->path);
+    staged->mode = change->old_mode;
+    if (change->old_sha1)
+        memcpy(staged->sha1, change->old_sha1, hash_algo()->rawsz);
+
+    return 0;
+}
+
+static int compare_staged_paths(const void *a, const void *b) {
+    return strcmp(((const struct staged_path *)a)->path,
+                  ((const struct staged_path *)b)->path);
+}
+
+// Finds the changes the index stages over HEAD, none for an unborn branch
+static int read_staged_paths(struct checkout_state *s) {
+    unsigned char head[GIT_MAX_RAWSZ];
+    struct commit_info info;
+    int ret;
+    if (resolve_revision("HEAD", head)) {
+        ret = diff_tree_index(NULL, &s->index, add_staged_path, s);
+    } else if (read_commit_info(head, &info)) {
+        return 1;
+    } else {
+        clear_commit_info(&info);
+        ret = diff_tree_index(info.tree, &s->index, add_staged_path, s);
+    }
+    qsort(s->staged, s->num_staged, sizeof(*s->staged), compare_staged_paths);
+
+    return ret;
+}
+
+static struct staged_path *find_staged(struct checkout_state *s,
+                                       const char *path) {
+    struct staged_path key = {(char *)path, 0, {0}};
+    return bsearch(&key, s->staged, s->num_staged, sizeof(*s->staged),
+                   compare_staged_paths);
+}
+
+// Whether the target has what HEAD has at a staged path
+static int matches_head(const struct staged_path *staged, uint32_t mode,
+                        const unsigned char *sha1) {
+    return staged->mode == mode &&
+           (!mode || !memcmp(staged->sha1, sha1, hash_algo()->rawsz));
+}
+
+// Whether the working tree still has what the entry records, so removing
+// or overwriting the file loses nothing. A file already gone is fine too.
+static int is_clean(struct checkout_state *s, struct git_index_entry *entry,
+                    char *path) {
+    if (entry->fsmonitor_valid)
+        return 1;
+
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT || errno == ENOTDIR;
+    if (S_ISLNK(st.st_mode) != (entry->mode == 120000) || S_ISDIR(st.st_mode))
+        return 0;
+    if (!entry_stat_changed(&s->index.header, entry, &st))
+        return 1;
+
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(path, target, sizeof(target));
+        if (len < 0)
+            return 0;
+        hash_object_data("blob", target, len, sha1);
+    } else if (blob_and_hash_file(path, sha1)) {
+        return 0;
+    }
+
+    return !memcmp(sha1, entry->sha1, hash_algo()->rawsz);
+}
+
+// Whether the directory at path holds tracked files, which go away as the
+// target has a file there
+static int has_tracked_files(struct checkout_state *s, const char *path) {
+    size_t len = strlen(path);
+    char *key = malloc(len + 2);
+    memcpy(key, path, len);
+    memcpy(key + len, "/", 2);
+    int found = index_has_dir(&s->index, key, len + 1);
+    free(key);
+
+    return found;
+}
+
+// Looks through a directory a file of the target takes the place of, as
+// its tracked files go away. Other files in it would be lost and count as
+// untracked files in the way, unless they are ignored.
+static void scan_replaced_dir(struct checkout_state *s, const char *path,
+                              int ignored) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        push_path(&s->untracked, strdup(path));
+        return;
+    }
+
+    size_t path_len = strlen(path);
+    char *dir_path = join_path(path, path_len, "", 0, "/");
+    struct ignore_dir *rules =
+        get_ignore_dir(s->ignores, dir_path, path_len + 1);
+    free(dir_path);
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char *name = dirent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        char *child = join_path(path, path_len, "/", 1, name);
+        struct stat st;
+        int is_dir = dirent->d_type == DT_DIR;
+        if (dirent->d_type == DT_UNKNOWN && lstat(child, &st) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+
+        int child_ignored = ignored;
+        if (!child_ignored) {
+            const struct ignore_rule *rule =
+                match_ignore_dir(rules, child, strlen(child), is_dir);
+            child_ignored = rule && !rule->negated;
+        }
+
+        if (is_dir) {
+            scan_replaced_dir(s, child, child_ignored);
+            push_path(&s->expendable,
+                      join_path(child, strlen(child), "", 0, "/"));
+            free(child);
+        } else if (index_pos(&s->index, child) >= 0) {
+            free(child);
+        } else if (child_ignored) {
+            push_path(&s->expendable, child);
+        } else {
+            push_path(&s->untracked, child);
+        }
+    }
+
+    closedir(dir);
+}
+
+// The target lacks the path of an old entry. As with git's two-way merge a
+// staged entry stays when HEAD lacks it too, and blocks checkout otherwise.
+static void remove_entry(struct checkout_state *s,
+                         struct git_index_entry *entry) {
+    char *path = index_entry_path(&s->index, entry);
+    struct staged_path *staged = find_staged(s, path);
+    if (staged && !staged->mode) {
+        *push_entry(s) = *entry;
+        push_path(&s->kept, strdup(path));
+        return;
+    }
+    if (staged || !is_clean(s, entry, path))
+        push_path(&s->modified, strdup(path));
+    push_path(&s->removed, strdup(path));
+}
+
+// Queues the target's blob at path to be written. Anything already there
+// has to be the old entry, replaced is then set, or a tracked directory
+// that goes away. A staged change at path stays when the target matches
+// HEAD there and blocks checkout otherwise, as with git's two-way merge.
+static int add_entry(struct checkout_state *s,
+                     const struct git_tree_entry *tree_entry, char *path,
+                     struct git_index_entry *replaced) {
+    if (tree_entry->mode != 100644 && tree_entry->mode != 100755 &&
+        tree_entry->mode != 120000) {
+        fprintf(stderr, "Unsupported mode %u for %s\n", tree_entry->mode,
+                path);
+        free(path);
+        return 1;
+    }
+
+    struct staged_path *staged = find_staged(s, path);
+    if (staged && matches_head(staged, tree_entry->mode, tree_entry->sha1)) {
+        if (replaced) {
+            *push_entry(s) = *replaced;
+            push_path(&s->kept, path);
+        } else {
+            free(path);
+        }
+        return 0;
+    }
+
+    struct stat st;
+    if (staged) {
+        push_path(&s->modified, strdup(path));
+    } else if (replaced) {
+        if (!is_clean(s, replaced, path))
+            push_path(&s->modified, strdup(path));
+    } else if (lstat(path, &st) == 0) {
+        if (!S_ISDIR(st.st_mode) || !has_tracked_files(s, path)) {
+            push_path(&s->untracked, strdup(path));
+        } else {
+            const struct ignore_rule *rule;
+            if (!s->ignores)
+                s->ignores = ignore_tree_new();
+            scan_replaced_dir(s, path,
+                              is_path_ignored(s->ignores, path, 1, &rule));
+        }
+    } else if (errno == ENOTDIR) {
+        // A file where the target has a directory has to be tracked, it is
+        // removed then
+        for (char *slash = strchr(path, '/'); slash;
+             slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            int in_way = lstat(path, &st) == 0 && !S_ISDIR(st.st_mode);
+            if (in_way && index_pos(&s->index, path) < 0)
+                push_path(&s->untracked, strdup(path));
+            *slash = '/';
+            if (in_way)
+                break;
+        }
+    }
+
+    struct git_index_entry *entry = push_entry(s);
+    memset(entry, 0, sizeof(*entry));
+    entry->mode = tree_entry->mode;
+    memcpy(entry->sha1, tree_entry->sha1, hash_algo()->rawsz);
+    entry->flags = INDEX_NAME_FLAGS(strlen(path));
+    entry->path = index_add_path(&s->index, path);
+
+    if (s->num_jobs == s->alloc_jobs) {
+        s->alloc_jobs = s->alloc_jobs ? s->alloc_jobs * 2 : 256;
+        s->jobs = realloc(s->jobs, s->alloc_jobs * sizeof(*s->jobs));
+    }
+    struct checkout_job *job = &s->jobs[s->num_jobs++];
+    job->entry = s->num_entries - 1;
+    job->path = path;
+    job->failed = 0;
+
+    return 0;
+}
+
+// Old entries of a directory being planned from a diff of trees, pos runs
+// up to end over the entries the cached tree covers
+struct plan_walk {
+    struct checkout_state *s;
+    size_t *pos;
+    size_t end;
+};
+
+// Takes over the old entries before path, all of them without one, as the
+// diff found them unchanged
+static void keep_entries(struct plan_walk *w, const char *path) {
+    struct git_index *index = &w->s->index;
+    while (*w->pos < w->end &&
+           (!path ||
+            strcmp(index_entry_path(index, &index->entries[*w->pos]), path) <
+                0))
+        *push_entry(w->s) = index->entries[(*w->pos)++];
+}
+
+static int plan_change(const struct tree_change *change, void *data) {
+    struct plan_walk *w = data;
+    struct checkout_state *s = w->s;
+    keep_entries(w, change->path);
+
+    struct git_index_entry *old = NULL;
+    if (change->old_mode) {
+        if (*w->pos == w->end ||
+            strcmp(index_entry_path(&s->index, &s->index.entries[*w->pos]),
+                   change->path) != 0) {
+            fprintf(stderr, "Cached tree does not match the index at %s\n",
+                    change->path);
+            return 1;
+        }
+        old = &s->index.entries[(*w->pos)++];
+    }
+
+    if (!change->new_mode) {
+        remove_entry(s, old);
+        return 0;
+    }
+
+    struct git_tree_entry entry = {change->new_mode, change->path,
+                                   strlen(change->path), change->new_sha1};
+    return add_entry(s, &entry, strdup(change->path), old);
+}
+
+// A directory the index has a valid cached tree for only needs the paths
+// where that tree and the target differ, which a diff of the two trees
+// finds without reading the subtrees they share. Returns -1 when the cached
+// tree cannot be used.
+static int plan_cached_tree(struct checkout_state *s,
+                            const unsigned char *sha1,
+                            struct cache_tree *cache, const char *base,
+                            size_t *pos) {
+    if (!cache || cache->entry_count < 0)
+        return -1;
+
+    struct plan_walk w = {s, pos, *pos + cache->entry_count};
+    if (!memcmp(cache->sha1, sha1, hash_algo()->rawsz)) {
+        keep_entries(&w, NULL);
+        return 0;
+    }
+    if (!has_object(cache->sha1))
+        return -1;
+
+    int ret = diff_trees(cache->sha1, sha1, base, 1, plan_change, &w);
+    if (!ret)
+        keep_entries(&w, NULL);
+
+    return ret;
+}
+
+// Walks the target tree for the directory base alongside the old index
+// entries from *pos on and builds the new entries, only entries that differ
+// get a job. Directories with a valid cached tree in the index are planned
+// from a diff of trees instead.
+static int plan_tree(struct checkout_state *s, const unsigned char *sha1,
+                     struct cache_tree *cache, char *base, size_t base_len,
+                     size_t *pos) {
+    struct git_index *index = &s->index;
+    size_t num_entries = index->header.entries;
+    size_t size, rawsz = hash_algo()->rawsz;
+    char *buf = read_tree_object(sha1, &size);
+    if (!buf)
+        return 1;
+
+    struct tree_desc desc;
+    struct git_tree_entry entry;
+    init_tree_desc(&desc, buf, size);
+    int has_entry = next_tree_entry(&desc, &entry);
+
+    int ret = 0;
+    while (!ret && has_entry >= 0) {
+        char *path = NULL, *slash = NULL;
+        size_t len = 0;
+        if (*pos < num_entries) {
+            path = index_entry_path(index, &index->entries[*pos]);
+            if (strncmp(path, base, base_len) != 0)
+                path = NULL;
+        }
+        if (path) {
+            path += base_len;
+            slash = strchr(path, '/');
+            len = slash ? (size_t)(slash - path) : strlen(path);
+        }
+        if (!path && !has_entry)
+            break;
+
+        int cmp = !path        ? 1
+                  : !has_entry ? -1
+                               : compare_tree_names(path, len, slash != NULL,
+                                                    entry.path, entry.path_len,
+                                                    entry.mode == 40000);
+        if (cmp < 0) {
+            // Gone from the target, with everything below it for a directory
+            char *prefix = path - base_len;
+            size_t prefix_len = base_len + len + (slash != NULL);
+            do {
+                remove_entry(s, &index->entries[(*pos)++]);
+            } while (slash && *pos < num_entries &&
+                     !strncmp(index_entry_path(index, &index->entries[*pos]),
+                              prefix, prefix_len));
+            continue;
+        }
+
+        if (cmp > 0 && entry.mode == 40000) {
+            char *sub =
+                join_path(base, base_len, entry.path, entry.path_len, "/");
+            ret = plan_tree(s, entry.sha1, NULL, sub,
+                            base_len + entry.path_len + 1, pos);
+            free(sub);
+        } else if (cmp > 0) {
+            ret = add_entry(
+                s, &entry,
+                join_path(base, base_len, entry.path, entry.path_len, ""),
+                NULL);
+        } else if (slash) {
+            struct cache_tree *sub = cache_tree_find(cache, path, len);
+            char *sub_base = join_path(base, base_len, path, len, "/");
+            ret = plan_cached_tree(s, entry.sha1, sub, sub_base, pos);
+            if (ret < 0)
+                ret = plan_tree(s, entry.sha1, sub, sub_base,
+                                base_len + len + 1, pos);
+            free(sub_base);
+        } else {
+            struct git_index_entry *ie = &index->entries[(*pos)++];
+            if (ie->mode == entry.mode && !memcmp(ie->sha1, entry.sha1, rawsz))
+                *push_entry(s) = *ie;
+            else
+                ret = add_entry(s, &entry, strdup(path - base_len), ie);
+        }
+
+        has_entry = next_tree_entry(&desc, &entry);
+    }
+    free(buf);
+
+    if (has_entry < 0) {
+        fprintf(stderr, "Corrupt tree under %s\n", base_len ? base : ".");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+// A staged entry that stays must not take the place of a directory of the
+// target's entries, nor lie below one of its files
+static void check_kept_entries(struct checkout_state *s) {
+    struct git_index planned = s->index;
+    planned.entries = s->entries;
+    planned.header.entries = s->num_entries;
+
+    for (size_t i = 0; i < s->kept.num; i++) {
+        char *path = s->kept.paths[i];
+        char *key = join_path(path, strlen(path), "", 0, "/");
+        int conflict = index_has_dir(&planned, key, strlen(key));
+        free(key);
+
+        for (char *slash = strchr(path, '/'); slash && !conflict;
+             slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            conflict = index_pos(&planned, path) >= 0;
+            *slash = '/';
+        }
+        if (conflict)
+            push_path(&s->modified, strdup(path));
+    }
+}
+
+static void report_conflicts(struct path_list *list, const char *what) {
+    if (!list->num)
+        return;
+
+    fprintf(stderr, "%s would be overwritten by checkout:\n", what);
+    for (size_t i = 0; i < list->num; i++)
+        fprintf(stderr, "\t%s\n", list->paths[i]);
+}
+
+// Deletes the files of removed entries and the expendable files and
+// directories, then every directory that was left empty, deepest first
+static int remove_files(struct path_list *removed,
+                        struct path_list *expendable) {
+    int ret = 0;
+    for (size_t i = 0; i < removed->num; i++) {
+        if (unlink(removed->paths[i]) != 0 && errno != ENOENT) {
+            perror(removed->paths[i]);
+            ret = 1;
+        }
+    }
+
+    for (size_t i = 0; i < expendable->num; i++) {
+        char *path = expendable->paths[i];
+        int is_dir = path[strlen(path) - 1] == '/';
+        if ((is_dir ? rmdir(path) : unlink(path)) != 0 && errno != ENOENT) {
+            perror(path);
+            ret = 1;
+        }
+    }
+
+    for (size_t i = removed->num; i-- > 0;) {
+        char *path = removed->paths[i], *slash;
+        while ((slash = strrchr(path, '/'))) {
+            *slash = '\0';
+            if (rmdir(path) != 0 && errno != ENOENT)
+                break;
+        }
+    }
+
+    return ret;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static size_t find_dir(struct checkout_state *s, const char *path,
+                       size_t len) {
+    size_t low = 0, high = s->num_dirs;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strncmp(s->dirs[mid].path, path, len);
+        if (cmp == 0)
+            cmp = s->dirs[mid].path[len] != '\0';
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return SIZE_MAX;
+}
+
+// Creates every directory the jobs write into, parents first, and opens
+// each relative to its parent so the workers never resolve a full path.
+// The soft limit on open files is raised first as there is one per
+// directory.
+static int create_dirs(struct checkout_state *s) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Every job's directory and the directories above it, without the
+    // repeats consecutive jobs in one directory would bring
+    struct path_list names = {NULL, 0, 0};
+    push_path(&names, strdup(""));
+    const char *last = NULL;
+    size_t last_len = 0;
+    for (size_t i = 0; i < s->num_jobs; i++) {
+        char *path = s->jobs[i].path, *slash = strrchr(path, '/');
+        size_t len = slash ? (size_t)(slash - path) : 0;
+        if (last && len == last_len && !strncmp(path, last, len))
+            continue;
+        last = path;
+        last_len = len;
+        for (size_t j = 0; j < len; j++)
+            if (path[j] == '/')
+                push_path(&names, strndup(path, j));
+        if (len)
+            push_path(&names, strndup(path, len));
+    }
+    qsort(names.paths, names.num, sizeof(char *), compare_strings);
+
+    s->dirs = malloc(names.num * sizeof(*s->dirs));
+    for (size_t i = 0; i < names.num; i++) {
+        if (s->num_dirs && !strcmp(s->dirs[s->num_dirs - 1].path,
+                                   names.paths[i])) {
+            free(names.paths[i]);
+            continue;
+        }
+        s->dirs[s->num_dirs].path = names.paths[i];
+        s->dirs[s->num_dirs].len = strlen(names.paths[i]);
+        s->dirs[s->num_dirs++].fd = -1;
+    }
+    free(names.paths);
+
+    int ret = 0;
+    s->dirs[0].fd = AT_FDCWD;
+    for (size_t i = 1; i < s->num_dirs; i++) {
+        struct checkout_dir *dir = &s->dirs[i];
+        char *slash = strrchr(dir->path, '/');
+        size_t parent = slash ? find_dir(s, dir->path, slash - dir->path) : 0;
+        int parent_fd = s->dirs[parent].fd;
+        const char *name = parent_fd < 0 || parent_fd == AT_FDCWD
+                               ? dir->path
+                               : slash + 1;
+        if (parent_fd < 0)
+            parent_fd = AT_FDCWD;
+
+        if (mkdirat(parent_fd, name, 0777) != 0 && errno != EEXIST) {
+            perror(dir->path);
+            ret = 1;
+            continue;
+        }
+        dir->fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (dir->fd < 0 && errno != EMFILE && errno != ENFILE) {
+            perror(dir->path);
+            ret = 1;
+        }
+    }
+
+    for (size_t i = 0; i < s->num_jobs; i++) {
+        char *path = s->jobs[i].path, *slash = strrchr(path, '/');
+        s->jobs[i].dir = slash ? find_dir(s, path, slash - path) : 0;
+    }
+
+    return ret;
+}
+
+// Inflates one blob straight into its file, or makes the symlink it holds,
+// and records the fresh stat data in its new entry
+static void checkout_job(size_t i, void *data) {
+    struct checkout_state *s = data;
+    struct checkout_job *job = &s->jobs[i];
+    struct git_index_entry *entry = &s->entries[job->entry];
+    struct checkout_dir *dir = &s->dirs[job->dir];
+    int dir_fd = dir->fd < 0 ? AT_FDCWD : dir->fd;
+    const char *name =
+        dir_fd == AT_FDCWD ? job->path : job->path + dir->len + 1;
+
+    char hex[GIT_MAX_HEXSZ + 1];
+    sha1_to_hex(entry->sha1, hex);
+    if (unlinkat(dir_fd, name, 0) != 0 && errno != ENOENT) {
+        job->failed = 1;
+        return;
+    }
+
+    struct stat st;
+    if (entry->mode == 120000) {
+        char type[16];
+        size_t size;
+        char *target = retrieve_object(hex, type, &size);
+        job->failed = !target || strcmp(type, "blob") != 0 ||
+                      symlinkat(target, dir_fd, name) != 0 ||
+                      fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0;
+        free(target);
+    } else {
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW,
+                        entry->mode == 100755 ? 0777 : 0666);
+        FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        job->failed = !out || stream_object(hex, out) || fflush(out) != 0 ||
+                      fstat(fd, &st) != 0;
+        if (out)
+            job->failed |= fclose(out) != 0;
+        else if (fd >= 0)
+            close(fd);
+    }
+
+    // A half-written file would only be in the way of trying again
+    if (job->failed)
+        unlinkat(dir_fd, name, 0);
+    else
+        fill_index_stat(entry, &st);
+}
+
+// Points HEAD at the branch that was checked out, or at the commit itself
+// when it was not named by a branch
+static int update_head(const char *name, const unsigned char *commit) {
+    char path[PATH_MAX], lock_path[PATH_MAX], hex[GIT_MAX_HEXSZ + 1];
+    snprintf(path, sizeof(path), ".gblimi/refs/heads/%s", name);
+    int is_branch = !strstr(name, "..") && access(path, F_OK) == 0;
+
+    int fd = hold_lock_file(".gblimi/HEAD", lock_path, sizeof(lock_path));
+    if (fd < 0)
+        return 1;
+
+    FILE *head = fdopen(fd, "w");
+    sha1_to_hex(commit, hex);
+    if (is_branch)
+        fprintf(head, "ref: refs/heads/%s\n", name);
+    else
+        fprintf(head, "%s\n", hex);
+    if (fclose(head) != 0 || rename(lock_path, ".gblimi/HEAD") != 0) {
+        fprintf(stderr, "Failed to write .gblimi/HEAD\n");
+        unlink(lock_path);
+        return 1;
+    }
+
+    if (is_branch)
+        printf("Switched to branch '%s'\n", name);
+    else
+        printf("HEAD is now at %s\n", hex);
+
+    return 0;
+}
+
+static void free_checkout_state(struct checkout_state *s) {
+    for (size_t i = 0; i < s->num_jobs; i++)
+        free(s->jobs[i].path);
+    free(s->jobs);
+    for (size_t i = 0; i < s->num_dirs; i++) {
+        if (s->dirs[i].fd >= 0)
+            close(s->dirs[i].fd);
+        free(s->dirs[i].path);
+    }
+    free(s->dirs);
+    free(s->entries);
+    clear_paths(&s->removed);
+    clear_paths(&s->modified);
+    clear_paths(&s->untracked);
+    clear_paths(&s->expendable);
+    for (size_t i = 0; i < s->num_staged; i++)
+        free(s->staged[i].path);
+    free(s->staged);
+    clear_paths(&s->kept);
+    if (s->ignores)
+        ignore_tree_free(s->ignores);
+    discard_index(&s->index);
+}
+
+// checkout <tree-or-commit> makes the index and the working tree match the
+// target. Only paths that differ from the index are touched: their blobs
+// are inflated and written on the worker pool, the index is rebuilt in one
+// pass with the fresh stat data, and HEAD moves when a commit was given.
+// Nothing is changed when that would lose local modifications, staged ones
+// included when a commit is checked out.
+int checkout(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s checkout <tree-or-commit>\n", argv[0]);
+        return 1;
+    }
+
+    unsigned char oid[GIT_MAX_RAWSZ], tree[GIT_MAX_RAWSZ];
+    if (get_tree_oid(argv[2], oid, tree))
+        return 1;
+    int is_commit = memcmp(oid, tree, hash_algo()->rawsz) != 0;
+
+    // The index stays locked from reading it to writing the new one
+    char lock_path[64];
+    int lock_fd = hold_lock_file(".gblimi/index", lock_path, sizeof(lock_path));
+    if (lock_fd < 0)
+        return 1;
+
+    struct checkout_state s;
+    memset(&s, 0, sizeof(s));
+    int loaded = read_index(&s.index);
+    int ret = loaded == 1;
+    size_t pos = 0;
+    if (!ret) {
+        sort_entries(&s.index);
+        refresh_fsmonitor(&s.index);
+        // Moving HEAD keeps what is staged on top of it as git's two-way
+        // merge does. A tree leaves HEAD alone and replaces the index, as
+        // does an initial checkout without an index file.
+        if (is_commit && loaded != 2)
+            ret = read_staged_paths(&s);
+    }
+    if (!ret) {
+        ret = plan_cached_tree(&s, tree, s.index.cache_tree, "", &pos);
+        if (ret < 0)
+            ret = plan_tree(&s, tree, s.index.cache_tree, "", 0, &pos);
+    }
+    if (!ret)
+        check_kept_entries(&s);
+    report_conflicts(&s.modified, "Your local changes to these files");
+    report_conflicts(&s.untracked, "Untracked working tree files");
+    if (ret || s.modified.num || s.untracked.num)
+        goto rollback;
+
+    for (size_t i = 0; i < s.removed.num; i++) {
+        cache_tree_invalidate_path(s.index.cache_tree, s.removed.paths[i]);
+        untracked_cache_invalidate_path(s.index.untracked, s.removed.paths[i],
+                                        UNTRACKED_VALID);
+    }
+    for (size_t i = 0; i < s.num_jobs; i++) {
+        cache_tree_invalidate_path(s.index.cache_tree, s.jobs[i].path);
+        untracked_cache_invalidate_path(s.index.untracked, s.jobs[i].path,
+                                        UNTRACKED_VALID);
+    }
+
+    ret = remove_files(&s.removed, &s.expendable);
+    ret |= create_dirs(&s);
+    run_parallel(s.num_jobs, checkout_job, &s);
+    for (size_t i = 0; i < s.num_jobs; i++) {
+        if (s.jobs[i].failed) {
+            fprintf(stderr, "Failed to check out %s\n", s.jobs[i].path);
+            ret = 1;
+        }
+    }
+    // The old index and HEAD stay, status then shows what did change
+    if (ret)
+        goto rollback;
+
+    free(s.index.entries);
+    s.index.entries = s.entries;
+    s.index.header.entries = s.num_entries;
+    s.entries = NULL;
+
+    // The index now holds the target's tree, with its cached trees brought
+    // up to date the next checkout or status can diff trees right away
+    int trees_written = 0;
+    if (!s.index.cache_tree)
+        s.index.cache_tree = cache_tree_new();
+    cache_tree_update(&s.index, &trees_written);
+
+    struct hashfile f;
+    hashfile_init(&f, lock_fd);
+    write_index(&f, &s.index);
+    ret = commit_lock_file(&f, lock_path, ".gblimi/index");
+
+    if (!ret && is_commit)
+        ret = update_head(argv[2], oid);
+
+    free_checkout_state(&s);
+
+    return ret;
+
+rollback:
+    close(lock_fd);
+    unlink(lock_path);
+    free_checkout_state(&s);
+
+    return 1;
+}
@@ -0,0 +1,6 @@
+#ifndef CHECKOUT_H
+#define CHECKOUT_H
+
+int checkout(int argc, char **argv);
+
+#endif
@@ -0,0 +1,630 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commit-graph.h"
+#include "commit.h"
+#include "config.h"
+#include "hash.h"
+#include "hashfile.h"
+#include "object.h"
+#include "oidmap.h"
+#include "packfile.h"
+#include "parse-options.h"
+#include "tree.h"
+#include "uint-util.h"
+
+static struct commit_graph *commit_graph_file;
+static pthread_once_t commit_graph_once = PTHREAD_ONCE_INIT;
+
+// Version byte of the object format in the commit-graph header
+static int graph_hash_version(void) {
+    return hash_algo()->rawsz == GIT_SHA256_RAWSZ ? 2 : 1;
+}
+
+static uint64_t get_be64(const unsigned char *buf) {
+    return (uint64_t)get_be32(buf) << 32 | get_be32(buf + 4);
+}
+
+// Finds the chunks through the table of contents after the header and checks
+// that their sizes agree with the number of commits
+static int parse_commit_graph(struct commit_graph *graph) {
+    const unsigned char *map = graph->map;
+    size_t size = graph->map_size, rawsz = graph->rawsz;
+    if (size < GRAPH_HEADER_SIZE + 12 + rawsz ||
+        get_be32(map) != GRAPH_SIGNATURE || map[4] != GRAPH_VERSION ||
+        map[5] != graph_hash_version() || map[7] != 0)
+        return 1;
+
+    int num_chunks = map[6];
+    if (size < GRAPH_HEADER_SIZE + (num_chunks + 1) * 12 + rawsz)
+        return 1;
+
+    const unsigned char *toc = map + GRAPH_HEADER_SIZE;
+    size_t fanout_size = 0, oids_size = 0, data_size = 0, edges_size = 0;
+    for (int i = 0; i < num_chunks; i++, toc += 12) {
+        uint64_t offset = get_be64(toc + 4), next = get_be64(toc + 16);
+        if (offset > next || next > size - rawsz)
+            return 1;
+
+        const unsigned char *chunk = map + offset;
+        size_t len = next - offset;
+        switch (get_be32(toc)) {
+        case GRAPH_CHUNKID_OIDFANOUT:
+            graph->fanout = chunk;
+            fanout_size = len;
+            break;
+        case GRAPH_CHUNKID_OIDLOOKUP:
+            graph->oids = chunk;
+            oids_size = len;
+            break;
+        case GRAPH_CHUNKID_DATA:
+            graph->data = chunk;
+            data_size = len;
+            break;
+        case GRAPH_CHUNKID_EXTRAEDGES:
+            graph->edges = chunk;
+            edges_size = len;
+            break;
+        }
+    }
+
+    if (!graph->fanout || fanout_size != 256 * 4 || !graph->oids ||
+        !graph->data)
+        return 1;
+
+    size_t n = graph->num_commits = get_be32(graph->fanout + 255 * 4);
+    if (n >= GRAPH_PARENT_NONE || oids_size != n * rawsz ||
+        data_size != n * (rawsz + 16) || edges_size % 4)
+        return 1;
+    graph->num_edges = edges_size / 4;
+
+    return 0;
+}
+
+static struct commit_graph *open_commit_graph(void) {
+    int fd = open(COMMIT_GRAPH_PATH, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct commit_graph *graph = calloc(1, sizeof(struct commit_graph));
+    graph->map = map;
+    graph->map_size = st.st_size;
+    graph->rawsz = hash_algo()->rawsz;
+    if (parse_commit_graph(graph)) {
+        fprintf(stderr, "Ignoring unusable %s\n", COMMIT_GRAPH_PATH);
+        munmap(map, st.st_size);
+        free(graph);
+        return NULL;
+    }
+
+    return graph;
+}
+
+static void close_commit_graph(struct commit_graph *graph) {
+    if (!graph)
+        return;
+
+    munmap((void *)graph->map, graph->map_size);
+    free(graph);
+}
+
+// Set core.commitGraph to false to neither read nor update the commit-graph
+int commit_graph_enabled(void) {
+    char *value = get_config("core.commitGraph");
+    int enabled = !value || strcmp(value, "false") != 0;
+    free(value);
+
+    return enabled;
+}
+
+static void load_commit_graph(void) {
+    if (commit_graph_enabled())
+        commit_graph_file = open_commit_graph();
+}
+
+// The commit-graph is mapped once for the life of the process, NULL when
+// there is none
+struct commit_graph *get_commit_graph(void) {
+    pthread_once(&commit_graph_once, load_commit_graph);
+    return commit_graph_file;
+}
+
+// Looks sha1 up in the sorted id table, narrowed down by the fanout
+int commit_graph_pos(const struct commit_graph *graph,
+                     const unsigned char *sha1, uint32_t *pos) {
+    size_t rawsz = graph->rawsz;
+    uint32_t low = sha1[0] ? get_be32(graph->fanout + (sha1[0] - 1) * 4) : 0;
+    uint32_t high = get_be32(graph->fanout + sha1[0] * 4);
+    if (high > graph->num_commits)
+        high = graph->num_commits;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int cmp = memcmp(graph->oids + (size_t)mid * rawsz, sha1, rawsz);
+        if (cmp == 0) {
+            *pos = mid;
+            return 1;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return 0;
+}
+
+const unsigned char *commit_graph_oid(const struct commit_graph *graph,
+                                      uint32_t pos) {
+    return graph->oids + (size_t)pos * graph->rawsz;
+}
+
+static const unsigned char *commit_data(const struct commit_graph *graph,
+                                        uint32_t pos) {
+    return graph->data + (size_t)pos * (graph->rawsz + 16);
+}
+
+const unsigned char *commit_graph_tree(const struct commit_graph *graph,
+                                       uint32_t pos) {
+    return commit_data(graph, pos);
+}
+
+uint32_t commit_graph_generation(const struct commit_graph *graph,
+                                 uint32_t pos) {
+    return get_be32(commit_data(graph, pos) + graph->rawsz + 8) >> 2;
+}
+
+// The date is 34 bits, the top two share a word with the generation
+int64_t commit_graph_date(const struct commit_graph *graph, uint32_t pos) {
+    const unsigned char *data = commit_data(graph, pos) + graph->rawsz + 8;
+    return (int64_t)(get_be32(data) & 3) << 32 | get_be32(data + 4);
+}
+
+// Finds the position of the nth parent of the commit at pos. The first two
+// are in the record itself, with more than two parents the second slot
+// points into the extra edge list holding every parent after the first.
+// Returns 1 for a parent, 0 when there is no nth parent and -1 if the graph
+// is corrupt.
+int commit_graph_parent(const struct commit_graph *graph, uint32_t pos, int n,
+                        uint32_t *parent) {
+    const unsigned char *data = commit_data(graph, pos) + graph->rawsz;
+    uint32_t value = get_be32(data + (n ? 4 : 0));
+
+    if (n && (value & GRAPH_EXTRA_EDGES_NEEDED)) {
+        size_t edge = value & ~GRAPH_EXTRA_EDGES_NEEDED;
+        for (int i = 1;; i++, edge++) {
+            if (edge >= graph->num_edges)
+                return -1;
+            value = get_be32(graph->edges + edge * 4);
+            if (i == n)
+                break;
+            if (value & GRAPH_LAST_EDGE)
+                return 0;
+        }
+        value &= ~GRAPH_LAST_EDGE;
+    } else if (n > 1) {
+        return 0;
+    }
+
+    if (value == GRAPH_PARENT_NONE)
+        return 0;
+    if (value >= graph->num_commits)
+        return -1;
+
+    *parent = value;
+    return 1;
+}
+
+struct graph_entry {
+    unsigned char oid[GIT_MAX_RAWSZ];
+    unsigned char tree[GIT_MAX_RAWSZ];
+    unsigned char *parents;
+    int num_parents;
+    int64_t date;
+
+    uint32_t pos;
+    uint32_t generation;
+};
+
+struct graph_list {
+    struct graph_entry **entries;
+    size_t num_entries;
+    size_t alloc_entries;
+    struct oidmap map;
+};
+
+static struct graph_entry *add_graph_entry(struct graph_list *list,
+                                           const unsigned char *oid) {
+    if (list->num_entries == list->alloc_entries) {
+        list->alloc_entries =
+            list->alloc_entries ? list->alloc_entries * 2 : 64;
+        list->entries = realloc(list->entries, list->alloc_entries *
+                                                   sizeof(*list->entries));
+    }
+
+    struct graph_entry *entry = calloc(1, sizeof(struct graph_entry));
+    memcpy(entry->oid, oid, hash_algo()->rawsz);
+    list->entries[list->num_entries++] = entry;
+    oidmap_put(&list->map, entry->oid, entry);
+
+    return entry;
+}
+
+// Every commit of the current graph is carried over as is, so only commits
+// that are new to the graph have to be read from the object store
+static int add_graph_commits(struct graph_list *list,
+                             const struct commit_graph *graph) {
+    size_t rawsz = graph->rawsz;
+    for (uint32_t pos = 0; pos < graph->num_commits; pos++) {
+        struct graph_entry *entry =
+            add_graph_entry(list, commit_graph_oid(graph, pos));
+        memcpy(entry->tree, commit_graph_tree(graph, pos), rawsz);
+        entry->date = commit_graph_date(graph, pos);
+
+        uint32_t parent;
+        int ret;
+        while ((ret = commit_graph_parent(graph, pos, entry->num_parents,
+                                          &parent)) > 0) {
+            entry->parents = realloc(entry->parents,
+                                     (entry->num_parents + 1) * rawsz);
+            memcpy(entry->parents + entry->num_parents++ * rawsz,
+                   commit_graph_oid(graph, parent), rawsz);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Corrupt %s\n", COMMIT_GRAPH_PATH);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Reads the tips and all their ancestors that are not in the list yet
+static int add_new_commits(struct graph_list *list, const unsigned char *tips,
+                           size_t num_tips) {
+    size_t rawsz = hash_algo()->rawsz;
+    size_t num = num_tips, alloc = num_tips + 64;
+    unsigned char *stack = malloc(alloc * rawsz);
+    memcpy(stack, tips, num_tips * rawsz);
+
+    int ret = 0;
+    while (!ret && num > 0) {
+        const unsigned char *oid = stack + --num * rawsz;
+        if (oidmap_get(&list->map, oid))
+            continue;
+
+        struct commit_info info;
+        if (read_commit_info(oid, &info)) {
+            ret = 1;
+            break;
+        }
+
+        struct graph_entry *entry = add_graph_entry(list, oid);
+        memcpy(entry->tree, info.tree, rawsz);
+        entry->parents = info.parents;
+        entry->num_parents = info.num_parents;
+        entry->date = info.date;
+
+        if (num + info.num_parents > alloc) {
+            alloc = (num + info.num_parents) * 2;
+            stack = realloc(stack, alloc * rawsz);
+        }
+        for (int i = 0; i < info.num_parents; i++)
+            if (!oidmap_get(&list->map, info.parents + i * rawsz))
+                memcpy(stack + num++ * rawsz, info.parents + i * rawsz,
+                       rawsz);
+    }
+
+    free(stack);
+
+    return ret;
+}
+
+static int compare_graph_entries(const void *a, const void *b) {
+    const struct graph_entry *x = *(const struct graph_entry **)a;
+    const struct graph_entry *y = *(const struct graph_entry **)b;
+    return memcmp(x->oid, y->oid, hash_algo()->rawsz);
+}
+
+static struct graph_entry *graph_parent(struct graph_list *list,
+                                        struct graph_entry *entry, int n) {
+    return oidmap_get(&list->map, entry->parents + n * hash_algo()->rawsz);
+}
+
+// A commit's generation is one more than the highest of its parents'. The
+// walk uses its own stack since histories are far deeper than the C stack.
+static void compute_generations(struct graph_list *list) {
+    size_t num = 0, alloc = 64;
+    struct graph_entry **stack = malloc(alloc * sizeof(*stack));
+
+    for (size_t i = 0; i < list->num_entries; i++) {
+        if (list->entries[i]->generation)
+            continue;
+
+        stack[num++] = list->entries[i];
+        while (num > 0) {
+            struct graph_entry *entry = stack[num - 1];
+            if (entry->generation) {
+                num--;
+                continue;
+            }
+
+            uint32_t max = 0;
+            int ready = 1;
+            for (int p = 0; p < entry->num_parents; p++) {
+                struct graph_entry *parent = graph_parent(list, entry, p);
+                if (parent->generation) {
+                    if (parent->generation > max)
+                        max = parent->generation;
+                    continue;
+                }
+
+                ready = 0;
+                if (num == alloc)
+                    stack = realloc(stack, (alloc *= 2) * sizeof(*stack));
+                stack[num++] = parent;
+            }
+
+            if (ready) {
+                entry->generation =
+                    max < GENERATION_NUMBER_MAX ? max + 1 : max;
+                num--;
+            }
+        }
+    }
+
+    free(stack);
+}
+
+static void write_chunk_id(struct hashfile *f, uint32_t id, uint64_t offset) {
+    hashfile_be32(f, id);
+    hashfile_be32(f, offset >> 32);
+    hashfile_be32(f, offset);
+}
+
+// Writes the header, the table of contents and the fanout, id, data and
+// extra edge chunks of the sorted list through the lock file
+static int write_graph_file(struct graph_list *list) {
+    size_t rawsz = hash_algo()->rawsz, n = list->num_entries;
+    size_t num_edges = 0;
+    for (size_t i = 0; i < n; i++)
+        if (list->entries[i]->num_parents > 2)
+            num_edges += list->entries[i]->num_parents - 1;
+
+    mkdir(".gblimi/objects/info", 0777);
+    char lock_path[64];
+    int fd = hold_lock_file(COMMIT_GRAPH_PATH, lock_path, sizeof(lock_path));
+    if (fd < 0)
+        return 1;
+
+    struct hashfile f;
+    hashfile_init(&f, fd);
+
+    int num_chunks = num_edges ? 4 : 3;
+    unsigned char header[4] = {GRAPH_VERSION, graph_hash_version(),
+                               num_chunks, 0};
+    hashfile_be32(&f, GRAPH_SIGNATURE);
+    hashfile_write(&f, header, 4);
+
+    uint64_t offset = GRAPH_HEADER_SIZE + (num_chunks + 1) * 12;
+    write_chunk_id(&f, GRAPH_CHUNKID_OIDFANOUT, offset);
+    offset += 256 * 4;
+    write_chunk_id(&f, GRAPH_CHUNKID_OIDLOOKUP, offset);
+    offset += n * rawsz;
+    write_chunk_id(&f, GRAPH_CHUNKID_DATA, offset);
+    offset += n * (rawsz + 16);
+    if (num_edges) {
+        write_chunk_id(&f, GRAPH_CHUNKID_EXTRAEDGES, offset);
+        offset += num_edges * 4;
+    }
+    write_chunk_id(&f, 0, offset);
+
+    size_t count = 0;
+    for (int byte = 0; byte < 256; byte++) {
+        while (count < n && list->entries[count]->oid[0] == byte)
+            count++;
+        hashfile_be32(&f, count);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        hashfile_write(&f, list->entries[i]->oid, rawsz);
+
+    uint32_t edge = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct graph_entry *entry = list->entries[i];
+        hashfile_write(&f, entry->tree, rawsz);
+
+        hashfile_be32(&f, entry->num_parents > 0
+                              ? graph_parent(list, entry, 0)->pos
+                              : GRAPH_PARENT_NONE);
+        if (entry->num_parents > 2) {
+            hashfile_be32(&f, GRAPH_EXTRA_EDGES_NEEDED | edge);
+            edge += entry->num_parents - 1;
+        } else {
+            hashfile_be32(&f, entry->num_parents > 1
+                                  ? graph_parent(list, entry, 1)->pos
+                                  : GRAPH_PARENT_NONE);
+        }
+
+        uint64_t date = entry->date > 0 ? entry->date : 0;
+        hashfile_be32(&f, entry->generation << 2 | (date >> 32 & 3));
+        hashfile_be32(&f, date);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        struct graph_entry *entry = list->entries[i];
+        for (int p = 1; entry->num_parents > 2 && p < entry->num_parents;
+             p++)
+            hashfile_be32(&f, graph_parent(list, entry, p)->pos |
+                                  (p == entry->num_parents - 1
+                                       ? GRAPH_LAST_EDGE
+                                       : 0));
+    }
+
+    return commit_lock_file(&f, lock_path, COMMIT_GRAPH_PATH);
+}
+
+// Rewrites the commit-graph with the commits it already has plus the tips
+// and whatever of their history it is missing
+int write_commit_graph(const unsigned char *tips, size_t num_tips) {
+    struct graph_list list = {NULL, 0, 0, {NULL, 0, 0}};
+    oidmap_init(&list.map);
+
+    struct commit_graph *graph = open_commit_graph();
+    int ret = graph ? add_graph_commits(&list, graph) : 0;
+    close_commit_graph(graph);
+
+    if (!ret)
+        ret = add_new_commits(&list, tips, num_tips);
+
+    if (!ret) {
+        qsort(list.entries, list.num_entries, sizeof(*list.entries),
+              compare_graph_entries);
+        for (size_t i = 0; i < list.num_entries; i++) {
+            struct graph_entry *entry = list.entries[i];
+            entry->pos = i;
+            for (int p = 0; !ret && p < entry->num_parents; p++) {
+                if (graph_parent(&list, entry, p))
+                    continue;
+                char hex[GIT_MAX_HEXSZ + 1];
+                sha1_to_hex(entry->oid, hex);
+                fprintf(stderr, "Parent of %s is not in the graph\n", hex);
+                ret = 1;
+            }
+        }
+    }
+
+    if (!ret) {
+        compute_generations(&list);
+        ret = write_graph_file(&list);
+    }
+
+    for (size_t i = 0; i < list.num_entries; i++) {
+        free(list.entries[i]->parents);
+        free(list.entries[i]);
+    }
+    free(list.entries);
+    oidmap_clear(&list.map);
+
+    return ret;
+}
+
+struct oid_array {
+    unsigned char *oids;
+    size_t num;
+    size_t alloc;
+};
+
+static void oid_array_append(struct oid_array *array,
+                             const unsigned char *oid) {
+    size_t rawsz = hash_algo()->rawsz;
+    if (array->num == array->alloc) {
+        array->alloc = array->alloc ? array->alloc * 2 : 64;
+        array->oids = realloc(array->oids, array->alloc * rawsz);
+    }
+    memcpy(array->oids + array->num++ * rawsz, oid, rawsz);
+}
+
+static int collect_loose_commit(char *hash, void *data) {
+    char type[16];
+    size_t size;
+    if (!object_info(hash, type, &size) && !strcmp(type, "commit")) {
+        unsigned char sha1[GIT_MAX_RAWSZ];
+        hex_to_sha1(hash, sha1);
+        oid_array_append(data, sha1);
+    }
+
+    return 0;
+}
+
+static void collect_all_commits(struct oid_array *commits) {
+    for_each_loose_object(collect_loose_commit, commits);
+
+    size_t rawsz = hash_algo()->rawsz;
+    for (struct packed_git *pack = get_packed_git(); pack; pack = pack->next) {
+        for (uint32_t i = 0; i < pack->num_objects; i++) {
+            const unsigned char *sha1 = pack->sha1s + (size_t)i * rawsz;
+            int type;
+            size_t size;
+            if (!packed_object_info(sha1, &type, &size) && type == OBJ_COMMIT)
+                oid_array_append(commits, sha1);
+        }
+    }
+}
+
+static int add_tip(struct oid_array *tips, const char *hex) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    if (strlen(hex) != hash_algo()->hexsz || hex_to_sha1(hex, sha1)) {
+        fprintf(stderr, "Not a valid object name %s\n", hex);
+        return 1;
+    }
+
+    oid_array_append(tips, sha1);
+    return 0;
+}
+
+// commit-graph write adds the given commits, the ones listed on stdin or by
+// default every commit in the object store, along with their history
+int commit_graph(int argc, char **argv) {
+    struct option graph_options[] = {
+        {"stdin-commits", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int stdin_commits = 0, bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "", graph_options, NULL)) != -1) {
+        if (c == 's')
+            stdin_commits = 1;
+        else
+            bad_usage = 1;
+    }
+
+    char **args;
+    int num_args = command_operands(argc, argv, &args);
+    if (bad_usage || num_args < 1 || strcmp(args[0], "write") ||
+        (stdin_commits && num_args > 1)) {
+        fprintf(stderr, "Usage: %s commit-graph write [<commit>...]\n",
+                argv[0]);
+        fprintf(stderr, "       %s commit-graph write --stdin-commits\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct oid_array tips = {NULL, 0, 0};
+    int ret = 0;
+    if (stdin_commits) {
+        char line[GIT_MAX_HEXSZ + 2];
+        while (!ret && fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (*line)
+                ret = add_tip(&tips, line);
+        }
+    } else if (num_args > 1) {
+        for (int i = 1; !ret && i < num_args; i++)
+            ret = add_tip(&tips, args[i]);
+    } else {
+        collect_all_commits(&tips);
+    }
+
+    if (!ret)
+        ret = write_commit_graph(tips.oids, tips.num);
+    free(tips.oids);
+
+    return ret;
+}
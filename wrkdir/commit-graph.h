@@ -0,0 +1,67 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMMIT_GRAPH_PATH ".gblimi/objects/info/commit-graph"
+
+// The layout is git's commit-graph format, version 1
+#define GRAPH_SIGNATURE 0x43475048 // "CGPH"
+#define GRAPH_VERSION 1
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CHUNKID_OIDFANOUT 0x4f494446 // "OIDF"
+#define GRAPH_CHUNKID_OIDLOOKUP 0x4f49444c // "OIDL"
+#define GRAPH_CHUNKID_DATA 0x43444154      // "CDAT"
+#define GRAPH_CHUNKID_EXTRAEDGES 0x45444745 // "EDGE"
+
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES_NEEDED 0x80000000
+#define GRAPH_LAST_EDGE 0x80000000
+
+// Generation numbers are topological levels, roots being 1. They saturate
+// at the largest value the 30 bits in the data chunk can hold.
+#define GENERATION_NUMBER_MAX 0x3FFFFFFF
+
+// A mapped commit-graph. Commits are identified by their position in the
+// sorted id table, each one has a fixed width record holding its tree, the
+// positions of its first two parents, its generation and its commit date.
+struct commit_graph {
+    const unsigned char *map;
+    size_t map_size;
+    uint32_t num_commits;
+    size_t rawsz;
+
+    const unsigned char *fanout;
+    const unsigned char *oids;
+    const unsigned char *data;
+    const unsigned char *edges;
+    size_t num_edges;
+};
+
+int commit_graph_enabled(void);
+
+struct commit_graph *get_commit_graph(void);
+
+int commit_graph_pos(const struct commit_graph *graph,
+                     const unsigned char *sha1, uint32_t *pos);
+
+const unsigned char *commit_graph_oid(const struct commit_graph *graph,
+                                      uint32_t pos);
+
+const unsigned char *commit_graph_tree(const struct commit_graph *graph,
+                                       uint32_t pos);
+
+uint32_t commit_graph_generation(const struct commit_graph *graph,
+                                 uint32_t pos);
+
+int64_t commit_graph_date(const struct commit_graph *graph, uint32_t pos);
+
+int commit_graph_parent(const struct commit_graph *graph, uint32_t pos, int n,
+                        uint32_t *parent);
+
+int write_commit_graph(const unsigned char *tips, size_t num_tips);
+
+int commit_graph(int argc, char **argv);
+
+#endif
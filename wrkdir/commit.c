@@ -0,0 +1,283 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "commit-graph.h"
+#include "commit.h"
+#include "config.h"
+#include "object.h"
+#include "parse-options.h"
+#include "tree.h"
+
+// Parses the header of a commit object: the tree, every parent and the
+// committer date. Returns 1 if the header is malformed.
+int parse_commit_buffer(const char *buf, size_t size,
+                        struct commit_info *info) {
+    size_t rawsz = hash_algo()->rawsz, hexsz = hash_algo()->hexsz;
+    const char *end = buf + size;
+    char hex[GIT_MAX_HEXSZ + 1];
+
+    info->parents = NULL;
+    info->num_parents = 0;
+    info->date = 0;
+
+    if ((size_t)(end - buf) < 5 + hexsz + 1 || memcmp(buf, "tree ", 5) ||
+        buf[5 + hexsz] != '\n')
+        return 1;
+    memcpy(hex, buf + 5, hexsz);
+    hex[hexsz] = '\0';
+    if (hex_to_sha1(hex, info->tree))
+        return 1;
+    buf += 5 + hexsz + 1;
+
+    while ((size_t)(end - buf) >= 7 + hexsz + 1 &&
+           !memcmp(buf, "parent ", 7) && buf[7 + hexsz] == '\n') {
+        info->parents =
+            realloc(info->parents, (info->num_parents + 1) * rawsz);
+        memcpy(hex, buf + 7, hexsz);
+        if (hex_to_sha1(hex, info->parents + info->num_parents * rawsz)) {
+            clear_commit_info(info);
+            return 1;
+        }
+        info->num_parents++;
+        buf += 7 + hexsz + 1;
+    }
+
+    // The date follows the last '>' of the committer line
+    while (buf < end) {
+        const char *eol = memchr(buf, '\n', end - buf);
+        if (!eol || eol == buf)
+            break;
+
+        if (eol - buf > 10 && !memcmp(buf, "committer ", 10)) {
+            const char *p = eol;
+            while (p > buf && p[-1] != '>')
+                p--;
+            if (p > buf) {
+                info->date = strtoll(p, NULL, 10);
+                return 0;
+            }
+        }
+        buf = eol + 1;
+    }
+
+    clear_commit_info(info);
+    return 1;
+}
+
+int read_commit_info(const unsigned char *sha1, struct commit_info *info) {
+    char hex[GIT_MAX_HEXSZ + 1], type[16];
+    size_t size;
+    sha1_to_hex(sha1, hex);
+    char *buf = retrieve_object(hex, type, &size);
+    if (!buf)
+        return 1;
+
+    int ret = 0;
+    if (strcmp(type, "commit") != 0) {
+        fprintf(stderr, "%s is a %s, not a commit\n", hex, type);
+        ret = 1;
+    } else if (parse_commit_buffer(buf, size, info)) {
+        fprintf(stderr, "Corrupt commit %s\n", hex);
+        ret = 1;
+    }
+    free(buf);
+
+    return ret;
+}
+
+void clear_commit_info(struct commit_info *info) {
+    free(info->parents);
+    info->parents = NULL;
+    info->num_parents = 0;
+}
+
+// Reads user.<key>, falling back to the bare key that configs written
+// before the user section still use
+static char *get_user_config(const char *key) {
+    char user_key[32];
+    snprintf(user_key, sizeof(user_key), "user.%s", key);
+    char *value = get_config(user_key);
+
+    return value ? value : get_config(key);
+}
+
+// Builds "Name <email> <seconds> <+zzzz>" from user.name and user.email.
+// The date can be fixed through date_env as "<seconds> <+zzzz>", for
+// reproducible commits, otherwise the current local time is used.
+static int format_ident(char *ident, const char *date_env) {
+    char *name = get_user_config("name");
+    char *email = get_user_config("email");
+    if (!name || !email || strpbrk(name, "<>\n") || strpbrk(email, "<>\n")) {
+        fprintf(stderr, "Set a valid user.name and user.email with "
+                        "'config set' first\n");
+        free(name);
+        free(email);
+        return 1;
+    }
+
+    char date[64];
+    const char *fixed = getenv(date_env);
+    if (fixed && *fixed) {
+        snprintf(date, sizeof(date), "%s", fixed);
+    } else {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        long offset = tm.tm_gmtoff / 60;
+        char sign = offset < 0 ? '-' : '+';
+        if (offset < 0)
+            offset = -offset;
+        snprintf(date, sizeof(date), "%lld %c%02ld%02ld", (long long)now,
+                 sign, offset / 60, offset % 60);
+    }
+
+    int len = snprintf(ident, IDENT_MAX, "%s <%s> %s", name, email, date);
+    free(name);
+    free(email);
+    if (len >= IDENT_MAX) {
+        fprintf(stderr, "Identity too long\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int check_object_type(char *hex, const char *expected) {
+    char type[16];
+    size_t size;
+    if (strlen(hex) != hash_algo()->hexsz || object_info(hex, type, &size)) {
+        fprintf(stderr, "Not a valid object name %s\n", hex);
+        return 1;
+    }
+    if (strcmp(type, expected) != 0) {
+        fprintf(stderr, "%s is a %s, not a %s\n", hex, type, expected);
+        return 1;
+    }
+
+    return 0;
+}
+
+static char *read_stdin(size_t *len) {
+    size_t alloc = 4096;
+    char *buf = malloc(alloc);
+    *len = 0;
+    size_t n;
+    while ((n = fread(buf + *len, 1, alloc - *len, stdin)) > 0) {
+        *len += n;
+        if (*len == alloc)
+            buf = realloc(buf, alloc *= 2);
+    }
+
+    return buf;
+}
+
+// Writes a commit object for the tree and prints its id. The message comes
+// from the -m options, each one a paragraph, or from stdin. The new commit
+// is added to the commit-graph unless core.commitGraph is false.
+int commit_tree(int argc, char **argv) {
+    struct option commit_options[] = {
+        {NULL, 0, NULL, 0},
+    };
+
+    size_t rawsz = hash_algo()->rawsz;
+    unsigned char *parents = NULL;
+    int num_parents = 0, bad_usage = 0, ret = 1;
+    char *message = NULL;
+    size_t message_len = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "p:m:", commit_options, NULL)) !=
+           -1) {
+        switch (c) {
+        case 'p': {
+            unsigned char sha1[GIT_MAX_RAWSZ];
+            if (check_object_type(optarg, "commit"))
+                goto out;
+            hex_to_sha1(optarg, sha1);
+
+            int duplicate = 0;
+            for (int i = 0; i < num_parents; i++)
+                duplicate |= !memcmp(parents + i * rawsz, sha1, rawsz);
+            if (duplicate) {
+                fprintf(stderr, "Duplicate parent %s ignored\n", optarg);
+                break;
+            }
+            parents = realloc(parents, (num_parents + 1) * rawsz);
+            memcpy(parents + num_parents++ * rawsz, sha1, rawsz);
+            break;
+        }
+        case 'm': {
+            size_t len = strlen(optarg);
+            message = realloc(message, message_len + len + 2);
+            if (message_len)
+                message[message_len++] = '\n';
+            memcpy(message + message_len, optarg, len);
+            message_len += len;
+            if (!len || optarg[len - 1] != '\n')
+                message[message_len++] = '\n';
+            break;
+        }
+        default:
+            bad_usage = 1;
+            break;
+        }
+    }
+
+    char **args;
+    if (bad_usage || command_operands(argc, argv, &args) != 1) {
+        fprintf(stderr,
+                "Usage: %s commit-tree <tree> [-p <parent>]... "
+                "[-m <message>]...\n",
+                argv[0]);
+        goto out;
+    }
+
+    unsigned char tree[GIT_MAX_RAWSZ];
+    char tree_hex[GIT_MAX_HEXSZ + 1];
+    if (check_object_type(args[0], "tree"))
+        goto out;
+    hex_to_sha1(args[0], tree);
+    sha1_to_hex(tree, tree_hex);
+
+    char author[IDENT_MAX], committer[IDENT_MAX];
+    if (format_ident(author, "GBLIMI_AUTHOR_DATE") ||
+        format_ident(committer, "GBLIMI_COMMITTER_DATE"))
+        goto out;
+
+    if (!message)
+        message = read_stdin(&message_len);
+
+    char *content;
+    size_t size;
+    FILE *buf = open_memstream(&content, &size);
+    fprintf(buf, "tree %s\n", tree_hex);
+    for (int i = 0; i < num_parents; i++) {
+        char hex[GIT_MAX_HEXSZ + 1];
+        sha1_to_hex(parents + i * rawsz, hex);
+        fprintf(buf, "parent %s\n", hex);
+    }
+    fprintf(buf, "author %s\ncommitter %s\n\n", author, committer);
+    fwrite(message, 1, message_len, buf);
+    fclose(buf);
+
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    ret = write_object("commit", content, size, sha1);
+    free(content);
+
+    if (!ret && commit_graph_enabled())
+        ret = write_commit_graph(sha1, 1);
+
+    if (!ret) {
+        char hex[GIT_MAX_HEXSZ + 1];
+        sha1_to_hex(sha1, hex);
+        printf("%s\n", hex);
+    }
+
+out:
+    free(parents);
+    free(message);
+
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdint.h>
+
+#include "hash.h"
+
+// Longest "Name <email> <seconds> <+zzzz>" line accepted for an identity
+#define IDENT_MAX 1024
+
+// What history traversal needs from a commit object
+struct commit_info {
+    unsigned char tree[GIT_MAX_RAWSZ];
+    unsigned char *parents;
+    int num_parents;
+    int64_t date;
+};
+
+int parse_commit_buffer(const char *buf, size_t size,
+                        struct commit_info *info);
+
+int read_commit_info(const unsigned char *sha1, struct commit_info *info);
+
+void clear_commit_info(struct commit_info *info);
+
+int commit_tree(int argc, char **argv);
+
+#endif
@@ -0,0 +1,51 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "config.h"
+
+static int core_level;
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+
+static void load_compression_level(void) {
+    core_level = get_config_int("core.compression", Z_DEFAULT_COMPRESSION);
+    if (core_level < Z_DEFAULT_COMPRESSION || core_level > Z_BEST_COMPRESSION) {
+        fprintf(stderr, "Bad core.compression %d, using the default\n",
+                core_level);
+        core_level = Z_DEFAULT_COMPRESSION;
+    }
+}
+
+// zlib level from core.compression, -1 being zlib's default
+int core_compression_level(void) {
+    pthread_once(&level_once, load_compression_level);
+    return core_level;
+}
+
+// Deflates the first block at level 1 and lowers level when the data barely
+// shrinks, already compressed content like archives and images then costs a
+// copy instead of a full deflate. Small objects are not sampled.
+int pick_compression_level(int level, const void *sample, size_t len) {
+    if (level == Z_NO_COMPRESSION || level == Z_BEST_SPEED ||
+        len < COMPRESSION_SAMPLE_SIZE)
+        return level;
+    len = COMPRESSION_SAMPLE_SIZE;
+
+    unsigned char out[COMPRESSION_SAMPLE_SIZE + 64];
+    uLongf out_len = sizeof(out);
+    if (compress2(out, &out_len, sample, len, Z_BEST_SPEED) != Z_OK)
+        return Z_NO_COMPRESSION;
+
+    if (out_len * 100 >= len * INCOMPRESSIBLE_RATIO)
+        return Z_NO_COMPRESSION;
+    if (out_len * 100 >= len * POOR_RATIO)
+        return Z_BEST_SPEED;
+
+    return level;
+}
+
+int object_compression_level(const void *sample, size_t len) {
+    return pick_compression_level(core_compression_level(), sample, len);
+}
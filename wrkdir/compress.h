@@ -0,0 +1,21 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Objects at least this big have their first block test compressed to decide
+// whether deflating the rest is worth it
+#define COMPRESSION_SAMPLE_SIZE (16 * 1024)
+
+// Percentage of its size a sample still takes up at level 1 above which the
+// object is stored without compression, or compressed at level 1 only
+#define INCOMPRESSIBLE_RATIO 95
+#define POOR_RATIO 85
+
+int core_compression_level(void);
+
+int pick_compression_level(int level, const void *sample, size_t len);
+
+int object_compression_level(const void *sample, size_t len);
+
+#endif
@@ -0,0 +1,178 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hashfile.h"
+
+#define CONFIG_PATH ".gblimi/config"
+
+// Splits a "<key> = <value>" line in place, surrounding whitespace is dropped.
+// Returns 1 for lines that are not settings.
+static int parse_config_line(char *line, char **key, char **value) {
+    char *eq = strchr(line, '=');
+    if (!eq)
+        return 1;
+
+    char *end = eq;
+    while (end > line && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+
+    *value = eq + 1;
+    while (isspace((unsigned char)**value))
+        (*value)++;
+    end = *value + strlen(*value);
+    while (end > *value && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+
+    *key = line;
+    while (isspace((unsigned char)**key))
+        (*key)++;
+
+    return **key == '\0';
+}
+
+// Returns the value of key as a new string, NULL when it is not set
+char *get_config(const char *key) {
+    FILE *file = fopen(CONFIG_PATH, "r");
+    if (!file)
+        return NULL;
+
+    char line[1024];
+    char *found = NULL;
+    while (fgets(line, sizeof(line), file)) {
+        char *name, *value;
+        if (parse_config_line(line, &name, &value) || strcmp(name, key))
+            continue;
+
+        // The last setting of a key wins
+        free(found);
+        found = strdup(value);
+    }
+
+    fclose(file);
+
+    return found;
+}
+
+// Reads a decimal integer, def is used when the key is not set or not a
+// number
+int get_config_int(const char *key, int def) {
+    char *value = get_config(key);
+    if (!value)
+        return def;
+
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || number < INT_MIN ||
+        number > INT_MAX) {
+        fprintf(stderr, "Bad number for %s: %s\n", key, value);
+        number = def;
+    }
+    free(value);
+
+    return number;
+}
+
+// Reads a size that may carry a k, m or g suffix, def is used when the key is
+// not set or not a valid size
+size_t get_config_size(const char *key, size_t def) {
+    char *value = get_config(key);
+    if (!value)
+        return def;
+
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(value, &end, 10);
+    switch (tolower((unsigned char)*end)) {
+    case 'g':
+        size *= 1024;
+        // fall through
+    case 'm':
+        size *= 1024;
+        // fall through
+    case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+
+    if (errno || end == value || *end != '\0') {
+        fprintf(stderr, "Bad size for %s: %s\n", key, value);
+        size = def;
+    }
+    free(value);
+
+    return size;
+}
+
+// Rewrites the config with key set to value, replacing an existing setting
+// in place or appending a new one
+int set_config(const char *key, const char *value) {
+    char lock_path[64];
+    int fd = hold_lock_file(CONFIG_PATH, lock_path, sizeof(lock_path));
+    if (fd < 0)
+        return 1;
+
+    FILE *out = fdopen(fd, "w");
+    FILE *in = fopen(CONFIG_PATH, "r");
+    int replaced = 0;
+    char line[1024], copy[1024];
+    while (in && fgets(line, sizeof(line), in)) {
+        char *name, *old;
+        memcpy(copy, line, sizeof(line));
+        if (!parse_config_line(copy, &name, &old) && !strcmp(name, key)) {
+            if (!replaced)
+                fprintf(out, "%s = %s\n", key, value);
+            replaced = 1;
+            continue;
+        }
+
+        fputs(line, out);
+        if (!strchr(line, '\n'))
+            fputc('\n', out);
+    }
+    if (in)
+        fclose(in);
+
+    if (!replaced)
+        fprintf(out, "%s = %s\n", key, value);
+
+    int ret = fclose(out) != 0;
+    if (!ret && rename(lock_path, CONFIG_PATH) != 0)
+        ret = 1;
+    if (ret) {
+        fprintf(stderr, "Failed to write %s\n", CONFIG_PATH);
+        unlink(lock_path);
+    }
+
+    return ret;
+}
+
+int config(int argc, char **argv) {
+    if (argc < 4 || (strcmp(argv[2], "get") && strcmp(argv[2], "set")) ||
+        (!strcmp(argv[2], "set") && argc < 5)) {
+        fprintf(stderr, "Usage: %s config get <key>\n", argv[0]);
+        fprintf(stderr, "       %s config set <key> <value>\n", argv[0]);
+        return 1;
+    }
+
+    if (!strcmp(argv[2], "set"))
+        return set_config(argv[3], argv[4]);
+
+    char *value = get_config(argv[3]);
+    if (!value)
+        return 1;
+
+    printf("%s\n", value);
+    free(value);
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+char *get_config(const char *key);
+
+int get_config_int(const char *key, int def);
+
+size_t get_config_size(const char *key, size_t def);
+
+int set_config(const char *key, const char *value);
+
+int config(int argc, char **argv);
+
+#endif
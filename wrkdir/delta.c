@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+
+// Multiplier of the polynomial rolling hash over DELTA_BLOCK_SIZE bytes
+#define HASH_BASE 257u
+
+// Candidates compared per target position before giving up on a bucket
+#define MAX_CHAIN 64
+
+struct delta_index {
+    const unsigned char *src;
+    size_t src_size;
+    uint32_t hash_mask;
+    uint32_t *buckets; // First block + 1 in each bucket, 0 when empty
+    uint32_t *next;    // Next block + 1 in the same bucket
+};
+
+struct delta_buf {
+    unsigned char *data;
+    size_t len;
+    size_t alloc;
+    size_t max;
+};
+
+static uint32_t block_hash(const unsigned char *p) {
+    uint32_t hash = 0;
+    for (int i = 0; i < DELTA_BLOCK_SIZE; i++)
+        hash = hash * HASH_BASE + p[i];
+
+    return hash;
+}
+
+static uint32_t bucket_of(struct delta_index *index, uint32_t hash) {
+    return (hash * 2654435761u >> 7) & index->hash_mask;
+}
+
+// Hashes every aligned block of the source so matches for any target window
+// can be found with one lookup
+struct delta_index *create_delta_index(const unsigned char *src,
+                                       size_t src_size) {
+    size_t num_blocks = src_size / DELTA_BLOCK_SIZE;
+    if (num_blocks == 0 || src_size > UINT32_MAX)
+        return NULL;
+
+    uint32_t num_buckets = 16;
+    while (num_buckets < num_blocks)
+        num_buckets <<= 1;
+
+    struct delta_index *index = malloc(sizeof(struct delta_index));
+    index->src = src;
+    index->src_size = src_size;
+    index->hash_mask = num_buckets - 1;
+    index->buckets = calloc(num_buckets, sizeof(uint32_t));
+    index->next = malloc(num_blocks * sizeof(uint32_t));
+
+    // Insert backwards so each chain lists earlier blocks first
+    for (size_t i = num_blocks; i-- > 0;) {
+        uint32_t bucket =
+            bucket_of(index, block_hash(src + i * DELTA_BLOCK_SIZE));
+        index->next[i] = index->buckets[bucket];
+        index->buckets[bucket] = i + 1;
+    }
+
+    return index;
+}
+
+void free_delta_index(struct delta_index *index) {
+    if (!index)
+        return;
+
+    free(index->buckets);
+    free(index->next);
+    free(index);
+}
+
+static int delta_put(struct delta_buf *buf, const unsigned char *data,
+                     size_t len) {
+    if (buf->len + len > buf->max)
+        return 1;
+
+    if (buf->len + len > buf->alloc) {
+        buf->alloc = (buf->len + len) * 2;
+        if (buf->alloc > buf->max)
+            buf->alloc = buf->max;
+        buf->data = realloc(buf->data, buf->alloc);
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+
+    return 0;
+}
+
+static int delta_put_size(struct delta_buf *buf, size_t size) {
+    unsigned char bytes[10];
+    int len = 0;
+    do {
+        bytes[len] = size & 0x7f;
+        size >>= 7;
+        if (size)
+            bytes[len] |= 0x80;
+        len++;
+    } while (size);
+
+    return delta_put(buf, bytes, len);
+}
+
+// Literal bytes go out as insert instructions of at most 127 bytes each
+static int delta_insert(struct delta_buf *buf, const unsigned char *data,
+                        size_t len) {
+    while (len > 0) {
+        unsigned char chunk = len > 127 ? 127 : len;
+        if (delta_put(buf, &chunk, 1) || delta_put(buf, data, chunk))
+            return 1;
+        data += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// A copy instruction flags which of its offset and size bytes are present
+static int delta_copy(struct delta_buf *buf, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t chunk = len > 0xffffff ? 0xffffff : len;
+        unsigned char op[8];
+        int op_len = 1;
+        op[0] = 0x80;
+
+        for (int i = 0; i < 4; i++) {
+            unsigned char byte = (offset >> (i * 8)) & 0xff;
+            if (byte) {
+                op[op_len++] = byte;
+                op[0] |= 1 << i;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            unsigned char byte = (chunk >> (i * 8)) & 0xff;
+            if (byte) {
+                op[op_len++] = byte;
+                op[0] |= 0x10 << i;
+            }
+        }
+
+        if (delta_put(buf, op, op_len))
+            return 1;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// Encodes trg as copies out of the indexed source plus literal inserts in
+// git's delta format. Returns NULL when the delta would exceed max_size.
+unsigned char *create_delta(struct delta_index *index,
+                            const unsigned char *trg, size_t trg_size,
+                            size_t *delta_size, size_t max_size) {
+    const unsigned char *src = index->src;
+    size_t src_size = index->src_size;
+    struct delta_buf buf = {NULL, 0, 0, max_size};
+
+    if (delta_put_size(&buf, src_size) || delta_put_size(&buf, trg_size))
+        goto fail;
+
+    uint32_t top = 1;
+    for (int i = 0; i < DELTA_BLOCK_SIZE; i++)
+        top *= HASH_BASE;
+
+    size_t pos = 0, literal = 0;
+    uint32_t hash = 0;
+    int have_hash = 0;
+    while (pos + DELTA_BLOCK_SIZE <= trg_size) {
+        if (!have_hash) {
+            hash = block_hash(trg + pos);
+            have_hash = 1;
+        }
+
+        size_t best_offset = 0, best_len = 0;
+        uint32_t block = index->buckets[bucket_of(index, hash)];
+        for (int tries = 0; block && tries < MAX_CHAIN; tries++) {
+            size_t offset = (size_t)(block - 1) * DELTA_BLOCK_SIZE;
+            block = index->next[block - 1];
+
+            size_t len = 0;
+            while (offset + len < src_size && pos + len < trg_size &&
+                   src[offset + len] == trg[pos + len])
+                len++;
+            if (len > best_len) {
+                best_len = len;
+                best_offset = offset;
+            }
+        }
+
+        if (best_len < DELTA_BLOCK_SIZE) {
+            // Roll the window forward by one byte
+            if (pos + DELTA_BLOCK_SIZE < trg_size)
+                hash = hash * HASH_BASE + trg[pos + DELTA_BLOCK_SIZE] -
+                       top * trg[pos];
+            pos++;
+            continue;
+        }
+
+        // Grow the match backwards over bytes that were going to be literal
+        while (best_offset > 0 && pos > literal &&
+               src[best_offset - 1] == trg[pos - 1]) {
+            best_offset--;
+            pos--;
+            best_len++;
+        }
+
+        if (delta_insert(&buf, trg + literal, pos - literal) ||
+            delta_copy(&buf, best_offset, best_len))
+            goto fail;
+
+        pos += best_len;
+        literal = pos;
+        have_hash = 0;
+    }
+
+    if (delta_insert(&buf, trg + literal, trg_size - literal))
+        goto fail;
+
+    *delta_size = buf.len;
+    return buf.data;
+
+fail:
+    free(buf.data);
+    return NULL;
+}
+
+static int delta_get_size(const unsigned char **p, const unsigned char *end,
+                          size_t *size) {
+    *size = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        if (*p == end || shift > 56)
+            return 1;
+        byte = *(*p)++;
+        *size |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return 0;
+}
+
+// Rebuilds the target of a delta made by create_delta() from its source, the
+// result is NUL terminated. Returns NULL when the delta is corrupt or was made
+// against a different source.
+unsigned char *patch_delta(const unsigned char *src, size_t src_size,
+                           const unsigned char *delta, size_t delta_size,
+                           size_t *trg_size) {
+    const unsigned char *p = delta, *end = delta + delta_size;
+
+    size_t expected_src, size;
+    if (delta_get_size(&p, end, &expected_src) || expected_src != src_size ||
+        delta_get_size(&p, end, &size))
+        return NULL;
+
+    unsigned char *trg = malloc(size + 1);
+    size_t len = 0;
+    while (p < end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            size_t offset = 0, copy = 0;
+            for (int i = 0; i < 4; i++)
+                if (op & (1 << i)) {
+                    if (p == end)
+                        goto fail;
+                    offset |= (size_t)*p++ << (i * 8);
+                }
+            for (int i = 0; i < 3; i++)
+                if (op & (0x10 << i)) {
+                    if (p == end)
+                        goto fail;
+                    copy |= (size_t)*p++ << (i * 8);
+                }
+            if (copy == 0)
+                copy = 0x10000;
+
+            if (offset + copy > src_size || len + copy > size)
+                goto fail;
+            memcpy(trg + len, src + offset, copy);
+            len += copy;
+        } else if (op) {
+            if ((size_t)(end - p) < op || len + op > size)
+                goto fail;
+            memcpy(trg + len, p, op);
+            len += op;
+            p += op;
+        } else {
+            goto fail;
+        }
+    }
+
+    if (len != size)
+        goto fail;
+
+    trg[size] = '\0';
+    *trg_size = size;
+    return trg;
+
+fail:
+    free(trg);
+    return NULL;
+}
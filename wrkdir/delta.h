@@ -0,0 +1,26 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Source blocks are indexed at this granularity, shorter matches are not
+// worth a copy instruction
+#define DELTA_BLOCK_SIZE 16
+
+struct delta_index;
+
+struct delta_index *create_delta_index(const unsigned char *src,
+                                       size_t src_size);
+
+void free_delta_index(struct delta_index *index);
+
+unsigned char *create_delta(struct delta_index *index,
+                            const unsigned char *trg, size_t trg_size,
+                            size_t *delta_size, size_t max_size);
+
+unsigned char *patch_delta(const unsigned char *src, size_t src_size,
+                           const unsigned char *delta, size_t delta_size,
+                           size_t *trg_size);
+
+#endif
@@ -0,0 +1,378 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache-tree.h"
+#include "diff-tree.h"
+#include "hash.h"
+#include "index.h"
+#include "object.h"
+#include "parse-options.h"
+#include "revision.h"
+#include "tree.h"
+
+struct diff_walk {
+    char path[PATH_MAX];
+    int recursive;
+    tree_change_fn fn;
+    void *data;
+};
+
+static int walk_trees(struct diff_walk *w, const unsigned char *old_tree,
+                      const unsigned char *new_tree, size_t base_len);
+
+// Reports one side's entry alone, descending into it when it is a tree
+static int report_entry(struct diff_walk *w, const struct git_tree_entry *entry,
+                        int is_new, size_t base_len) {
+    if (base_len + entry->path_len + 1 >= sizeof(w->path)) {
+        fprintf(stderr, "Path too long under %.*s\n", (int)base_len, w->path);
+        return 1;
+    }
+    memcpy(w->path + base_len, entry->path, entry->path_len);
+
+    if (entry->mode == 40000 && w->recursive) {
+        w->path[base_len + entry->path_len] = '/';
+        return walk_trees(w, is_new ? NULL : entry->sha1,
+                          is_new ? entry->sha1 : NULL,
+                          base_len + entry->path_len + 1);
+    }
+
+    w->path[base_len + entry->path_len] = '\0';
+    struct tree_change change = {w->path, 0, 0, NULL, NULL};
+    if (is_new) {
+        change.new_mode = entry->mode;
+        change.new_sha1 = entry->sha1;
+    } else {
+        change.old_mode = entry->mode;
+        change.old_sha1 = entry->sha1;
+    }
+
+    return w->fn(&change, w->data);
+}
+
+// Merges the entries of two trees, which are both in tree order. Entries
+// with the same name and id are skipped, so an unchanged subtree is never
+// read however large it is. A missing tree is empty.
+static int walk_trees(struct diff_walk *w, const unsigned char *old_tree,
+                      const unsigned char *new_tree, size_t base_len) {
+    size_t old_size = 0, new_size = 0, rawsz = hash_algo()->rawsz;
+    char *old_buf = NULL, *new_buf = NULL;
+    if ((old_tree && !(old_buf = read_tree_object(old_tree, &old_size))) ||
+        (new_tree && !(new_buf = read_tree_object(new_tree, &new_size)))) {
+        free(old_buf);
+        return 1;
+    }
+
+    struct tree_desc old_desc, new_desc;
+    struct git_tree_entry a, b;
+    init_tree_desc(&old_desc, old_buf, old_size);
+    init_tree_desc(&new_desc, new_buf, new_size);
+    int has_a = next_tree_entry(&old_desc, &a);
+    int has_b = next_tree_entry(&new_desc, &b);
+
+    int ret = 0;
+    while (!ret && has_a > 0 && has_b > 0) {
+        int cmp = compare_tree_names(a.path, a.path_len, a.mode == 40000,
+                                     b.path, b.path_len, b.mode == 40000);
+        if (cmp < 0) {
+            ret = report_entry(w, &a, 0, base_len);
+            has_a = next_tree_entry(&old_desc, &a);
+            continue;
+        }
+        if (cmp > 0) {
+            ret = report_entry(w, &b, 1, base_len);
+            has_b = next_tree_entry(&new_desc, &b);
+            continue;
+        }
+
+        if (a.mode != b.mode || memcmp(a.sha1, b.sha1, rawsz)) {
+            if (base_len + a.path_len + 1 >= sizeof(w->path)) {
+                fprintf(stderr, "Path too long under %.*s\n", (int)base_len,
+                        w->path);
+                ret = 1;
+                break;
+            }
+            memcpy(w->path + base_len, a.path, a.path_len);
+            if (a.mode == 40000 && w->recursive) {
+                w->path[base_len + a.path_len] = '/';
+                ret = walk_trees(w, a.sha1, b.sha1, base_len + a.path_len + 1);
+            } else {
+                w->path[base_len + a.path_len] = '\0';
+                struct tree_change change = {w->path, a.mode, b.mode, a.sha1,
+                                             b.sha1};
+                ret = w->fn(&change, w->data);
+            }
+        }
+        has_a = next_tree_entry(&old_desc, &a);
+        has_b = next_tree_entry(&new_desc, &b);
+    }
+    while (!ret && has_a > 0) {
+        ret = report_entry(w, &a, 0, base_len);
+        has_a = next_tree_entry(&old_desc, &a);
+    }
+    while (!ret && has_b > 0) {
+        ret = report_entry(w, &b, 1, base_len);
+        has_b = next_tree_entry(&new_desc, &b);
+    }
+
+    if (!ret && (has_a < 0 || has_b < 0)) {
+        fprintf(stderr, "Corrupt tree under %.*s\n", (int)base_len, w->path);
+        ret = 1;
+    }
+    free(old_buf);
+    free(new_buf);
+
+    return ret;
+}
+
+// Calls fn for every path that differs between two trees, either of which
+// may be NULL for an empty tree. base, empty or ending in '/', is put in
+// front of every path. With recursive clear changed subtrees are reported
+// as themselves rather than descended into.
+int diff_trees(const unsigned char *old_tree, const unsigned char *new_tree,
+               const char *base, int recursive, tree_change_fn fn,
+               void *data) {
+    struct diff_walk w;
+    size_t base_len = strlen(base);
+    if (base_len >= sizeof(w.path)) {
+        fprintf(stderr, "Path too long %s\n", base);
+        return 1;
+    }
+    memcpy(w.path, base, base_len);
+    w.recursive = recursive;
+    w.fn = fn;
+    w.data = data;
+
+    return walk_trees(&w, old_tree, new_tree, base_len);
+}
+
+static char *join_path(const char *base, size_t base_len, const char *name,
+                       size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    char *path = malloc(base_len + len + suffix_len + 1);
+    memcpy(path, base, base_len);
+    memcpy(path + base_len, name, len);
+    memcpy(path + base_len + len, suffix, suffix_len + 1);
+
+    return path;
+}
+
+// The index side of a tree to index diff, pos runs over its sorted entries
+struct index_walk {
+    struct git_index *index;
+    size_t pos;
+    tree_change_fn fn;
+    void *data;
+};
+
+static int report_index_entry(struct index_walk *w,
+                              const struct git_tree_entry *tree_entry) {
+    struct git_index_entry *entry = &w->index->entries[w->pos++];
+    struct tree_change change = {index_entry_path(w->index, entry), 0,
+                                 entry->mode, NULL, entry->sha1};
+    if (tree_entry) {
+        change.old_mode = tree_entry->mode;
+        change.old_sha1 = tree_entry->sha1;
+    }
+
+    return w->fn(&change, w->data);
+}
+
+// A directory the index still has a valid cached tree for is compared tree
+// to tree, which only reads the subtrees that differ. Returns -1 when the
+// cached tree cannot be used.
+static int diff_cached_tree(struct index_walk *w, const unsigned char *sha1,
+                            struct cache_tree *cache, const char *base) {
+    if (!cache || cache->entry_count < 0)
+        return -1;
+    if (memcmp(cache->sha1, sha1, hash_algo()->rawsz) != 0) {
+        if (!has_object(cache->sha1))
+            return -1;
+        int ret = diff_trees(sha1, cache->sha1, base, 1, w->fn, w->data);
+        if (ret)
+            return ret;
+    }
+    w->pos += cache->entry_count;
+
+    return 0;
+}
+
+// Walks the tree for the directory base alongside the index entries in it.
+// Directories with a valid cached tree are diffed tree to tree instead, and
+// ones only the tree has are listed from it.
+static int diff_index_dir(struct index_walk *w, const unsigned char *sha1,
+                          struct cache_tree *cache, char *base,
+                          size_t base_len) {
+    struct git_index *index = w->index;
+    size_t num_entries = index->header.entries;
+    size_t size = 0, rawsz = hash_algo()->rawsz;
+    char *buf = NULL;
+    if (sha1 && !(buf = read_tree_object(sha1, &size)))
+        return 1;
+
+    struct tree_desc desc;
+    struct git_tree_entry entry;
+    init_tree_desc(&desc, buf, size);
+    int has_entry = next_tree_entry(&desc, &entry);
+
+    int ret = 0;
+    while (!ret && has_entry >= 0) {
+        char *path = NULL, *slash = NULL;
+        size_t len = 0;
+        if (w->pos < num_entries) {
+            path = index_entry_path(index, &index->entries[w->pos]);
+            if (strncmp(path, base, base_len) != 0)
+                path = NULL;
+        }
+        if (path) {
+            path += base_len;
+            slash = strchr(path, '/');
+            len = slash ? (size_t)(slash - path) : strlen(path);
+        }
+        if (!path && !has_entry)
+            break;
+
+        int cmp = !path        ? 1
+                  : !has_entry ? -1
+                               : compare_tree_names(path, len, slash != NULL,
+                                                    entry.path, entry.path_len,
+                                                    entry.mode == 40000);
+        if (cmp < 0) {
+            // New in the index, with everything below it for a directory
+            char *prefix = path - base_len;
+            size_t prefix_len = base_len + len + 1;
+            do {
+                ret = report_index_entry(w, NULL);
+            } while (!ret && slash && w->pos < num_entries &&
+                     !strncmp(index_entry_path(index, &index->entries[w->pos]),
+                              prefix, prefix_len));
+            continue;
+        }
+
+        if (cmp > 0) {
+            int is_dir = entry.mode == 40000;
+            char *sub = join_path(base, base_len, entry.path, entry.path_len,
+                                  is_dir ? "/" : "");
+            if (is_dir) {
+                ret = diff_trees(entry.sha1, NULL, sub, 1, w->fn, w->data);
+            } else {
+                struct tree_change change = {sub, entry.mode, 0, entry.sha1,
+                                             NULL};
+                ret = w->fn(&change, w->data);
+            }
+            free(sub);
+        } else if (slash) {
+            struct cache_tree *sub = cache_tree_find(cache, path, len);
+            char *sub_base = join_path(base, base_len, path, len, "/");
+            ret = diff_cached_tree(w, entry.sha1, sub, sub_base);
+            if (ret < 0)
+                ret = diff_index_dir(w, entry.sha1, sub, sub_base,
+                                     base_len + len + 1);
+            free(sub_base);
+        } else {
+            struct git_index_entry *ie = &index->entries[w->pos];
+            if (ie->mode != entry.mode || memcmp(ie->sha1, entry.sha1, rawsz))
+                ret = report_index_entry(w, &entry);
+            else
+                w->pos++;
+        }
+
+        has_entry = next_tree_entry(&desc, &entry);
+    }
+    free(buf);
+
+    if (!ret && has_entry < 0) {
+        fprintf(stderr, "Corrupt tree under %s\n", base_len ? base : ".");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+// Calls fn for every path where the sorted index differs from tree, which
+// may be NULL for an empty tree. The tree is the old side of each change.
+int diff_tree_index(const unsigned char *tree, struct git_index *index,
+                    tree_change_fn fn, void *data) {
+    struct index_walk w = {index, 0, fn, data};
+    if (tree) {
+        int ret = diff_cached_tree(&w, tree, index->cache_tree, "");
+        if (ret >= 0)
+            return ret;
+    }
+
+    return diff_index_dir(&w, tree, index->cache_tree, "", 0);
+}
+
+// A change of kind between file, symlink and tree is T, anything else M
+static char change_status(const struct tree_change *change) {
+    if (!change->old_mode)
+        return 'A';
+    if (!change->new_mode)
+        return 'D';
+    if ((change->old_mode == 120000) != (change->new_mode == 120000) ||
+        (change->old_mode == 40000) != (change->new_mode == 40000))
+        return 'T';
+
+    return 'M';
+}
+
+static int show_raw(const struct tree_change *change, void *data) {
+    (void)data;
+    char old_hex[GIT_MAX_HEXSZ + 1], new_hex[GIT_MAX_HEXSZ + 1];
+    size_t hexsz = hash_algo()->hexsz;
+    memset(old_hex, '0', hexsz);
+    memset(new_hex, '0', hexsz);
+    old_hex[hexsz] = new_hex[hexsz] = '\0';
+    if (change->old_sha1)
+        sha1_to_hex(change->old_sha1, old_hex);
+    if (change->new_sha1)
+        sha1_to_hex(change->new_sha1, new_hex);
+
+    printf(":%.6u %.6u %s %s %c\t%s\n", change->old_mode, change->new_mode,
+           old_hex, new_hex, change_status(change), change->path);
+
+    return 0;
+}
+
+static int show_name_status(const struct tree_change *change, void *data) {
+    (void)data;
+    printf("%c\t%s\n", change_status(change), change->path);
+
+    return 0;
+}
+
+// diff-tree [-r] [--name-status] <a> <b> compares two trees or the trees
+// of two commits
+int diff_tree(int argc, char **argv) {
+    struct option diff_options[] = {
+        {"name-status", no_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int recursive = 0, name_status = 0, bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "r", diff_options, NULL)) != -1) {
+        if (c == 'r')
+            recursive = 1;
+        else if (c == 'n')
+            name_status = 1;
+        else
+            bad_usage = 1;
+    }
+
+    char **args;
+    if (bad_usage || command_operands(argc, argv, &args) != 2) {
+        fprintf(stderr, "Usage: %s diff-tree [-r] [--name-status] <a> <b>\n",
+                argv[0]);
+        return 1;
+    }
+
+    unsigned char oid[GIT_MAX_RAWSZ], a[GIT_MAX_RAWSZ], b[GIT_MAX_RAWSZ];
+    if (get_tree_oid(args[0], oid, a) || get_tree_oid(args[1], oid, b))
+        return 1;
+
+    return diff_trees(a, b, "", recursive,
+                      name_status ? show_name_status : show_raw, NULL);
+}
@@ -0,0 +1,30 @@
+#ifndef DIFF_TREE_H
+#define DIFF_TREE_H
+
+#include <stdint.h>
+
+struct git_index;
+
+// One path that differs between two trees. The side that does not have the
+// path has mode 0 and a NULL id. path is only valid during the callback.
+struct tree_change {
+    const char *path;
+    uint32_t old_mode;
+    uint32_t new_mode;
+    const unsigned char *old_sha1;
+    const unsigned char *new_sha1;
+};
+
+// Called for each change in path order, a nonzero return stops the walk and
+// is passed on
+typedef int (*tree_change_fn)(const struct tree_change *change, void *data);
+
+int diff_trees(const unsigned char *old_tree, const unsigned char *new_tree,
+               const char *base, int recursive, tree_change_fn fn, void *data);
+
+int diff_tree_index(const unsigned char *tree, struct git_index *index,
+                    tree_change_fn fn, void *data);
+
+int diff_tree(int argc, char **argv);
+
+#endif
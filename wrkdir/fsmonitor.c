@@ -0,0 +1,723 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/inotify.h>
+#endif
+
+#include "config.h"
+#include "fsmonitor.h"
+#include "hashfile.h"
+#include "index.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Off unless core.fsmonitor is true, the daemon has to be started by hand
+int fsmonitor_enabled(void) {
+    char *value = get_config("core.fsmonitor");
+    int enabled = value && !strcmp(value, "true");
+    free(value);
+
+    return enabled;
+}
+
+static int connect_fsmonitor(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FSMONITOR_SOCKET);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Sends one request line and reads the reply up to the daemon closing the
+// connection. Returns NULL when no daemon is listening.
+static char *fsmonitor_request(const char *request, size_t *len) {
+    int fd = connect_fsmonitor();
+    if (fd < 0)
+        return NULL;
+
+    if (write_all(fd, request, strlen(request))) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t alloc = 4096;
+    char *buf = malloc(alloc);
+    *len = 0;
+    for (;;) {
+        if (*len == alloc) {
+            alloc *= 2;
+            buf = realloc(buf, alloc);
+        }
+        ssize_t n = read(fd, buf + *len, alloc - *len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(buf);
+            buf = NULL;
+        }
+        if (n <= 0)
+            break;
+        *len += n;
+    }
+    close(fd);
+
+    return buf;
+}
+
+// The reply is the new token and then each changed path, all NUL
+// terminated. A single "/" instead of paths means everything may have
+// changed. Returns 1 when there is no usable answer.
+int query_fsmonitor(const char *token, struct fsmonitor_changes *changes) {
+    memset(changes, 0, sizeof(*changes));
+
+    char request[256];
+    snprintf(request, sizeof(request), "query %s\n", token ? token : "");
+    size_t len;
+    char *buf = fsmonitor_request(request, &len);
+    if (!buf)
+        return 1;
+    if (!len || buf[len - 1] != '\0') {
+        free(buf);
+        return 1;
+    }
+
+    changes->buf = buf;
+    changes->token = buf;
+    size_t alloc = 0;
+    for (char *p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1) {
+        if (!strcmp(p, "/")) {
+            changes->trivial = 1;
+            continue;
+        }
+        if (changes->num_paths == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            changes->paths =
+                realloc(changes->paths, alloc * sizeof(*changes->paths));
+        }
+        changes->paths[changes->num_paths++] = p;
+    }
+
+    return 0;
+}
+
+void clear_fsmonitor_changes(struct fsmonitor_changes *changes) {
+    free(changes->paths);
+    free(changes->buf);
+    memset(changes, 0, sizeof(*changes));
+}
+
+static void invalidate_all(struct git_index *index) {
+    if (index->untracked && index->untracked->root)
+        untracked_cache_invalidate_all(index->untracked,
+                                       UNTRACKED_FSMONITOR_VALID);
+    for (size_t i = 0; i < index->header.entries; i++) {
+        if (index->entries[i].fsmonitor_valid) {
+            index->entries[i].fsmonitor_valid = 0;
+            index->fsmonitor_changed = 1;
+        }
+    }
+}
+
+// Clears the entry for path and every entry below it, a path reported for a
+// directory removed or renamed as a whole ends in '/'
+static void invalidate_path(struct git_index *index, const char *path) {
+    size_t len = strlen(path);
+    char *dir = malloc(len + 2);
+    memcpy(dir, path, len + 1);
+    if (len && dir[len - 1] == '/')
+        dir[--len] = '\0';
+
+    int pos = index_pos(index, dir);
+    if (pos >= 0 && index->entries[pos].fsmonitor_valid) {
+        index->entries[pos].fsmonitor_valid = 0;
+        index->fsmonitor_changed = 1;
+    }
+
+    dir[len] = '/';
+    dir[len + 1] = '\0';
+    pos = index_pos(index, dir);
+    for (size_t i = pos < 0 ? -pos - 1 : pos; i < index->header.entries;
+         i++) {
+        struct git_index_entry *entry = &index->entries[i];
+        if (strncmp(index_entry_path(index, entry), dir, len + 1) != 0)
+            break;
+        if (entry->fsmonitor_valid) {
+            entry->fsmonitor_valid = 0;
+            index->fsmonitor_changed = 1;
+        }
+    }
+    free(dir);
+}
+
+// Asks the daemon what changed since the token saved in the index and
+// clears fsmonitor_valid on the entries below those paths, which are the
+// only ones that need an lstat() then. Without a daemon the token is dropped
+// and every entry is checked. The entries must be sorted.
+void refresh_fsmonitor(struct git_index *index) {
+    char *token = index->fsmonitor_token;
+    struct fsmonitor_changes changes;
+    index->fsmonitor_token = NULL;
+
+    if (!fsmonitor_enabled() || query_fsmonitor(token, &changes)) {
+        invalidate_all(index);
+        free(token);
+        return;
+    }
+
+    if (!token || changes.trivial) {
+        invalidate_all(index);
+    } else {
+        for (size_t i = 0; i < changes.num_paths; i++) {
+            invalidate_path(index, changes.paths[i]);
+            untracked_cache_invalidate_path(index->untracked, changes.paths[i],
+                                            UNTRACKED_FSMONITOR_VALID);
+        }
+    }
+
+    index->fsmonitor_token = strdup(changes.token);
+    clear_fsmonitor_changes(&changes);
+    free(token);
+}
+
+// The extension is the token, NUL terminated, then one bit per entry in
+// index order that is set when the entry matched the working tree as of the
+// token. It is ignored when it does not fit the entries.
+void read_fsmonitor_extension(struct git_index *index,
+                              const unsigned char *data, size_t size) {
+    const unsigned char *nul = memchr(data, '\0', size);
+    size_t entries = index->header.entries;
+    if (!nul || size - (nul + 1 - data) != (entries + 7) / 8)
+        return;
+
+    const unsigned char *bits = nul + 1;
+    for (size_t i = 0; i < entries; i++)
+        index->entries[i].fsmonitor_valid = (bits[i / 8] >> (i % 8)) & 1;
+    index->fsmonitor_token = strdup((const char *)data);
+}
+
+void write_fsmonitor_extension(struct hashfile *f, struct git_index *index) {
+    size_t entries = index->header.entries;
+    size_t token_len = strlen(index->fsmonitor_token) + 1;
+    unsigned char *bits = calloc((entries + 7) / 8 + 1, 1);
+    for (size_t i = 0; i < entries; i++)
+        if (index->entries[i].fsmonitor_valid)
+            bits[i / 8] |= 1 << (i % 8);
+
+    hashfile_write(f, FSMONITOR_EXTENSION, 4);
+    hashfile_be32(f, token_len + (entries + 7) / 8);
+    hashfile_write(f, index->fsmonitor_token, token_len);
+    hashfile_write(f, bits, (entries + 7) / 8);
+
+    free(bits);
+}
+
+#ifdef __linux__
+
+#define WATCH_MASK                                                            \
+    (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |          \
+     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |               \
+     IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct changed_path {
+    struct changed_path *next;
+    uint64_t seq;
+    char path[];
+};
+
+// Every path is stamped with seq as of its last event. A query answers with
+// the current seq as token and bumps it, so the paths changed since a token
+// are the ones stamped after it. Tokens from before reset_seq may have missed
+// events, when the kernel queue overflowed, and get a trivial answer.
+struct fsmonitor_daemon {
+    int inotify_fd;
+    int listen_fd;
+    char **watches;
+    int alloc_watches;
+    struct changed_path **buckets;
+    size_t num_buckets;
+    size_t num_paths;
+    uint64_t seq;
+    uint64_t reset_seq;
+    char instance[64];
+    int quit;
+};
+
+static size_t hash_path(const char *path, size_t len) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+
+    return hash;
+}
+
+static void clear_changes(struct fsmonitor_daemon *d) {
+    for (size_t i = 0; i < d->num_buckets; i++) {
+        while (d->buckets[i]) {
+            struct changed_path *next = d->buckets[i]->next;
+            free(d->buckets[i]);
+            d->buckets[i] = next;
+        }
+    }
+    d->num_paths = 0;
+}
+
+static void record_change(struct fsmonitor_daemon *d, const char *path,
+                          size_t len) {
+    if (d->num_paths >= d->num_buckets) {
+        size_t num_buckets = d->num_buckets ? d->num_buckets * 2 : 1024;
+        struct changed_path **buckets =
+            calloc(num_buckets, sizeof(*buckets));
+        for (size_t i = 0; i < d->num_buckets; i++) {
+            while (d->buckets[i]) {
+                struct changed_path *change = d->buckets[i];
+                d->buckets[i] = change->next;
+                size_t pos = hash_path(change->path, strlen(change->path)) %
+                             num_buckets;
+                change->next = buckets[pos];
+                buckets[pos] = change;
+            }
+        }
+        free(d->buckets);
+        d->buckets = buckets;
+        d->num_buckets = num_buckets;
+    }
+
+    size_t pos = hash_path(path, len) % d->num_buckets;
+    for (struct changed_path *change = d->buckets[pos]; change;
+         change = change->next) {
+        if (!strncmp(change->path, path, len) && change->path[len] == '\0') {
+            change->seq = d->seq;
+            return;
+        }
+    }
+
+    struct changed_path *change = malloc(sizeof(*change) + len + 1);
+    change->seq = d->seq;
+    memcpy(change->path, path, len);
+    change->path[len] = '\0';
+    change->next = d->buckets[pos];
+    d->buckets[pos] = change;
+    d->num_paths++;
+}
+
+static void set_watch(struct fsmonitor_daemon *d, int wd, const char *path,
+                      size_t len) {
+    if (wd >= d->alloc_watches) {
+        int alloc = d->alloc_watches ? d->alloc_watches : 256;
+        while (alloc <= wd)
+            alloc *= 2;
+        d->watches = realloc(d->watches, alloc * sizeof(*d->watches));
+        memset(d->watches + d->alloc_watches, 0,
+               (alloc - d->alloc_watches) * sizeof(*d->watches));
+        d->alloc_watches = alloc;
+    }
+
+    // A directory moved within the tree keeps its watch under the new name
+    free(d->watches[wd]);
+    d->watches[wd] = malloc(len + 1);
+    memcpy(d->watches[wd], path, len);
+    d->watches[wd][len] = '\0';
+}
+
+// Watches the directory path, "" for the root or ending in '/', and every
+// directory below it. With record set the files found are recorded as
+// changed, they may have been created before their directory was watched.
+static void add_watches(struct fsmonitor_daemon *d, const char *path,
+                        size_t len, int record) {
+    const char *dir_path = len ? path : ".";
+    int wd = inotify_add_watch(d->inotify_fd, dir_path, WATCH_MASK);
+    if (wd < 0) {
+        if (errno != ENOENT && errno != ENOTDIR)
+            fprintf(stderr, "Unable to watch %s: %s\n", dir_path,
+                    strerror(errno));
+        return;
+    }
+    set_watch(d, wd, path, len);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return;
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        const char *name = dirent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") ||
+            (!len && !strcmp(name, ".gblimi")))
+            continue;
+
+        size_t name_len = strlen(name);
+        char *child = malloc(len + name_len + 2);
+        memcpy(child, path, len);
+        memcpy(child + len, name, name_len + 1);
+
+        int is_dir = dirent->d_type == DT_DIR;
+        if (dirent->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = !lstat(child, &st) && S_ISDIR(st.st_mode);
+        }
+
+        if (is_dir) {
+            child[len + name_len] = '/';
+            child[len + name_len + 1] = '\0';
+            add_watches(d, child, len + name_len + 1, record);
+        } else if (record) {
+            record_change(d, child, len + name_len);
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+static void handle_event(struct fsmonitor_daemon *d,
+                         const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        clear_changes(d);
+        d->reset_seq = d->seq;
+        return;
+    }
+
+    if (event->wd < 0 || event->wd >= d->alloc_watches ||
+        !d->watches[event->wd])
+        return;
+
+    const char *dir = d->watches[event->wd];
+    if (event->mask & IN_IGNORED) {
+        free(d->watches[event->wd]);
+        d->watches[event->wd] = NULL;
+        return;
+    }
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!*dir)
+            d->quit = 1;
+        return;
+    }
+    if (!event->len || (!*dir && !strcmp(event->name, ".gblimi")))
+        return;
+
+    // A directory only matters when it comes or goes, its own metadata is
+    // not tracked
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+    if (is_dir && !(event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO)))
+        return;
+
+    size_t dir_len = strlen(dir), name_len = strlen(event->name);
+    char *path = malloc(dir_len + name_len + 2);
+    memcpy(path, dir, dir_len);
+    memcpy(path + dir_len, event->name, name_len);
+    size_t len = dir_len + name_len;
+    if (is_dir)
+        path[len++] = '/';
+    path[len] = '\0';
+
+    if (is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+        add_watches(d, path, len, 1);
+    record_change(d, path, len);
+    free(path);
+}
+
+// Handles every event queued so far. Changes made before a query came in are
+// already queued by then, so draining first keeps answers exact.
+static void read_events(struct fsmonitor_daemon *d) {
+    uint64_t buf[8192];
+    for (;;) {
+        ssize_t n = read(d->inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        char *p = (char *)buf;
+        while (p < (char *)buf + n) {
+            const struct inotify_event *event = (struct inotify_event *)p;
+            handle_event(d, event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+struct reply {
+    char *buf;
+    size_t len;
+    size_t alloc;
+};
+
+static void reply_add(struct reply *reply, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (reply->len + len > reply->alloc) {
+        reply->alloc = (reply->len + len) * 2;
+        reply->buf = realloc(reply->buf, reply->alloc);
+    }
+    memcpy(reply->buf + reply->len, str, len);
+    reply->len += len;
+}
+
+static void answer_query(struct fsmonitor_daemon *d, int fd,
+                         const char *token) {
+    read_events(d);
+
+    // Tokens of another daemon, or from before an overflow, say nothing
+    size_t instance_len = strlen(d->instance);
+    unsigned long long since = 0;
+    int trivial = strncmp(token, d->instance, instance_len) != 0 ||
+                  token[instance_len] != ':' ||
+                  sscanf(token + instance_len + 1, "%llu", &since) != 1 ||
+                  since < d->reset_seq || since > d->seq;
+
+    struct reply reply = {NULL, 0, 0};
+    char new_token[96];
+    snprintf(new_token, sizeof(new_token), "%s:%llu", d->instance,
+             (unsigned long long)d->seq);
+    reply_add(&reply, new_token);
+
+    if (trivial) {
+        reply_add(&reply, "/");
+    } else {
+        for (size_t i = 0; i < d->num_buckets; i++)
+            for (struct changed_path *change = d->buckets[i]; change;
+                 change = change->next)
+                if (change->seq > since)
+                    reply_add(&reply, change->path);
+    }
+    d->seq++;
+
+    write_all(fd, reply.buf, reply.len);
+    free(reply.buf);
+}
+
+static void handle_client(struct fsmonitor_daemon *d, int fd) {
+    // A client that never finishes its request must not stall the daemon
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char request[256];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        if (memchr(request, '\n', len))
+            break;
+    }
+    request[len] = '\0';
+
+    char *newline = strchr(request, '\n');
+    if (!newline)
+        return;
+    *newline = '\0';
+
+    if (!strcmp(request, "quit"))
+        d->quit = 1;
+    else if (!strncmp(request, "query ", 6))
+        answer_query(d, fd, request + 6);
+}
+
+// Sets up the watches and the socket, so clients can query as soon as this
+// returns
+static int init_daemon(struct fsmonitor_daemon *d) {
+    memset(d, 0, sizeof(*d));
+    d->listen_fd = -1;
+
+    int fd = connect_fsmonitor();
+    if (fd >= 0) {
+        close(fd);
+        fprintf(stderr, "fsmonitor is already running\n");
+        return 1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(d->instance, sizeof(d->instance), "%d.%lld.%ld", (int)getpid(),
+             (long long)now.tv_sec, (long)now.tv_nsec);
+
+    d->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (d->inotify_fd < 0) {
+        perror("inotify_init1");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FSMONITOR_SOCKET);
+
+    // Nobody answered, so a socket left behind is stale
+    unlink(FSMONITOR_SOCKET);
+    d->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (d->listen_fd < 0 ||
+        bind(d->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(d->listen_fd, 16) != 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", FSMONITOR_SOCKET,
+                strerror(errno));
+        close(d->inotify_fd);
+        if (d->listen_fd >= 0)
+            close(d->listen_fd);
+        return 1;
+    }
+
+    add_watches(d, "", 0, 0);
+
+    return 0;
+}
+
+static void run_daemon(struct fsmonitor_daemon *d) {
+    while (!d->quit) {
+        struct pollfd fds[2] = {{d->inotify_fd, POLLIN, 0},
+                                {d->listen_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            read_events(d);
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(d->listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                handle_client(d, fd);
+                close(fd);
+            }
+        }
+    }
+
+    unlink(FSMONITOR_SOCKET);
+    close(d->listen_fd);
+    close(d->inotify_fd);
+    clear_changes(d);
+    free(d->buckets);
+    for (int i = 0; i < d->alloc_watches; i++)
+        free(d->watches[i]);
+    free(d->watches);
+}
+
+static int start_daemon(int background) {
+    struct fsmonitor_daemon d;
+    if (init_daemon(&d))
+        return 1;
+
+    if (background) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid > 0) {
+            printf("Started fsmonitor (pid %d)\n", (int)pid);
+            return 0;
+        }
+
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    run_daemon(&d);
+
+    return 0;
+}
+
+#else
+
+static int start_daemon(int background) {
+    (void)background;
+    fprintf(stderr, "fsmonitor needs inotify, which is Linux only\n");
+
+    return 1;
+}
+
+#endif
+
+static int stop_daemon(void) {
+    size_t len;
+    char *reply = fsmonitor_request("quit\n", &len);
+    if (!reply) {
+        fprintf(stderr, "fsmonitor is not running\n");
+        return 1;
+    }
+    free(reply);
+
+    return 0;
+}
+
+static int show_changes(const char *token) {
+    struct fsmonitor_changes changes;
+    if (query_fsmonitor(token, &changes)) {
+        fprintf(stderr, "fsmonitor is not running\n");
+        return 1;
+    }
+
+    printf("%s\n", changes.token);
+    if (changes.trivial)
+        printf("/\n");
+    for (size_t i = 0; i < changes.num_paths; i++)
+        printf("%s\n", changes.paths[i]);
+    clear_fsmonitor_changes(&changes);
+
+    return 0;
+}
+
+// start forks the daemon into the background once it is watching, run
+// keeps it in the foreground. query prints the token to pass next time and
+// the paths changed since the given one.
+int fsmonitor(int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[2], "start"))
+        return start_daemon(1);
+    if (argc == 3 && !strcmp(argv[2], "run"))
+        return start_daemon(0);
+    if (argc == 3 && !strcmp(argv[2], "stop"))
+        return stop_daemon();
+    if ((argc == 3 || argc == 4) && !strcmp(argv[2], "query"))
+        return show_changes(argc == 4 ? argv[3] : NULL);
+
+    fprintf(stderr,
+            "Usage: %s fsmonitor (start | run | stop | query [<token>])\n",
+            argv[0]);
+    return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+#include <stddef.h>
+
+#include "hashfile.h"
+
+#define FSMONITOR_SOCKET ".gblimi/fsmonitor.sock"
+
+// Index extension the valid bits are saved in. The layout is our own, not
+// that of git's FSMN, and the uppercase signature makes git skip it.
+#define FSMONITOR_EXTENSION "GBFM"
+
+struct git_index;
+
+// Reply to a query. paths point into buf, a path ending in '/' stands for
+// everything below that directory. trivial is set when the daemon cannot
+// tell what changed since the token, everything has to be checked then.
+struct fsmonitor_changes {
+    char *token;
+    char **paths;
+    size_t num_paths;
+    int trivial;
+    char *buf;
+};
+
+int fsmonitor_enabled(void);
+
+int query_fsmonitor(const char *token, struct fsmonitor_changes *changes);
+
+void clear_fsmonitor_changes(struct fsmonitor_changes *changes);
+
+void refresh_fsmonitor(struct git_index *index);
+
+void read_fsmonitor_extension(struct git_index *index,
+                              const unsigned char *data, size_t size);
+
+void write_fsmonitor_extension(struct hashfile *f, struct git_index *index);
+
+int fsmonitor(int argc, char **argv);
+
+#endif
@@ -1,4 +1,4 @@
-#include <openssl/sha.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,32 +8,186 @@
 #include <zlib.h>
 
 #include "blob.h"
+#include "hash-object.h"
+#include "hash.h"
+#include "object.h"
+#include "parse-options.h"
+#include "thread-pool.h"
 #include "tree.h"
 
-int hash_object(char *file, int write) {
-    size_t ucompSize;
-    char *blob = blob_file(file, &ucompSize);
+struct hash_job {
+    char *path;
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    int failed;
 
-    char *hash = create_object_hash(blob, ucompSize);
+    // Small files that are only hashed are loaded here and hashed together
+    char header[OBJECT_HEADER_MAX];
+    char *data;
+    size_t len;
+};
 
-    if (write) {
-        size_t compressed_size;
-        char *compressed = compress_object(blob, ucompSize, &compressed_size);
+struct hash_batch {
+    struct hash_job *jobs;
+    int write;
+};
 
-        char *object_path = create_object_store(hash);
+int hash_file(char *file, int write) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    if (stream_blob(file, sha1, write))
+        return 1;
 
-        FILE *object = fopen(object_path, "w");
-        fwrite(compressed, 1, compressed_size, object);
-        fclose(object);
+    char hash[GIT_MAX_HEXSZ + 1];
+    sha1_to_hex(sha1, hash);
+    printf("%s\n", hash);
+
+    return 0;
+}
+
+// Reads a file of at most one chunk into the job, returns 1 when it is bigger
+// or cannot be read and has to go through stream_blob() instead
+static int load_small_file(struct hash_job *job) {
+    struct stat st;
+    if (stat(job->path, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > BLOB_CHUNK_SIZE)
+        return 1;
 
-        free(compressed);
-        free(object_path);
+    FILE *file = fopen(job->path, "rb");
+    if (!file)
+        return 1;
+
+    job->data = malloc(st.st_size + 1);
+    job->len = fread(job->data, 1, st.st_size, file);
+    int failed = ferror(file) || job->len != (size_t)st.st_size;
+    fclose(file);
+    if (failed) {
+        free(job->data);
+        job->data = NULL;
     }
 
-    printf("%s\n", hash);
+    return failed;
+}
 
-    free(blob);
-    free(hash);
+static void hash_batch_job(size_t i, void *data) {
+    struct hash_batch *batch = data;
+    struct hash_job *job = &batch->jobs[i];
+    job->data = NULL;
+    if (!batch->write && !load_small_file(job))
+        return;
 
-    return 0;
+    job->failed = stream_blob(job->path, job->sha1, batch->write);
+}
+
+// Hashes a batch on the worker pool and prints the ids in the order the paths
+// were given, stopping at the first file that failed. Without -w the small
+// files are only read by the pool and then hashed in one hash_buffers() call.
+static int finish_batch(struct hash_batch *batch, size_t num_jobs) {
+    run_parallel(num_jobs, hash_batch_job, batch);
+
+    struct hash_buffer *buffers =
+        malloc((num_jobs + 1) * sizeof(struct hash_buffer));
+    size_t num_buffers = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        struct hash_job *job = &batch->jobs[i];
+        if (!job->data)
+            continue;
+
+        struct hash_buffer *buf = &buffers[num_buffers++];
+        buf->header = job->header;
+        buf->header_len = format_object_header(job->header, "blob", job->len);
+        buf->data = job->data;
+        buf->len = job->len;
+        buf->out = job->sha1;
+        job->failed = 0;
+    }
+    hash_buffers(buffers, num_buffers);
+    free(buffers);
+
+    int ret = 0;
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (!ret && batch->jobs[i].failed) {
+            fprintf(stderr, "Failed to hash %s\n", batch->jobs[i].path);
+            ret = 1;
+        }
+        if (!ret) {
+            char hash[GIT_MAX_HEXSZ + 1];
+            sha1_to_hex(batch->jobs[i].sha1, hash);
+            printf("%s\n", hash);
+        }
+        free(batch->jobs[i].path);
+        free(batch->jobs[i].data);
+    }
+    fflush(stdout);
+
+    return ret;
+}
+
+// Reads one path per line from stdin, hashing them in parallel batches
+int hash_stdin_paths(int write) {
+    struct hash_batch batch = {
+        malloc(HASH_OBJECT_BATCH * sizeof(struct hash_job)), write};
+    size_t num_jobs = 0;
+    int ret = 0;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (!ret && (len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        batch.jobs[num_jobs++].path = strdup(line);
+        if (num_jobs == HASH_OBJECT_BATCH) {
+            ret = finish_batch(&batch, num_jobs);
+            num_jobs = 0;
+        }
+    }
+
+    if (!ret)
+        ret = finish_batch(&batch, num_jobs);
+    else
+        for (size_t i = 0; i < num_jobs; i++)
+            free(batch.jobs[i].path);
+
+    free(line);
+    free(batch.jobs);
+
+    return ret;
+}
+
+int hash_object(int argc, char **argv) {
+    struct option hash_options[] = {
+        {"write", no_argument, NULL, 'w'},
+        {"stdin-paths", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int write = 0, stdin_paths = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "w", hash_options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            write = 1;
+            break;
+        case 's':
+            stdin_paths = 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    char **args;
+    if (command_operands(argc, argv, &args) != !stdin_paths) {
+        fprintf(stderr, "Usage: %s hash-object [-w] <file>\n", argv[0]);
+        fprintf(stderr, "       %s hash-object [-w] --stdin-paths\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (stdin_paths)
+        return hash_stdin_paths(write);
+
+    return hash_file(args[0], write);
 }
@@ -10,6 +10,14 @@
 #include <unistd.h>
 #include <zlib.h>
 
-int hash_object(char *file, int write);
+// Paths read with --stdin-paths are hashed this many at a time, results are
+// printed as each batch completes
+#define HASH_OBJECT_BATCH 1024
+
+int hash_file(char *file, int write);
+
+int hash_stdin_paths(int write);
+
+int hash_object(int argc, char **argv);
 
 #endif
@@ -0,0 +1,108 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "hash.h"
+#include "thread-pool.h"
+
+static const struct git_hash_algo hash_algos[] = {
+    {"sha1", GIT_SHA1_RAWSZ, GIT_SHA1_HEXSZ, "SHA1"},
+    {"sha256", GIT_SHA256_RAWSZ, GIT_SHA256_HEXSZ, "SHA256"},
+};
+
+static const struct git_hash_algo *repo_algo;
+static EVP_MD *repo_md;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+const struct git_hash_algo *hash_algo_by_name(const char *name) {
+    for (size_t i = 0; i < sizeof(hash_algos) / sizeof(hash_algos[0]); i++)
+        if (!strcmp(hash_algos[i].name, name))
+            return &hash_algos[i];
+
+    return NULL;
+}
+
+// The digest is fetched from the provider once, initializing contexts with
+// it then skips the implicit fetch EVP_sha1() would cost every time
+static void load_hash_algo(void) {
+    char *name = get_config("extensions.objectFormat");
+    repo_algo = hash_algo_by_name(name ? name : "sha1");
+    if (!repo_algo) {
+        fprintf(stderr, "Unknown object format %s\n", name);
+        exit(1);
+    }
+    free(name);
+
+    repo_md = EVP_MD_fetch(NULL, repo_algo->evp_name, NULL);
+    if (!repo_md) {
+        fprintf(stderr, "%s is not available\n", repo_algo->evp_name);
+        exit(1);
+    }
+}
+
+const struct git_hash_algo *hash_algo(void) {
+    pthread_once(&hash_once, load_hash_algo);
+    return repo_algo;
+}
+
+EVP_MD_CTX *hash_ctx_new(void) {
+    pthread_once(&hash_once, load_hash_algo);
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, repo_md, NULL);
+
+    return ctx;
+}
+
+// Starts a new digest on a context that was already used
+void hash_ctx_reset(EVP_MD_CTX *ctx) {
+    EVP_DigestInit_ex(ctx, repo_md, NULL);
+}
+
+void hash_ctx_final(EVP_MD_CTX *ctx, unsigned char *out) {
+    EVP_DigestFinal_ex(ctx, out, NULL);
+}
+
+void hash_data(const void *data, size_t len, unsigned char *out) {
+    EVP_MD_CTX *ctx = hash_ctx_new();
+    EVP_DigestUpdate(ctx, data, len);
+    hash_ctx_final(ctx, out);
+    EVP_MD_CTX_free(ctx);
+}
+
+struct hash_buffers_ctx {
+    struct hash_buffer *buffers;
+    size_t num_buffers;
+};
+
+static void hash_buffers_job(size_t i, void *data) {
+    struct hash_buffers_ctx *ctx = data;
+    size_t start = i * HASH_BUFFERS_PER_JOB;
+    size_t end = start + HASH_BUFFERS_PER_JOB;
+    if (end > ctx->num_buffers)
+        end = ctx->num_buffers;
+
+    EVP_MD_CTX *md_ctx = hash_ctx_new();
+    for (size_t j = start; j < end; j++) {
+        struct hash_buffer *buf = &ctx->buffers[j];
+        if (j > start)
+            hash_ctx_reset(md_ctx);
+        if (buf->header)
+            EVP_DigestUpdate(md_ctx, buf->header, buf->header_len);
+        EVP_DigestUpdate(md_ctx, buf->data, buf->len);
+        hash_ctx_final(md_ctx, buf->out);
+    }
+    EVP_MD_CTX_free(md_ctx);
+}
+
+// Hashes many small buffers at once. OpenSSL offers no multi-lane digest
+// through EVP, so runs of buffers are spread over the cores and each run
+// reuses a single context instead of setting one up per buffer.
+void hash_buffers(struct hash_buffer *buffers, size_t num_buffers) {
+    struct hash_buffers_ctx ctx = {buffers, num_buffers};
+    run_parallel((num_buffers + HASH_BUFFERS_PER_JOB - 1) /
+                     HASH_BUFFERS_PER_JOB,
+                 hash_buffers_job, &ctx);
+}
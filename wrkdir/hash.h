@@ -0,0 +1,52 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <openssl/evp.h>
+#include <stddef.h>
+
+#define GIT_SHA1_RAWSZ 20
+#define GIT_SHA1_HEXSZ 40
+#define GIT_SHA256_RAWSZ 32
+#define GIT_SHA256_HEXSZ 64
+
+// Big enough for an object id of any supported algorithm
+#define GIT_MAX_RAWSZ GIT_SHA256_RAWSZ
+#define GIT_MAX_HEXSZ GIT_SHA256_HEXSZ
+
+// Buffers handed to hash_buffers() are split into runs of this many per job
+#define HASH_BUFFERS_PER_JOB 64
+
+// The object id algorithm of a repository, chosen at init and recorded as
+// extensions.objectFormat in its config
+struct git_hash_algo {
+    const char *name;
+    size_t rawsz;
+    size_t hexsz;
+    const char *evp_name;
+};
+
+// One input of hash_buffers(), the digest of header followed by data is
+// written to out. header may be NULL.
+struct hash_buffer {
+    const void *header;
+    size_t header_len;
+    const void *data;
+    size_t len;
+    unsigned char *out;
+};
+
+const struct git_hash_algo *hash_algo_by_name(const char *name);
+
+const struct git_hash_algo *hash_algo(void);
+
+EVP_MD_CTX *hash_ctx_new(void);
+
+void hash_ctx_reset(EVP_MD_CTX *ctx);
+
+void hash_ctx_final(EVP_MD_CTX *ctx, unsigned char *out);
+
+void hash_data(const void *data, size_t len, unsigned char *out);
+
+void hash_buffers(struct hash_buffer *buffers, size_t num_buffers);
+
+#endif
@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "hashfile.h"
+
+void hashfile_init(struct hashfile *f, int fd) {
+    f->fd = fd;
+    f->ctx = hash_ctx_new();
+    f->buf = malloc(HASHFILE_BUFFER_SIZE);
+    f->len = 0;
+    f->total = 0;
+    f->error = 0;
+}
+
+static void hashfile_flush(struct hashfile *f) {
+    EVP_DigestUpdate(f->ctx, f->buf, f->len);
+
+    size_t written = 0;
+    while (!f->error && written < f->len) {
+        ssize_t ret = write(f->fd, f->buf + written, f->len - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            f->error = 1;
+        else
+            written += ret;
+    }
+
+    f->len = 0;
+}
+
+void hashfile_write(struct hashfile *f, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    f->total += len;
+
+    while (len > 0) {
+        size_t chunk = HASHFILE_BUFFER_SIZE - f->len;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(f->buf + f->len, bytes, chunk);
+        f->len += chunk;
+        bytes += chunk;
+        len -= chunk;
+
+        if (f->len == HASHFILE_BUFFER_SIZE)
+            hashfile_flush(f);
+    }
+}
+
+void hashfile_be32(struct hashfile *f, uint32_t value) {
+    unsigned char buf[4] = {value >> 24, value >> 16, value >> 8, value};
+    hashfile_write(f, buf, 4);
+}
+
+void hashfile_be16(struct hashfile *f, uint16_t value) {
+    unsigned char buf[2] = {value >> 8, value};
+    hashfile_write(f, buf, 2);
+}
+
+// Appends the checksum of everything written so far, flushes and fsyncs the
+// file. The checksum is also copied out when requested.
+int hashfile_finish(struct hashfile *f, unsigned char *checksum) {
+    unsigned char digest[GIT_MAX_RAWSZ];
+    size_t rawsz = hash_algo()->rawsz;
+
+    hashfile_flush(f);
+    hash_ctx_final(f->ctx, digest);
+    EVP_MD_CTX_free(f->ctx);
+    free(f->buf);
+
+    size_t written = 0;
+    while (!f->error && written < rawsz) {
+        ssize_t ret = write(f->fd, digest + written, rawsz - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            f->error = 1;
+        else
+            written += ret;
+    }
+    f->total += rawsz;
+
+    if (!f->error && fsync(f->fd) != 0)
+        f->error = 1;
+
+    if (checksum)
+        memcpy(checksum, digest, rawsz);
+
+    return f->error;
+}
+
+// Creates path.lock exclusively, a second writer fails instead of racing
+int hold_lock_file(const char *path, char *lock_path, size_t lock_path_len) {
+    snprintf(lock_path, lock_path_len, "%s.lock", path);
+
+    int fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        fprintf(stderr, "Unable to create %s: %s\n", lock_path,
+                strerror(errno));
+
+    return fd;
+}
+
+// Finishes the file written through the lock and atomically renames it over
+// path, on any failure the lock is removed and path is left untouched
+int commit_lock_file(struct hashfile *f, const char *lock_path,
+                     const char *path) {
+    int ret = hashfile_finish(f, NULL);
+    if (close(f->fd) != 0)
+        ret = 1;
+
+    if (!ret && rename(lock_path, path) != 0)
+        ret = 1;
+
+    if (ret) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        unlink(lock_path);
+    }
+
+    return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef HASHFILE_H
+#define HASHFILE_H
+
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASHFILE_BUFFER_SIZE (128 * 1024)
+
+// Buffered writer that keeps a running hash of everything written through it
+// so a trailing checksum never needs the file to be read back
+struct hashfile {
+    int fd;
+    EVP_MD_CTX *ctx;
+    unsigned char *buf;
+    size_t len;
+    size_t total;
+    int error;
+};
+
+void hashfile_init(struct hashfile *f, int fd);
+
+void hashfile_write(struct hashfile *f, const void *data, size_t len);
+
+void hashfile_be32(struct hashfile *f, uint32_t value);
+
+void hashfile_be16(struct hashfile *f, uint16_t value);
+
+int hashfile_finish(struct hashfile *f, unsigned char *checksum);
+
+int hold_lock_file(const char *path, char *lock_path, size_t lock_path_len);
+
+int commit_lock_file(struct hashfile *f, const char *lock_path,
+                     const char *path);
+
+#endif
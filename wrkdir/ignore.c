@@ -0,0 +1,753 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ignore.h"
+#include "index.h"
+#include "parse-options.h"
+
+// Patterns without wildcards are looked up in sorted literal sets: plain
+// names, whole paths, and the suffix of "*.o" or prefix of "tmp*" style
+// names. Everything else is compiled into one automaton per list for names
+// and one for paths, which follows every pattern at once in a single pass
+// over the string instead of trying them one after the other.
+
+enum glob_op_type {
+    OP_CHAR,       // The character c
+    OP_ANY,        // ? matches any character but '/'
+    OP_CLASS,      // [...], arg is the class
+    OP_STAR,       // * matches any run without '/'
+    OP_STARSTAR,   // Trailing /** matches anything below
+    OP_DIRS,       // **/ matches zero or more leading directories, with the
+    OP_DIRS_INNER, // state following it being inside one of them
+    OP_MATCH,      // Pattern arg matched if the string ends here
+};
+
+struct glob_op {
+    unsigned char type;
+    unsigned char c;
+    int arg;
+};
+
+struct glob_automaton {
+    struct glob_op *ops;
+    size_t num_ops;
+    size_t alloc_ops;
+    unsigned char (*classes)[32];
+    size_t num_classes;
+    int *starts;
+    size_t num_starts;
+};
+
+struct literal {
+    char *key;
+    size_t len;
+    int rule;
+};
+
+// Sorted by length then bytes, lens lists every distinct key length
+struct literal_set {
+    struct literal *items;
+    size_t num;
+    size_t alloc;
+    size_t *lens;
+    size_t num_lens;
+};
+
+struct ignore_list {
+    char *source;
+    struct ignore_rule *rules;
+    size_t num_rules;
+    size_t alloc_rules;
+    struct literal_set names;
+    struct literal_set paths;
+    struct literal_set suffixes;
+    struct literal_set prefixes;
+    struct glob_automaton name_globs;
+    struct glob_automaton path_globs;
+};
+
+static void add_literal(struct literal_set *set, const char *key, size_t len,
+                        int rule) {
+    if (set->num == set->alloc) {
+        set->alloc = set->alloc ? set->alloc * 2 : 16;
+        set->items = realloc(set->items, set->alloc * sizeof(*set->items));
+    }
+    struct literal *literal = &set->items[set->num++];
+    literal->key = malloc(len + 1);
+    memcpy(literal->key, key, len);
+    literal->key[len] = '\0';
+    literal->len = len;
+    literal->rule = rule;
+}
+
+static int compare_literal_keys(const char *a, size_t a_len, const char *b,
+                                size_t b_len) {
+    if (a_len != b_len)
+        return a_len < b_len ? -1 : 1;
+
+    return memcmp(a, b, a_len);
+}
+
+static int compare_literals(const void *a, const void *b) {
+    const struct literal *x = a, *y = b;
+    int cmp = compare_literal_keys(x->key, x->len, y->key, y->len);
+    return cmp ? cmp : x->rule - y->rule;
+}
+
+static void finish_literal_set(struct literal_set *set) {
+    qsort(set->items, set->num, sizeof(*set->items), compare_literals);
+    set->lens = malloc((set->num + 1) * sizeof(*set->lens));
+    for (size_t i = 0; i < set->num; i++)
+        if (!set->num_lens || set->lens[set->num_lens - 1] != set->items[i].len)
+            set->lens[set->num_lens++] = set->items[i].len;
+}
+
+static void free_literal_set(struct literal_set *set) {
+    for (size_t i = 0; i < set->num; i++)
+        free(set->items[i].key);
+    free(set->items);
+    free(set->lens);
+}
+
+// Later rules override earlier ones, dir-only rules do not apply to files
+static void consider_rule(const struct ignore_list *list, int rule,
+                          int is_dir, int *best) {
+    if (rule > *best && (is_dir || !list->rules[rule].dir_only))
+        *best = rule;
+}
+
+static void match_literals(const struct ignore_list *list,
+                           const struct literal_set *set, const char *key,
+                           size_t len, int is_dir, int *best) {
+    size_t low = 0, high = set->num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        struct literal *literal = &set->items[mid];
+        if (compare_literal_keys(literal->key, literal->len, key, len) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (; low < set->num; low++) {
+        struct literal *literal = &set->items[low];
+        if (literal->len != len || memcmp(literal->key, key, len) != 0)
+            break;
+        consider_rule(list, literal->rule, is_dir, best);
+    }
+}
+
+static struct glob_op *push_op(struct glob_automaton *a, int type,
+                               unsigned char c, int arg) {
+    if (a->num_ops == a->alloc_ops) {
+        a->alloc_ops = a->alloc_ops ? a->alloc_ops * 2 : 64;
+        a->ops = realloc(a->ops, a->alloc_ops * sizeof(*a->ops));
+    }
+    struct glob_op *op = &a->ops[a->num_ops++];
+    op->type = type;
+    op->c = c;
+    op->arg = arg;
+
+    return op;
+}
+
+// Parses the bracket expression starting at p[i] == '['. Returns the index
+// past its ']', or 0 when it is not closed and '[' is a plain character.
+static size_t compile_class(struct glob_automaton *a, const char *p,
+                            size_t len, size_t i) {
+    unsigned char class[32] = {0};
+    size_t j = i + 1;
+    int negated = j < len && (p[j] == '!' || p[j] == '^');
+    if (negated)
+        j++;
+
+    size_t first = j;
+    while (j < len && (p[j] != ']' || j == first)) {
+        unsigned char lo = p[j];
+        if (lo == '\\' && j + 1 < len)
+            lo = p[++j];
+        unsigned char hi = lo;
+        if (j + 2 < len && p[j + 1] == '-' && p[j + 2] != ']') {
+            j += 2;
+            hi = p[j];
+            if (hi == '\\' && j + 1 < len)
+                hi = p[++j];
+        }
+        for (unsigned c = lo; c <= hi; c++)
+            class[c / 8] |= 1 << (c % 8);
+        j++;
+    }
+    if (j >= len)
+        return 0;
+
+    if (negated)
+        for (int k = 0; k < 32; k++)
+            class[k] = ~class[k];
+
+    a->classes = realloc(a->classes, (a->num_classes + 1) * sizeof(class));
+    memcpy(a->classes[a->num_classes], class, sizeof(class));
+    push_op(a, OP_CLASS, 0, a->num_classes++);
+
+    return j + 1;
+}
+
+// Appends the states of one pattern. In a path pattern "**" as a whole
+// component spans directories, anywhere else it is a plain '*'.
+static void compile_glob(struct glob_automaton *a, const char *p, size_t len,
+                         int is_path, int rule) {
+    a->starts = realloc(a->starts, (a->num_starts + 1) * sizeof(*a->starts));
+    a->starts[a->num_starts++] = a->num_ops;
+
+    size_t i = 0, next;
+    while (i < len) {
+        char c = p[i];
+        if (c == '*') {
+            size_t run = 1;
+            while (i + run < len && p[i + run] == '*')
+                run++;
+            int whole = run >= 2 && is_path && (i == 0 || p[i - 1] == '/') &&
+                        (i + run == len || p[i + run] == '/');
+            if (whole && i + run == len) {
+                push_op(a, OP_STARSTAR, 0, 0);
+            } else if (whole) {
+                push_op(a, OP_DIRS, 0, 0);
+                push_op(a, OP_DIRS_INNER, 0, 0);
+                run++;
+            } else {
+                push_op(a, OP_STAR, 0, 0);
+            }
+            i += run;
+        } else if (c == '?') {
+            push_op(a, OP_ANY, 0, 0);
+            i++;
+        } else if (c == '[' && (next = compile_class(a, p, len, i)) != 0) {
+            i = next;
+        } else if (c == '\\' && i + 1 < len) {
+            push_op(a, OP_CHAR, p[i + 1], 0);
+            i += 2;
+        } else {
+            push_op(a, OP_CHAR, c, 0);
+            i++;
+        }
+    }
+    push_op(a, OP_MATCH, 0, rule);
+}
+
+static void add_state(const struct glob_automaton *a, uint64_t *set,
+                      size_t state) {
+    while (!((set[state / 64] >> (state % 64)) & 1)) {
+        set[state / 64] |= (uint64_t)1 << (state % 64);
+        int type = a->ops[state].type;
+        if (type == OP_STAR || type == OP_STARSTAR)
+            state++;
+        else if (type == OP_DIRS)
+            state += 2;
+        else
+            return;
+    }
+}
+
+#define STACK_SET_WORDS 64
+
+// Runs every pattern of the automaton over str at once, tracking the set of
+// live states, and keeps the latest rule that matched the whole string
+static void match_globs(const struct ignore_list *list,
+                        const struct glob_automaton *a, const char *str,
+                        size_t len, int is_dir, int *best) {
+    if (!a->num_starts)
+        return;
+
+    size_t words = (a->num_ops + 63) / 64;
+    uint64_t stack[2 * STACK_SET_WORDS];
+    uint64_t *sets = words <= STACK_SET_WORDS
+                         ? stack
+                         : malloc(2 * words * sizeof(uint64_t));
+    uint64_t *cur = sets, *next = sets + words;
+
+    memset(cur, 0, words * sizeof(uint64_t));
+    for (size_t i = 0; i < a->num_starts; i++)
+        add_state(a, cur, a->starts[i]);
+
+    int live = 1;
+    for (size_t k = 0; live && k < len; k++) {
+        unsigned char c = str[k];
+        memset(next, 0, words * sizeof(uint64_t));
+        live = 0;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t bits = cur[w];
+            while (bits) {
+                size_t state = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                const struct glob_op *op = &a->ops[state];
+                switch (op->type) {
+                case OP_CHAR:
+                    if (c == op->c)
+                        add_state(a, next, state + 1);
+                    break;
+                case OP_ANY:
+                    if (c != '/')
+                        add_state(a, next, state + 1);
+                    break;
+                case OP_CLASS:
+                    if (c != '/' && (a->classes[op->arg][c / 8] >> (c % 8)) & 1)
+                        add_state(a, next, state + 1);
+                    break;
+                case OP_STAR:
+                    if (c != '/')
+                        add_state(a, next, state);
+                    break;
+                case OP_STARSTAR:
+                    add_state(a, next, state);
+                    break;
+                case OP_DIRS:
+                    add_state(a, next, c == '/' ? state : state + 1);
+                    break;
+                case OP_DIRS_INNER:
+                    add_state(a, next, c == '/' ? state - 1 : state);
+                    break;
+                }
+                live = 1;
+            }
+        }
+
+        uint64_t *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    for (size_t w = 0; live && w < words; w++) {
+        uint64_t bits = cur[w];
+        while (bits) {
+            size_t state = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (a->ops[state].type == OP_MATCH)
+                consider_rule(list, a->ops[state].arg, is_dir, best);
+        }
+    }
+
+    if (sets != stack)
+        free(sets);
+}
+
+static void free_glob_automaton(struct glob_automaton *a) {
+    free(a->ops);
+    free(a->classes);
+    free(a->starts);
+}
+
+static const char *find_last(const char *s, char c, size_t len) {
+    while (len--)
+        if (s[len] == c)
+            return s + len;
+
+    return NULL;
+}
+
+static int has_glob_chars(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (strchr("*?[\\", p[i]))
+            return 1;
+
+    return 0;
+}
+
+// Parses one line the way git reads .gitignore: '#' starts a comment, '!'
+// negates, a trailing '/' only matches directories and a pattern with a
+// slash anywhere else is matched against the path relative to the file's
+// directory instead of against the name alone.
+static void add_pattern(struct ignore_list *list, const char *line,
+                        size_t len, int line_no) {
+    if (len && line[len - 1] == '\r')
+        len--;
+    while (len && line[len - 1] == ' ' && !(len >= 2 && line[len - 2] == '\\'))
+        len--;
+    if (!len || line[0] == '#')
+        return;
+
+    const char *p = line;
+    size_t plen = len;
+    int negated = p[0] == '!';
+    if (negated) {
+        p++;
+        plen--;
+    }
+    int dir_only = plen && p[plen - 1] == '/';
+    if (dir_only)
+        plen--;
+    int is_path = memchr(p, '/', plen) != NULL;
+    if (plen && p[0] == '/') {
+        p++;
+        plen--;
+    }
+    if (!plen)
+        return;
+
+    if (list->num_rules == list->alloc_rules) {
+        list->alloc_rules = list->alloc_rules ? list->alloc_rules * 2 : 16;
+        list->rules =
+            realloc(list->rules, list->alloc_rules * sizeof(*list->rules));
+    }
+    int rule = list->num_rules++;
+    struct ignore_rule *r = &list->rules[rule];
+    r->source = list->source;
+    r->line = line_no;
+    r->pattern = malloc(len + 1);
+    memcpy(r->pattern, line, len);
+    r->pattern[len] = '\0';
+    r->negated = negated;
+    r->dir_only = dir_only;
+
+    if (!has_glob_chars(p, plen))
+        add_literal(is_path ? &list->paths : &list->names, p, plen, rule);
+    else if (!is_path && p[0] == '*' && !has_glob_chars(p + 1, plen - 1))
+        add_literal(&list->suffixes, p + 1, plen - 1, rule);
+    else if (!is_path && p[plen - 1] == '*' && !has_glob_chars(p, plen - 1))
+        add_literal(&list->prefixes, p, plen - 1, rule);
+    else
+        compile_glob(is_path ? &list->path_globs : &list->name_globs, p, plen,
+                     is_path, rule);
+}
+
+struct ignore_list *compile_ignore_list(const char *buf, size_t len,
+                                        const char *source) {
+    struct ignore_list *list = calloc(1, sizeof(*list));
+    list->source = strdup(source);
+
+    int line_no = 0;
+    const char *end = buf + len;
+    while (buf < end) {
+        const char *newline = memchr(buf, '\n', end - buf);
+        const char *line_end = newline ? newline : end;
+        add_pattern(list, buf, line_end - buf, ++line_no);
+        buf = line_end + 1;
+    }
+
+    finish_literal_set(&list->names);
+    finish_literal_set(&list->paths);
+    finish_literal_set(&list->suffixes);
+    finish_literal_set(&list->prefixes);
+
+    return list;
+}
+
+// Returns NULL when the file does not exist or holds no rules
+struct ignore_list *read_ignore_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    char *buf = NULL;
+    ssize_t len = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        buf = malloc(st.st_size + 1);
+        len = read(fd, buf, st.st_size);
+    }
+    close(fd);
+    if (len < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    struct ignore_list *list = compile_ignore_list(buf, len, path);
+    free(buf);
+    if (!list->num_rules) {
+        free_ignore_list(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+void free_ignore_list(struct ignore_list *list) {
+    if (!list)
+        return;
+
+    for (size_t i = 0; i < list->num_rules; i++)
+        free(list->rules[i].pattern);
+    free(list->rules);
+    free_literal_set(&list->names);
+    free_literal_set(&list->paths);
+    free_literal_set(&list->suffixes);
+    free_literal_set(&list->prefixes);
+    free_glob_automaton(&list->name_globs);
+    free_glob_automaton(&list->path_globs);
+    free(list->source);
+    free(list);
+}
+
+// Returns the rule of the list deciding about path, which is relative to the
+// list's directory, or NULL when none matches. The caller checks negated.
+const struct ignore_rule *match_ignore_list(const struct ignore_list *list,
+                                            const char *path, size_t len,
+                                            int is_dir) {
+    const char *slash = find_last(path, '/', len);
+    const char *name = slash ? slash + 1 : path;
+    size_t name_len = len - (name - path);
+    int best = -1;
+
+    match_literals(list, &list->names, name, name_len, is_dir, &best);
+    match_literals(list, &list->paths, path, len, is_dir, &best);
+    for (size_t i = 0; i < list->suffixes.num_lens; i++) {
+        size_t n = list->suffixes.lens[i];
+        if (n <= name_len)
+            match_literals(list, &list->suffixes, name + name_len - n, n,
+                           is_dir, &best);
+    }
+    for (size_t i = 0; i < list->prefixes.num_lens; i++) {
+        size_t n = list->prefixes.lens[i];
+        if (n <= name_len)
+            match_literals(list, &list->prefixes, name, n, is_dir, &best);
+    }
+    match_globs(list, &list->name_globs, name, name_len, is_dir, &best);
+    match_globs(list, &list->path_globs, path, len, is_dir, &best);
+
+    return best >= 0 ? &list->rules[best] : NULL;
+}
+
+// Loaded ignore files by directory, shared by the threads of a scan. The
+// exclude file sits below the top-level ignore file as its parent.
+struct ignore_tree {
+    pthread_mutex_t lock;
+    struct ignore_dir **buckets;
+    size_t num_buckets;
+    size_t num_dirs;
+    struct ignore_dir exclude;
+};
+
+struct ignore_tree *ignore_tree_new(void) {
+    struct ignore_tree *tree = calloc(1, sizeof(*tree));
+    pthread_mutex_init(&tree->lock, NULL);
+    tree->exclude.list = read_ignore_file(EXCLUDE_FILE);
+    tree->exclude.path = strdup("");
+
+    return tree;
+}
+
+void ignore_tree_free(struct ignore_tree *tree) {
+    for (size_t i = 0; i < tree->num_buckets; i++) {
+        while (tree->buckets[i]) {
+            struct ignore_dir *next = tree->buckets[i]->next;
+            free_ignore_list(tree->buckets[i]->list);
+            free(tree->buckets[i]->path);
+            free(tree->buckets[i]);
+            tree->buckets[i] = next;
+        }
+    }
+    free(tree->buckets);
+    free_ignore_list(tree->exclude.list);
+    free(tree->exclude.path);
+    pthread_mutex_destroy(&tree->lock);
+    free(tree);
+}
+
+static size_t hash_dir(const char *path, size_t len) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+
+    return hash;
+}
+
+static struct ignore_dir *lookup_dir(struct ignore_tree *tree,
+                                     const char *dir, size_t len) {
+    if (tree->num_buckets) {
+        size_t pos = hash_dir(dir, len) % tree->num_buckets;
+        for (struct ignore_dir *d = tree->buckets[pos]; d; d = d->next)
+            if (d->base_len == len && !memcmp(d->path, dir, len))
+                return d;
+    }
+
+    struct ignore_dir *parent = &tree->exclude;
+    if (len) {
+        const char *slash = find_last(dir, '/', len - 1);
+        parent = lookup_dir(tree, dir, slash ? (size_t)(slash - dir) + 1 : 0);
+    }
+
+    if (tree->num_dirs >= tree->num_buckets) {
+        size_t num_buckets = tree->num_buckets ? tree->num_buckets * 2 : 64;
+        struct ignore_dir **buckets = calloc(num_buckets, sizeof(*buckets));
+        for (size_t i = 0; i < tree->num_buckets; i++) {
+            while (tree->buckets[i]) {
+                struct ignore_dir *d = tree->buckets[i];
+                tree->buckets[i] = d->next;
+                size_t pos = hash_dir(d->path, d->base_len) % num_buckets;
+                d->next = buckets[pos];
+                buckets[pos] = d;
+            }
+        }
+        free(tree->buckets);
+        tree->buckets = buckets;
+        tree->num_buckets = num_buckets;
+    }
+
+    struct ignore_dir *d = calloc(1, sizeof(*d));
+    d->parent = parent;
+    d->base_len = len;
+    d->path = malloc(len + sizeof(IGNORE_FILE));
+    memcpy(d->path, dir, len);
+    memcpy(d->path + len, IGNORE_FILE, sizeof(IGNORE_FILE));
+    d->list = read_ignore_file(d->path);
+    d->path[len] = '\0';
+
+    size_t pos = hash_dir(dir, len) % tree->num_buckets;
+    d->next = tree->buckets[pos];
+    tree->buckets[pos] = d;
+    tree->num_dirs++;
+
+    return d;
+}
+
+// Returns the rules for the directory dir, "" for the top or ending in '/',
+// reading its ignore file and those above it on first use
+struct ignore_dir *get_ignore_dir(struct ignore_tree *tree, const char *dir,
+                                  size_t len) {
+    pthread_mutex_lock(&tree->lock);
+    struct ignore_dir *d = lookup_dir(tree, dir, len);
+    pthread_mutex_unlock(&tree->lock);
+
+    return d;
+}
+
+// Matches path, relative to the top, against the rules of its directory
+// first and then those above it, the innermost file with a match decides
+const struct ignore_rule *match_ignore_dir(const struct ignore_dir *dir,
+                                           const char *path, size_t len,
+                                           int is_dir) {
+    for (; dir; dir = dir->parent) {
+        if (!dir->list)
+            continue;
+        const struct ignore_rule *rule = match_ignore_list(
+            dir->list, path + dir->base_len, len - dir->base_len, is_dir);
+        if (rule)
+            return rule;
+    }
+
+    return NULL;
+}
+
+// Whether path is ignored, itself or because a directory above it is. rule
+// is set to the deciding rule, which may be a negated one.
+int is_path_ignored(struct ignore_tree *tree, const char *path, int is_dir,
+                    const struct ignore_rule **rule) {
+    size_t len = strlen(path), dir_len = 0;
+    const struct ignore_rule *match;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] != '/')
+            continue;
+        match = match_ignore_dir(get_ignore_dir(tree, path, dir_len), path, i,
+                                 1);
+        if (match && !match->negated) {
+            *rule = match;
+            return 1;
+        }
+        dir_len = i + 1;
+    }
+
+    match = match_ignore_dir(get_ignore_dir(tree, path, dir_len), path, len,
+                             is_dir);
+    *rule = match;
+
+    return match && !match->negated;
+}
+
+// Prints the path when it is ignored, with -v along with the rule deciding
+// about it even when that rule re-includes it. Tracked paths are never
+// ignored. Returns 1 when the path is ignored.
+static int check_ignore_path(struct ignore_tree *tree, struct git_index *index,
+                             char *arg, int verbose) {
+    char *path = arg;
+    while (!strncmp(path, "./", 2) && path[2] != '\0')
+        path += 2;
+
+    size_t len = strlen(path);
+    int is_dir = len && path[len - 1] == '/';
+    char *copy = strdup(path);
+    while (len > 1 && copy[len - 1] == '/')
+        copy[--len] = '\0';
+
+    struct stat st;
+    if (!is_dir && lstat(copy, &st) == 0)
+        is_dir = S_ISDIR(st.st_mode);
+
+    const struct ignore_rule *rule = NULL;
+    int ignored = 0;
+    if (index_pos(index, copy) < 0)
+        ignored = is_path_ignored(tree, copy, is_dir, &rule);
+    free(copy);
+
+    if (verbose && rule)
+        printf("%s:%d:%s\t%s\n", rule->source, rule->line, rule->pattern, arg);
+    else if (ignored)
+        printf("%s\n", arg);
+
+    return ignored;
+}
+
+// check-ignore [-v] (--stdin | <path>...) prints the paths that are ignored
+// and exits with 1 when none is. With --stdin the paths are read one per
+// line and the rules of every directory are only compiled once.
+int check_ignore(int argc, char **argv) {
+    struct option check_ignore_options[] = {
+        {"verbose", no_argument, NULL, 'v'},
+        {"stdin", no_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int verbose = 0, from_stdin = 0, bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "v", check_ignore_options, NULL)) !=
+           -1) {
+        if (c == 'v')
+            verbose = 1;
+        else if (c == 's')
+            from_stdin = 1;
+        else
+            bad_usage = 1;
+    }
+
+    char **paths;
+    int num_paths = command_operands(argc, argv, &paths);
+    if (bad_usage || (from_stdin ? num_paths != 0 : num_paths < 1)) {
+        fprintf(stderr, "Usage: %s check-ignore [-v] (--stdin | <path>...)\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct git_index index;
+    if (read_index(&index) == 1)
+        return 1;
+    sort_entries(&index);
+    struct ignore_tree *tree = ignore_tree_new();
+
+    int matched = 0;
+    if (from_stdin) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, stdin)) > 0) {
+            if (line[len - 1] == '\n')
+                line[--len] = '\0';
+            if (len)
+                matched |= check_ignore_path(tree, &index, line, verbose);
+        }
+        free(line);
+    } else {
+        for (int i = 0; i < num_paths; i++)
+            matched |= check_ignore_path(tree, &index, paths[i], verbose);
+    }
+
+    ignore_tree_free(tree);
+    discard_index(&index);
+
+    return !matched;
+}
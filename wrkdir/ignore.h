@@ -0,0 +1,59 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stddef.h>
+
+#define IGNORE_FILE ".gblimiignore"
+#define EXCLUDE_FILE ".gblimi/info/exclude"
+
+// One line of an ignore file. pattern is kept as written for check-ignore.
+struct ignore_rule {
+    const char *source;
+    int line;
+    char *pattern;
+    int negated;
+    int dir_only;
+};
+
+struct ignore_list;
+
+// The rules of one directory and, through parent, of every directory above
+// it. base_len is the length of its path including the trailing slash.
+struct ignore_dir {
+    struct ignore_dir *parent;
+    struct ignore_list *list;
+    char *path;
+    size_t base_len;
+    struct ignore_dir *next;
+};
+
+struct ignore_tree;
+
+struct ignore_list *compile_ignore_list(const char *buf, size_t len,
+                                        const char *source);
+
+struct ignore_list *read_ignore_file(const char *path);
+
+void free_ignore_list(struct ignore_list *list);
+
+const struct ignore_rule *match_ignore_list(const struct ignore_list *list,
+                                            const char *path, size_t len,
+                                            int is_dir);
+
+struct ignore_tree *ignore_tree_new(void);
+
+void ignore_tree_free(struct ignore_tree *tree);
+
+struct ignore_dir *get_ignore_dir(struct ignore_tree *tree, const char *dir,
+                                  size_t len);
+
+const struct ignore_rule *match_ignore_dir(const struct ignore_dir *dir,
+                                           const char *path, size_t len,
+                                           int is_dir);
+
+int is_path_ignored(struct ignore_tree *tree, const char *path, int is_dir,
+                    const struct ignore_rule **rule);
+
+int check_ignore(int argc, char **argv);
+
+#endif
@@ -1,252 +1,661 @@
+#include <fcntl.h>
+
 #include "index.h"
 #include "blob.h"
+#include "cache-tree.h"
+#include "fsmonitor.h"
+#include "hash.h"
+#include "hashfile.h"
+#include "ignore.h"
+#include "object.h"
+#include "thread-pool.h"
 #include "uint-util.h"
 
-int search_index(struct git_index_header header,
-                 struct git_index_entry *entries, struct stat *file_stat,
-                 char *path, int *found) {
-    if (stat(path, file_stat) != 0) {
-        perror("Failed to get file stats");
+// An entry whose mtime is not older than the index file itself could have
+// been modified again within the same timestamp granularity after it was
+// hashed, so its stat data cannot vouch for its content
+static int is_racy_entry(struct git_index_header *header,
+                         struct git_index_entry *entry) {
+    if (!header->mtime_sec)
+        return 0;
+
+    return entry->mtime_sec > header->mtime_sec ||
+           (entry->mtime_sec == header->mtime_sec &&
+            entry->mtime_nsec >= header->mtime_nsec);
+}
+
+// Returns 1 when the file may differ from the entry and has to be rehashed
+int entry_stat_changed(struct git_index_header *header,
+                       struct git_index_entry *entry, struct stat *file_stat) {
+    if (entry->mtime_sec != (uint32_t)file_stat->st_mtime ||
+        entry->mtime_nsec != (uint32_t)ST_MTIME_NSEC(file_stat) ||
+        entry->ctime_sec != (uint32_t)file_stat->st_ctime ||
+        entry->ctime_nsec != (uint32_t)ST_CTIME_NSEC(file_stat) ||
+        entry->size != (uint32_t)file_stat->st_size ||
+        entry->ino != (uint32_t)file_stat->st_ino ||
+        entry->dev != (uint32_t)file_stat->st_dev)
         return 1;
+
+    return is_racy_entry(header, entry);
+}
+
+// Looks the path up and compares its cached stat data to lstat(), returns 1
+// when the file is missing or has to be rehashed. Entries fsmonitor vouches
+// for are not even stat'ed.
+int search_index(struct git_index *index, struct stat *file_stat, char *path,
+                 int *found) {
+    int pos = index_pos(index, path);
+    if (pos >= 0 && index->entries[pos].fsmonitor_valid) {
+        *found = pos + 1;
+        return 0;
     }
 
-    for (uint32_t i = 0; i < header.entries; i++) {
-        if (strcmp(entries[i].path, path) == 0) {
-            *found = i + 1;
-            if (entries[i].mtime_sec < file_stat->st_mtime)
-                return 1;
-        }
+    if (lstat(path, file_stat) != 0) {
+        perror("Failed to get file stats");
+        return 1;
     }
 
+    if (pos < 0)
+        return 0;
+
+    *found = pos + 1;
+    if (entry_stat_changed(&index->header, &index->entries[pos], file_stat))
+        return 1;
+
+    // Still valid when the next token is saved with this index
+    index->entries[pos].fsmonitor_valid = 1;
     return 0;
 }
 
-void sort_entries(struct git_index_entry *entries, size_t num_entries) {
-    // This is a bubble sort, but it's fine since the number of entries is
-    // probably small
+// Binary searches the sorted entries, returns the position of path or
+// -(insert position) - 1 when it is not in the index
+int index_pos(struct git_index *index, char *path) {
+    int low = 0, high = index->header.entries;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        int cmp = strcmp(index_entry_path(index, &index->entries[mid]), path);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return -low - 1;
+}
+
+// Whether any index entry lies below the directory path, which ends in '/'
+int index_has_dir(struct git_index *index, char *path, size_t len) {
+    int pos = index_pos(index, path);
+    if (pos < 0)
+        pos = -pos - 1;
+
+    return (size_t)pos < index->header.entries &&
+           !strncmp(index_entry_path(index, &index->entries[pos]), path, len);
+}
+
+char *index_entry_path(struct git_index *index, struct git_index_entry *entry) {
+    if (entry->path < index->map_size)
+        return (char *)index->map + entry->path;
+
+    return index->paths + (entry->path - index->map_size);
+}
+
+// Appends a path to the arena and returns its offset, offsets stay valid when
+// the arena grows
+uint32_t index_add_path(struct git_index *index, char *path) {
+    size_t len = strlen(path) + 1;
+    if (index->paths_len + len > index->paths_alloc) {
+        index->paths_alloc = (index->paths_len + len) * 2;
+        index->paths = realloc(index->paths, index->paths_alloc);
+    }
+
+    uint32_t offset = index->paths_len;
+    memcpy(index->paths + offset, path, len);
+    index->paths_len += len;
+
+    return index->map_size + offset;
+}
+
+struct sort_key {
+    const char *path;
+    uint32_t pos;
+};
+
+static int compare_sort_keys(const void *a, const void *b) {
+    return strcmp(((const struct sort_key *)a)->path,
+                  ((const struct sort_key *)b)->path);
+}
+
+// Sorts small (path, position) keys rather than the entries themselves and
+// then gathers the entries into their new order in one pass
+void sort_entries(struct git_index *index) {
+    size_t num_entries = index->header.entries;
+    int sorted = 1;
+    for (size_t i = 1; i < num_entries && sorted; i++)
+        sorted = strcmp(index_entry_path(index, &index->entries[i - 1]),
+                        index_entry_path(index, &index->entries[i])) <= 0;
+    if (sorted)
+        return;
+
+    struct sort_key *keys = malloc(num_entries * sizeof(struct sort_key));
     for (size_t i = 0; i < num_entries; i++) {
-        for (size_t j = i + 1; j < num_entries; j++) {
-            if (strcmp(entries[i].path, entries[j].path) > 0) {
-                struct git_index_entry temp = entries[i];
-                entries[i] = entries[j];
-                entries[j] = temp;
-            }
+        keys[i].path = index_entry_path(index, &index->entries[i]);
+        keys[i].pos = i;
+    }
+    qsort(keys, num_entries, sizeof(struct sort_key), compare_sort_keys);
+
+    struct git_index_entry *entries =
+        malloc(num_entries * sizeof(struct git_index_entry));
+    for (size_t i = 0; i < num_entries; i++)
+        entries[i] = index->entries[keys[i].pos];
+
+    free(index->entries);
+    index->entries = entries;
+    free(keys);
+}
+
+struct update_job {
+    struct git_index_entry *entry;
+    struct stat file_stat;
+    char *path;
+    int failed;
+};
+
+static void hash_update_job(size_t i, void *data) {
+    struct update_job *job = &((struct update_job *)data)[i];
+    job->failed = prep_index_entry(job->entry, &job->file_stat, job->path);
+}
+
+static void push_path(char ***paths, size_t *num_paths, size_t *cap,
+                      char *path) {
+    if (*num_paths == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *paths = realloc(*paths, *cap * sizeof(char *));
+    }
+    (*paths)[(*num_paths)++] = path;
+}
+
+// Whether path is tracked, or for a directory holds any tracked file
+static int index_has_path(struct git_index *index, const char *path,
+                          int is_dir) {
+    size_t len = strlen(path);
+    char *key = malloc(len + 2);
+    memcpy(key, path, len);
+    key[len] = is_dir ? '/' : '\0';
+    key[len + 1] = '\0';
+
+    int found = is_dir ? index_has_dir(index, key, len + 1)
+                       : index_pos(index, key) >= 0;
+    free(key);
+
+    return found;
+}
+
+// Collects every file below path, directories are descended into and the
+// repository directory itself is skipped. Only entries readdir() cannot tell
+// the type of are stat'ed. Ignored files found along the way are left out
+// unless they are tracked, paths given explicitly are taken as they are.
+static void collect_paths(char *path, int ignored, struct git_index *index,
+                          struct ignore_tree *ignores, char ***paths,
+                          size_t *num_paths, size_t *cap) {
+    struct stat file_stat;
+    if (lstat(path, &file_stat) != 0 || !S_ISDIR(file_stat.st_mode)) {
+        push_path(paths, num_paths, cap, strdup(path));
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return;
+    }
+
+    int is_root = !strcmp(path, ".");
+    size_t path_len = is_root ? 0 : strlen(path);
+    char *dir_path = malloc(path_len + 2);
+    memcpy(dir_path, path, path_len);
+    if (!is_root)
+        dir_path[path_len++] = '/';
+    dir_path[path_len] = '\0';
+    struct ignore_dir *rules = get_ignore_dir(ignores, dir_path, path_len);
+    free(dir_path);
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char *name = dirent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") ||
+            !strcmp(name, ".gblimi"))
+            continue;
+
+        size_t len = strlen(path) + 1 + strlen(name) + 1;
+        char *child = malloc(len);
+        if (is_root)
+            snprintf(child, len, "%s", name);
+        else
+            snprintf(child, len, "%s/%s", path, name);
+
+        int is_file = dirent->d_type == DT_REG || dirent->d_type == DT_LNK;
+        int is_dir = dirent->d_type == DT_DIR;
+        if (dirent->d_type == DT_UNKNOWN && lstat(child, &file_stat) == 0)
+            is_dir = S_ISDIR(file_stat.st_mode);
+
+        int child_ignored = ignored;
+        if (!child_ignored) {
+            const struct ignore_rule *rule =
+                match_ignore_dir(rules, child, strlen(child), is_dir);
+            child_ignored = rule && !rule->negated;
+        }
+        if (child_ignored && !index_has_path(index, child, is_dir)) {
+            free(child);
+            continue;
+        }
+
+        if (is_file) {
+            push_path(paths, num_paths, cap, child);
+            continue;
         }
+
+        collect_paths(child, child_ignored, index, ignores, paths, num_paths,
+                      cap);
+        free(child);
     }
+
+    closedir(dir);
 }
 
-// TODO: Orgainze these function into separate files and factor out the reused
-// parts
-int update_index(int argc, char **argv) {
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s update-index [--add | --remove] <path>\n",
-                argv[0]);
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds or removes every given path with a single read and write of the index.
+// Files that need hashing are hashed and written as blobs on a worker pool
+// before the results are merged back in.
+int update_index_paths(char **args, size_t num_args, int remove) {
+    struct git_index index;
+    if (read_index(&index) == 1)
         return 1;
+    sort_entries(&index);
+    refresh_fsmonitor(&index);
+    size_t num_entries = index.header.entries;
+
+    struct ignore_tree *ignores = ignore_tree_new();
+    char **paths = NULL;
+    size_t num_paths = 0, cap = 0;
+    for (size_t i = 0; i < num_args; i++) {
+        char *arg = args[i];
+        size_t len = strlen(arg);
+        while (len > 1 && arg[len - 1] == '/')
+            arg[--len] = '\0';
+        while (!strncmp(arg, "./", 2) && arg[2] != '\0')
+            arg += 2;
+
+        if (remove)
+            push_path(&paths, &num_paths, &cap, strdup(arg));
+        else
+            collect_paths(arg, 0, &index, ignores, &paths, &num_paths, &cap);
     }
+    ignore_tree_free(ignores);
+
+    // Sort so duplicates from overlapping arguments are only staged once
+    qsort(paths, num_paths, sizeof(char *), compare_paths);
+    size_t unique = 0;
+    for (size_t i = 0; i < num_paths; i++) {
+        if (unique && !strcmp(paths[unique - 1], paths[i]))
+            free(paths[i]);
+        else
+            paths[unique++] = paths[i];
+    }
+    num_paths = unique;
+
+    struct update_job *jobs = malloc((num_paths + 1) * sizeof(*jobs));
+    size_t num_jobs = 0;
+    int ret = 0;
+
+    // New entries are built up separately, already in path order since the
+    // paths are sorted, and merged with the existing ones at the end
+    struct git_index_entry *added =
+        malloc((remove ? 1 : num_paths + 1) * sizeof(struct git_index_entry));
+    size_t num_added = 0;
+    char *removed = calloc(num_entries + 1, 1);
+
+    for (size_t i = 0; i < num_paths; i++) {
+        if (remove) {
+            int pos = index_pos(&index, paths[i]);
+            if (pos >= 0) {
+                removed[pos] = 1;
+                cache_tree_invalidate_path(index.cache_tree, paths[i]);
+                untracked_cache_invalidate_path(index.untracked, paths[i],
+                                                UNTRACKED_VALID);
+            }
+            continue;
+        }
 
-    size_t path_len = strlen(argv[3]);
-    if (argv[3][path_len - 1] == '/')
-        argv[3][path_len - 1] = '\0';
+        struct update_job *job = &jobs[num_jobs];
+        int found = 0;
+        int modified = search_index(&index, &job->file_stat, paths[i], &found);
 
-    struct git_index_header header;
-    struct git_index_entry *entries;
+        if (!found && modified) {
+            ret = 1;
+            continue;
+        }
+        if (found && !modified)
+            continue;
+
+        if (found) {
+            job->entry = &index.entries[found - 1];
+        } else {
+            job->entry = &added[num_added++];
+            job->entry->path = index_add_path(&index, paths[i]);
+            untracked_cache_invalidate_path(index.untracked, paths[i],
+                                            UNTRACKED_VALID);
+        }
+        job->path = paths[i];
+        num_jobs++;
+        cache_tree_invalidate_path(index.cache_tree, paths[i]);
+    }
 
-    read_index(&header, &entries);
+    run_parallel(num_jobs, hash_update_job, jobs);
 
-    struct stat file_stat;
-    int found;
-    int modified = search_index(header, entries, &file_stat, argv[3], &found);
-
-    if (strcmp(argv[2], "--add") == 0) {
-        if (found && modified) {
-            prep_index_entry(&entries[--found], &file_stat, argv[3]);
-        } else if (!found) {
-            entries = realloc(entries, ++header.entries *
-                                           sizeof(struct git_index_entry));
-            prep_index_entry(&entries[header.entries - 1], &file_stat, argv[3]);
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (jobs[i].failed) {
+            fprintf(stderr, "Failed to add %s\n", jobs[i].path);
+            ret = 1;
         }
-    } else if (strcmp(argv[2], "--remove") == 0) {
-        if (found--) {
-            entries[found] = entries[--header.entries];
-            entries = realloc(entries,
-                              header.entries * sizeof(struct git_index_entry));
+    }
+
+    if (!ret) {
+        struct git_index_entry *merged = malloc(
+            (num_entries + num_added + 1) * sizeof(struct git_index_entry));
+        size_t num_merged = 0, i = 0, j = 0;
+        while (i < num_entries || j < num_added) {
+            if (i < num_entries && removed[i]) {
+                i++;
+            } else if (j == num_added ||
+                       (i < num_entries &&
+                        strcmp(index_entry_path(&index, &index.entries[i]),
+                               index_entry_path(&index, &added[j])) < 0)) {
+                merged[num_merged++] = index.entries[i++];
+            } else {
+                merged[num_merged++] = added[j++];
+            }
         }
+        free(index.entries);
+        index.entries = merged;
+        index.header.entries = num_merged;
+
+        ret = write_index_file(&index);
     }
 
-    sort_entries(entries, header.entries);
+    free(added);
+    free(removed);
+    for (size_t i = 0; i < num_paths; i++)
+        free(paths[i]);
+    free(paths);
+    free(jobs);
+    discard_index(&index);
 
-    FILE *fp = fopen(".gblimi/index", "wb+");
-    if (!fp)
-        perror("Failed to open index file");
+    return ret;
+}
+
+int update_index(int argc, char **argv) {
+    if (argc < 4 ||
+        (strcmp(argv[2], "--add") != 0 && strcmp(argv[2], "--remove") != 0)) {
+        fprintf(stderr,
+                "Usage: %s update-index [--add | --remove] <path>...\n",
+                argv[0]);
+        return 1;
+    }
 
-    write_index(fp, header, entries);
-    fclose(fp);
+    return update_index_paths(argv + 3, argc - 3,
+                              strcmp(argv[2], "--remove") == 0);
+}
 
-    free(entries);
+int add(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s add <path>...\n", argv[0]);
+        return 1;
+    }
 
-    return 0;
+    return update_index_paths(argv + 2, argc - 2, 0);
 }
 
-// Function to read and parse the index file
-int read_index(struct git_index_header *header,
-               struct git_index_entry **entries) {
-    char index_path[256];
-    snprintf(index_path, 256, ".gblimi/index");
-    FILE *fp = fopen(index_path, "rb");
-    if (!fp) {
-        fclose(fp);
-        header->signature[0] = 'D';
-        header->signature[1] = 'I';
-        header->signature[2] = 'R';
-        header->signature[3] = 'C';
-        header->entries = 0;
-        header->version = 2;
-
-        *entries = malloc(sizeof(struct git_index_entry));
+// Maps the index file and parses the entries in place. The checksum is
+// verified first and every path is left pointing into the mapping.
+int read_index(struct git_index *index) {
+    struct git_index_header *header = &index->header;
+    memset(index, 0, sizeof(*index));
+    memcpy(header->signature, "DIRC", 4);
+    header->version = 2;
+
+    int fd = open(".gblimi/index", O_RDONLY);
+    if (fd < 0)
         return 2;
+
+    // Entries touched after this point are racily clean
+    struct stat index_stat;
+    fstat(fd, &index_stat);
+    header->mtime_sec = (uint32_t)index_stat.st_mtime;
+    header->mtime_nsec = (uint32_t)ST_MTIME_NSEC(&index_stat);
+
+    size_t rawsz = hash_algo()->rawsz;
+    size_t size = index_stat.st_size;
+    if (size < 12 + rawsz) {
+        close(fd);
+        fprintf(stderr, "Index file is too small\n");
+        return 1;
     }
 
-    // Read header
-    if (fread(&header->signature, 4, 1, fp) != 1) {
-        fclose(fp);
-        printf("Error reading header\n");
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map index file");
         return 1;
     }
-    // Verify signature
-    if (memcmp(header->signature, "DIRC", 4) != 0) {
-        fclose(fp);
-        printf("Invalid index file signature\n");
+    index->map = map;
+    index->map_size = size;
+
+    // Verify signature and checksum
+    unsigned char checksum[GIT_MAX_RAWSZ];
+    hash_data(map, size - rawsz, checksum);
+    if (memcmp(map, "DIRC", 4) != 0 ||
+        memcmp(checksum, map + size - rawsz, rawsz) != 0) {
+        fprintf(stderr, "Index file is corrupt\n");
+        discard_index(index);
+        return 1;
     }
-    // Read rest of header
-    read_uint32(fp, &header->version);
-    read_uint32(fp, &header->entries);
+
+    header->version = get_be32(map + 4);
+    uint32_t num_entries = get_be32(map + 8);
 
     // Read entries
-    *entries = malloc((header->entries) * sizeof(struct git_index_entry));
-    for (size_t i = 0; i < header->entries; i++) {
-        read_uint32(fp, &(*entries)[i].ctime_sec);
-        read_uint32(fp, &(*entries)[i].ctime_nsec);
-        read_uint32(fp, &(*entries)[i].mtime_sec);
-        read_uint32(fp, &(*entries)[i].mtime_nsec);
-        read_uint32(fp, &(*entries)[i].dev);
-        read_uint32(fp, &(*entries)[i].ino);
-        read_uint32(fp, &(*entries)[i].mode);
-        read_uint32(fp, &(*entries)[i].uid);
-        read_uint32(fp, &(*entries)[i].gid);
-        read_uint32(fp, &(*entries)[i].size);
-        fread((*entries)[i].sha1, 1, 20, fp);
-        fread(&(*entries)[i].flags, 1, 2, fp);
-        char path[4096]; // Max path length
-        int c, path_len = 0;
-        while ((c = fgetc(fp)) != '\0' && c != EOF && path_len < 4095) {
-            path[path_len++] = c;
+    index->entries = malloc((num_entries + 1) * sizeof(struct git_index_entry));
+    size_t offset = 12, end = size - rawsz;
+    size_t fixed = INDEX_ENTRY_FIXED_SIZE(rawsz);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        struct git_index_entry *entry = &index->entries[i];
+        unsigned char *data = map + offset;
+        unsigned char *nul =
+            offset + fixed < end
+                ? memchr(data + fixed, '\0', end - offset - fixed)
+                : NULL;
+        if (!nul) {
+            fprintf(stderr, "Index file is corrupt\n");
+            discard_index(index);
+            return 1;
         }
-        path[path_len] = '\0';
-        strncpy((*entries)[i].path, path, path_len);
-        int padding = (8 - ((62 + path_len) % 8)) - 1;
-        if (padding > 0) {
-            char null_bytes[8] = {0};
-            fread(null_bytes, 1, padding, fp);
+
+        entry->ctime_sec = get_be32(data);
+        entry->ctime_nsec = get_be32(data + 4);
+        entry->mtime_sec = get_be32(data + 8);
+        entry->mtime_nsec = get_be32(data + 12);
+        entry->dev = get_be32(data + 16);
+        entry->ino = get_be32(data + 20);
+        entry->mode = get_be32(data + 24);
+        entry->uid = get_be32(data + 28);
+        entry->gid = get_be32(data + 32);
+        entry->size = get_be32(data + 36);
+        memcpy(entry->sha1, data + 40, rawsz);
+        entry->flags = get_be16(data + 40 + rawsz);
+        entry->path = offset + fixed;
+        entry->fsmonitor_valid = 0;
+
+        // Entries are padded with NULs to a multiple of 8 bytes
+        size_t path_len = nul - (data + fixed);
+        offset += (fixed + path_len + 8) & ~(size_t)7;
+        header->entries++;
+    }
+
+    // Extensions follow as "<signature><be32 size><data>", ones starting
+    // with an uppercase letter are optional and skipped when unknown
+    while (offset + 8 <= end) {
+        unsigned char *ext = map + offset;
+        uint32_t ext_size = get_be32(ext + 4);
+        if (ext_size > end - offset - 8 ||
+            (memcmp(ext, "TREE", 4) != 0 && (ext[0] < 'A' || ext[0] > 'Z'))) {
+            fprintf(stderr, "Index file is corrupt\n");
+            discard_index(index);
+            return 1;
         }
+
+        if (!memcmp(ext, "TREE", 4))
+            index->cache_tree = read_cache_tree(ext + 8, ext_size);
+        else if (!memcmp(ext, FSMONITOR_EXTENSION, 4))
+            read_fsmonitor_extension(index, ext + 8, ext_size);
+        else if (!memcmp(ext, UNTRACKED_EXTENSION, 4))
+            index->untracked = read_untracked_extension(ext + 8, ext_size);
+        offset += 8 + ext_size;
     }
 
-    fclose(fp);
     return 0;
 }
 
-void prep_index_entry(struct git_index_entry *entry, struct stat *file_stat,
-                      char *path) {
+void discard_index(struct git_index *index) {
+    if (index->map)
+        munmap(index->map, index->map_size);
+    free(index->entries);
+    free(index->paths);
+    cache_tree_free(index->cache_tree);
+    free(index->fsmonitor_token);
+    untracked_cache_free(index->untracked);
+    index->cache_tree = NULL;
+    index->fsmonitor_token = NULL;
+    index->untracked = NULL;
+    index->map = NULL;
+    index->entries = NULL;
+    index->paths = NULL;
+    index->header.entries = 0;
+    index->map_size = index->paths_len = index->paths_alloc = 0;
+}
+
+// Mode recorded for a file of this type, 0 for types that are not tracked
+uint32_t index_mode(const struct stat *file_stat) {
+    if (S_ISDIR(file_stat->st_mode))
+        return 40000;
+    if (S_ISREG(file_stat->st_mode))
+        return file_stat->st_mode & S_IXUSR ? 100755 : 100644;
+    if (S_ISLNK(file_stat->st_mode))
+        return 120000;
+
+    return 0;
+}
+
+// Copies the stat data that later tells whether the file may have changed
+void fill_index_stat(struct git_index_entry *entry,
+                     const struct stat *file_stat) {
     entry->ctime_sec = (uint32_t)file_stat->st_ctime;
-    entry->ctime_nsec = (uint32_t)file_stat->st_ctimespec.tv_nsec;
+    entry->ctime_nsec = (uint32_t)ST_CTIME_NSEC(file_stat);
     entry->mtime_sec = (uint32_t)file_stat->st_mtime;
-    entry->mtime_nsec = (uint32_t)file_stat->st_mtimespec.tv_nsec;
+    entry->mtime_nsec = (uint32_t)ST_MTIME_NSEC(file_stat);
     entry->dev = (uint32_t)file_stat->st_dev;
     entry->ino = (uint32_t)file_stat->st_ino;
-    if (S_ISDIR(file_stat->st_mode)) {
-        entry->mode = 40000;
-    } else if (S_ISREG(file_stat->st_mode)) {
-        entry->mode = 100644;
-    } else if (S_ISLNK(file_stat->st_mode)) {
-        entry->mode = 120000;
-    }
-    // entry->mode = (uint32_t)file_stat->st_mode;
     entry->uid = (uint32_t)file_stat->st_uid;
     entry->gid = (uint32_t)file_stat->st_gid;
     entry->size = (uint32_t)file_stat->st_size;
-
-    long size;
-    unsigned char *hash = blob_and_hash_file(path, &size);
-    memcpy(entry->sha1, hash, 20);
-
-    // Set flags (path length etc.)
-    entry->flags = strlen(path);
-    strncpy(entry->path, path, entry->flags);
-}
-
-void write_index_header(FILE *fp, struct git_index_header *header) {
-    fwrite(header->signature, 1, 4, fp);
-    write_uint32(fp, header->version);
-    write_uint32(fp, header->entries);
 }
 
-void write_index_entry(FILE *fp, struct git_index_entry *entry) {
-    write_uint32(fp, entry->ctime_sec);
-    write_uint32(fp, entry->ctime_nsec);
-    write_uint32(fp, entry->mtime_sec);
-    write_uint32(fp, entry->mtime_nsec);
-    write_uint32(fp, entry->dev);
-    write_uint32(fp, entry->ino);
+int prep_index_entry(struct git_index_entry *entry, struct stat *file_stat,
+                     char *path) {
+    fill_index_stat(entry, file_stat);
+    uint32_t mode = index_mode(file_stat);
+    if (mode)
+        entry->mode = mode;
 
-    if (entry->mode == 40000)
-        write_uint32(fp, 40000);
-    else if (entry->mode == 100644)
-        write_uint32(fp, 100644);
-    else if (entry->mode == 120000)
-        write_uint32(fp, 120000);
+    // Set flags (path length etc.)
+    entry->flags = INDEX_NAME_FLAGS(strlen(path));
+    entry->fsmonitor_valid = 1;
 
-    write_uint32(fp, entry->uid);
-    write_uint32(fp, entry->gid);
-    write_uint32(fp, entry->size);
-    fwrite(entry->sha1, 1, 20, fp);
-    fwrite(&entry->flags, 1, 2, fp);
-    fwrite(entry->path, 1, entry->flags, fp);
+    if (!S_ISLNK(file_stat->st_mode))
+        return stream_blob(path, entry->sha1, 1);
 
-    int padding = 8 - ((62 + entry->flags) % 8);
-    if (padding < 8) {
-        char null_bytes[8] = {0};
-        fwrite(null_bytes, 1, padding, fp);
+    // A symlink is stored as its target, which need not exist
+    char target[PATH_MAX];
+    ssize_t len = readlink(path, target, sizeof(target));
+    if (len < 0) {
+        fprintf(stderr, "Failed to read link %s\n", path);
+        return 1;
     }
+
+    return write_object("blob", target, len, entry->sha1);
 }
 
-void write_index_checksum(FILE *fp) {
-    fseek(fp, 0, SEEK_END);
-    long index_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+void write_index_header(struct hashfile *f, struct git_index_header *header) {
+    hashfile_write(f, header->signature, 4);
+    hashfile_be32(f, header->version);
+    hashfile_be32(f, header->entries);
+}
 
-    char *index = malloc(index_size);
-    if (index)
-        fread(index, 1, index_size, fp);
+void write_index_entry(struct hashfile *f, struct git_index *index,
+                       struct git_index_entry *entry) {
+    hashfile_be32(f, entry->ctime_sec);
+    hashfile_be32(f, entry->ctime_nsec);
+    hashfile_be32(f, entry->mtime_sec);
+    hashfile_be32(f, entry->mtime_nsec);
+    hashfile_be32(f, entry->dev);
+    hashfile_be32(f, entry->ino);
+    hashfile_be32(f, entry->mode);
+    hashfile_be32(f, entry->uid);
+    hashfile_be32(f, entry->gid);
+    hashfile_be32(f, entry->size);
+    size_t rawsz = hash_algo()->rawsz;
+    hashfile_write(f, entry->sha1, rawsz);
+    char *path = index_entry_path(index, entry);
+    size_t path_len = strlen(path);
+    hashfile_be16(f, entry->flags);
+    hashfile_write(f, path, path_len);
+
+    // Always at least one NUL so the reader can find the end of the path
+    int padding = 8 - ((INDEX_ENTRY_FIXED_SIZE(rawsz) + path_len) % 8);
+    char null_bytes[8] = {0};
+    hashfile_write(f, null_bytes, padding);
+}
 
-    unsigned char checksum[20];
-    SHA1((unsigned char *)index, index_size, checksum);
+void write_index(struct hashfile *f, struct git_index *index) {
+    write_index_header(f, &index->header);
 
-    fwrite(checksum, 1, 20, fp);
+    for (size_t i = 0; i < index->header.entries; i++)
+        write_index_entry(f, index, &index->entries[i]);
 
-    free(index);
+    if (index->cache_tree)
+        write_cache_tree_extension(f, index->cache_tree);
+    if (index->untracked)
+        write_untracked_extension(f, index->untracked);
+    if (index->fsmonitor_token)
+        write_fsmonitor_extension(f, index);
 }
 
-void write_index(FILE *fp, struct git_index_header header,
-                 struct git_index_entry *entries) {
-    // FILE *fp = fopen(".gblimi/index", "wb+");
-    // if (!fp) {
-    //     perror("Failed to open index file");
-    //     return;
-    // }
-
-    write_index_header(fp, &header);
+// Serializes the index into .gblimi/index.lock in one sequential pass with the
+// checksum computed along the way, then renames it over the old index
+int write_index_file(struct git_index *index) {
+    char lock_path[64];
+    int fd = hold_lock_file(".gblimi/index", lock_path, sizeof(lock_path));
+    if (fd < 0)
+        return 1;
 
-    for (size_t i = 0; i < header.entries; i++)
-        write_index_entry(fp, &entries[i]);
+    struct hashfile f;
+    hashfile_init(&f, fd);
+    write_index(&f, index);
 
-    write_index_checksum(fp);
+    return commit_lock_file(&f, lock_path, ".gblimi/index");
 }
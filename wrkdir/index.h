@@ -1,19 +1,47 @@
 #ifndef INDEX_H
 #define INDEX_H
 
-#include <openssl/sha.h>
+#include <dirent.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include "cache-tree.h"
+#include "hash.h"
+#include "hashfile.h"
+#include "untracked-cache.h"
+
+// Nanosecond timestamps live in different members on macOS and Linux
+#ifdef __APPLE__
+#define ST_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
 struct git_index_header {
     char signature[4]; // Should be "DIRC"
     uint32_t version;  // Version number (usually 2)
     uint32_t entries;  // Number of entries
+
+    // Modification time of the index file when it was read, not written out
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
 };
 
+// Bytes of an on-disk entry before its path: ten 32-bit stat fields, the
+// object id and the 16-bit flags
+#define INDEX_ENTRY_FIXED_SIZE(rawsz) (40 + (rawsz) + 2)
+
+// The low 12 bits of the flags hold the path length, capped at 0xFFF for
+// longer paths whose end is then only known by their NUL. The bits above
+// are the stage and extended flags and stay clear.
+#define INDEX_NAME_FLAGS(len) ((len) < 0xFFF ? (uint16_t)(len) : 0xFFF)
+
 // Git index entry structure
 struct git_index_entry {
     uint32_t ctime_sec;
@@ -26,33 +54,76 @@ struct git_index_entry {
     uint32_t uid;
     uint32_t gid;
     uint32_t size;
-    unsigned char sha1[20];
+    unsigned char sha1[GIT_MAX_RAWSZ];
     uint16_t flags;
-    char path[4096];
+    uint32_t path; // Offset of the path, see index_entry_path()
+
+    // Matches the working tree as of fsmonitor_token, no lstat() needed
+    unsigned char fsmonitor_valid;
+};
+
+// The in-memory index keeps fixed-size entries in one array. Paths of entries
+// read from disk point into the mapped index file, paths added since then live
+// NUL terminated in a single arena. Offsets below map_size are in the mapping.
+// cache_tree holds the TREE extension, NULL when the index had none.
+// fsmonitor_token is the daemon's token its extension was saved with,
+// fsmonitor_changed is set once a query clears any entry's valid bit.
+// untracked holds the untracked cache extension, NULL when the index had none.
+struct git_index {
+    struct git_index_header header;
+    struct git_index_entry *entries;
+    unsigned char *map;
+    size_t map_size;
+    char *paths;
+    size_t paths_len;
+    size_t paths_alloc;
+    struct cache_tree *cache_tree;
+    char *fsmonitor_token;
+    int fsmonitor_changed;
+    struct untracked_cache *untracked;
 };
 
-void prep_index_entry(struct git_index_entry *entry, struct stat *file_stat,
-                      char *path);
+char *index_entry_path(struct git_index *index, struct git_index_entry *entry);
 
-void write_index_header(FILE *fp, struct git_index_header *header);
+uint32_t index_add_path(struct git_index *index, char *path);
 
-// TODO: Sort the entries
-void write_index_entry(FILE *fp, struct git_index_entry *entry);
+uint32_t index_mode(const struct stat *file_stat);
 
-void write_index_checksum(FILE *fp);
+void fill_index_stat(struct git_index_entry *entry,
+                     const struct stat *file_stat);
 
-void write_index(FILE *fp, struct git_index_header header,
-                 struct git_index_entry *entries);
+int prep_index_entry(struct git_index_entry *entry, struct stat *file_stat,
+                     char *path);
 
-int read_index(struct git_index_header *header,
-               struct git_index_entry **entries);
+void write_index_header(struct hashfile *f, struct git_index_header *header);
 
-int search_index(struct git_index_header header,
-                 struct git_index_entry *entries, struct stat *file_stat,
-                 char *path, int *found);
+void write_index_entry(struct hashfile *f, struct git_index *index,
+                       struct git_index_entry *entry);
 
-void sort_entries(struct git_index_entry *entries, size_t num_entries);
+void write_index(struct hashfile *f, struct git_index *index);
+
+int write_index_file(struct git_index *index);
+
+int read_index(struct git_index *index);
+
+void discard_index(struct git_index *index);
+
+int entry_stat_changed(struct git_index_header *header,
+                       struct git_index_entry *entry, struct stat *file_stat);
+
+int search_index(struct git_index *index, struct stat *file_stat, char *path,
+                 int *found);
+
+int index_pos(struct git_index *index, char *path);
+
+int index_has_dir(struct git_index *index, char *path, size_t len);
+
+void sort_entries(struct git_index *index);
+
+int update_index_paths(char **args, size_t num_args, int remove);
 
 int update_index(int argc, char **argv);
 
+int add(int argc, char **argv);
+
 #endif
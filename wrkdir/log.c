@@ -0,0 +1,175 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "object.h"
+#include "parse-options.h"
+#include "revision.h"
+#include "tree.h"
+
+// Formats "<seconds> <+zzzz>" the way git does by default, in the time zone
+// the date was recorded in, e.g. "Tue Nov 14 23:13:20 2023 +0100"
+static void format_date(const char *date, char *out, size_t len) {
+    static const char *days[] = {"Sun", "Mon", "Tue", "Wed",
+                                 "Thu", "Fri", "Sat"};
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr",
+                                   "May", "Jun", "Jul", "Aug",
+                                   "Sep", "Oct", "Nov", "Dec"};
+
+    char *end;
+    long long seconds = strtoll(date, &end, 10);
+    long tz = strtol(end, NULL, 10);
+    long offset = (tz / 100 * 60 + tz % 100) * 60;
+
+    time_t t = seconds + offset;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    snprintf(out, len, "%s %s %d %02d:%02d:%02d %d %+05ld", days[tm.tm_wday],
+             months[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             tm.tm_year + 1900, tz);
+}
+
+// Finds the header line starting with name, returns its value and length
+static const char *find_header(const char *buf, const char *end,
+                               const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    while (buf < end && *buf != '\n') {
+        const char *eol = memchr(buf, '\n', end - buf);
+        if (!eol)
+            eol = end;
+        if ((size_t)(eol - buf) > name_len && !memcmp(buf, name, name_len) &&
+            buf[name_len] == ' ') {
+            *len = eol - buf - name_len - 1;
+            return buf + name_len + 1;
+        }
+        buf = eol + 1;
+    }
+
+    return NULL;
+}
+
+// The commit object is only read here, for commits that are shown
+static int show_commit(struct commit *commit, int oneline, int first) {
+    char hex[GIT_MAX_HEXSZ + 1], type[16];
+    size_t size;
+    sha1_to_hex(commit->oid, hex);
+    char *buf = retrieve_object(hex, type, &size);
+    if (!buf)
+        return 1;
+
+    const char *end = buf + size, *message = end;
+    for (const char *p = buf; p + 1 < end; p++) {
+        if (p[0] == '\n' && p[1] == '\n') {
+            message = p + 2;
+            break;
+        }
+    }
+
+    // Trailing blank lines are not shown
+    const char *message_end = end;
+    while (message_end > message &&
+           (message_end[-1] == '\n' || message_end[-1] == ' '))
+        message_end--;
+
+    if (oneline) {
+        const char *eol = memchr(message, '\n', message_end - message);
+        printf("%.*s %.*s\n", DEFAULT_ABBREV, hex,
+               (int)((eol ? eol : message_end) - message), message);
+        free(buf);
+        return 0;
+    }
+
+    if (!first)
+        putchar('\n');
+    printf("commit %s\n", hex);
+    if (commit->num_parents > 1) {
+        printf("Merge:");
+        for (int i = 0; i < commit->num_parents; i++) {
+            char parent[GIT_MAX_HEXSZ + 1];
+            sha1_to_hex(commit->parents[i]->oid, parent);
+            printf(" %.*s", DEFAULT_ABBREV, parent);
+        }
+        putchar('\n');
+    }
+
+    size_t len;
+    const char *author = find_header(buf, message, "author", &len);
+    const char *date = author ? memchr(author, '>', len) : NULL;
+    if (date) {
+        char formatted[64];
+        char *date_str = strndup(date + 1, author + len - date - 1);
+        format_date(date_str, formatted, sizeof(formatted));
+        free(date_str);
+        printf("Author: %.*s\nDate:   %s\n", (int)(date + 1 - author), author,
+               formatted);
+    }
+    putchar('\n');
+
+    while (message < message_end) {
+        const char *eol = memchr(message, '\n', message_end - message);
+        if (!eol)
+            eol = message_end;
+        printf("    %.*s\n", (int)(eol - message), message);
+        message = eol + 1;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+// log [-n <n>] [--oneline] [<rev>...] shows the history of the revisions,
+// HEAD by default
+int show_log(int argc, char **argv) {
+    struct option log_options[] = {
+        {"max-count", required_argument, NULL, 'n'},
+        {"oneline", no_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0},
+    };
+
+    struct rev_info revs;
+    init_revisions(&revs);
+
+    int oneline = 0, bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "n:", log_options, NULL)) != -1) {
+        if (c == 'n')
+            revs.max_count = atoi(optarg);
+        else if (c == 'o')
+            oneline = 1;
+        else
+            bad_usage = 1;
+    }
+
+    if (bad_usage) {
+        fprintf(stderr, "Usage: %s log [-n <n>] [--oneline] [<rev>...]\n",
+                argv[0]);
+        release_revisions(&revs);
+        return 1;
+    }
+
+    char **args;
+    int num_args = command_operands(argc, argv, &args);
+    int ret = 0;
+    if (!num_args)
+        ret = add_revision(&revs, "HEAD");
+    for (int i = 0; !ret && i < num_args; i++)
+        ret = add_revision(&revs, args[i]);
+    if (!ret)
+        ret = prepare_revision_walk(&revs);
+
+    struct commit *commit;
+    int first = 1;
+    while (!ret && (commit = get_revision(&revs))) {
+        ret = show_commit(commit, oneline, first);
+        first = 0;
+    }
+    ret |= revs.error;
+
+    release_revisions(&revs);
+
+    return ret;
+}
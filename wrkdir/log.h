@@ -0,0 +1,9 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Length of the abbreviated ids in one line and merge output
+#define DEFAULT_ABBREV 7
+
+int show_log(int argc, char **argv);
+
+#endif
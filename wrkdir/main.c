@@ -1,4 +1,5 @@
 #include <getopt.h>
+#include <limits.h>
 #include <openssl/sha.h>
 #include <regex.h>
 #include <stdio.h>
@@ -7,26 +8,41 @@
 #include <sys/stat.h>
 #include <zlib.h>
 
+#include "cat-file.h"
+#include "checkout.h"
+#include "commit-graph.h"
+#include "commit.h"
+#include "config.h"
+#include "diff-tree.h"
+#include "fsmonitor.h"
 #include "hash-object.h"
+#include "hash.h"
+#include "ignore.h"
 #include "index.h"
+#include "log.h"
+#include "object.h"
+#include "pack.h"
+#include "revision.h"
+#include "status.h"
 #include "tree.h"
 
 // TODO: Commands to add
 // - ~cat-file~
-// - add
+// - ~add~
 // - commit
-// - commit-tree
-// - checkout
-// - config
-// - check-ignore
+// - ~commit-tree~
+// - ~checkout~
+// - ~config~
+// - ~diff-tree~
+// - ~check-ignore~
 // - ~hash-object~
-// - log
+// - ~log~
 // - ~ls-files~
 // - ~ls-tree~
 // - rev-parse
 // - rm
 // - show-ref
-// - status
+// - ~status~
 // - tag
 
 #define RED "\x1B[31m"
@@ -38,7 +54,35 @@
 #define WHT "\x1B[37m"
 #define RESET "\x1B[0m"
 
-int init(void) {
+int init(int argc, char **argv) {
+    const char *format = NULL;
+    if (argc == 3 && !strncmp(argv[2], "--object-format=", 16)) {
+        format = argv[2] + 16;
+    } else if (argc != 2) {
+        fprintf(stderr, "Usage: %s init [--object-format=(sha1|sha256)]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (format && !hash_algo_by_name(format)) {
+        fprintf(stderr, "Unknown object format %s\n", format);
+        return 1;
+    }
+
+    // Every object id in the repository depends on the format, so running
+    // init again keeps it. A repository without the setting is sha1.
+    struct stat st;
+    int is_new = stat(".gblimi", &st) != 0;
+    char *existing = is_new ? NULL : get_config("extensions.objectFormat");
+    const char *current = existing ? existing : is_new ? NULL : "sha1";
+    if (format && current && strcmp(format, current)) {
+        fprintf(stderr, "Repository already uses object format %s\n",
+                current);
+        free(existing);
+        return 1;
+    }
+    free(existing);
+
     mkdir(".gblimi", 0777);
     mkdir(".gblimi/objects", 0777);
     mkdir(".gblimi/refs", 0777);
@@ -47,224 +91,77 @@ int init(void) {
     fprintf(head, "ref: refs/heads/master\n");
     fclose(head);
 
+    if (is_new &&
+        set_config("extensions.objectFormat", format ? format : "sha1"))
+        return 1;
+
     printf("Initialized gblimi repository\n");
 
     return 0;
 }
 
-char *retrieve_object(char *hash, size_t *size) {
-    char *object_path = malloc(strlen(".gblimi/objects/") + strlen(hash) + 2);
-
-    char dir[3] = {hash[0], hash[1], '\0'};
-    snprintf(object_path, strlen(".gblimi/objects/") + strlen(hash) + 2,
-             ".gblimi/objects/%s/%s", dir, hash + 2);
-
-    FILE *object = fopen(object_path, "r");
-    fseek(object, 0, SEEK_END);
-    *size = ftell(object);
-    fseek(object, 0, SEEK_SET);
-    char *data = malloc(*size);
-    if (data)
-        fread(data, 1, *size, object);
-    fclose(object);
-
-    size_t ucompSize = 8192;
-    char *blob = malloc(ucompSize);
-    uncompress((Bytef *)blob, (uLongf *)&ucompSize, (Bytef *)data, ucompSize);
-    *size = ucompSize;
-
-    free(object_path);
-    free(data);
-
-    return blob;
-}
-
 int ls_files(void) {
-    struct git_index_header header;
-    struct git_index_entry *entries;
-    read_index(&header, &entries);
-
-    for (size_t i = 0; i < header.entries; i++)
-        printf("%s\n", entries[i].path);
-
-    free(entries);
-
-    return 0;
-}
-
-void handle_cat_file_opts(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s cat-file <hash>\n", argv[0]);
-        exit(1);
-    }
-}
-
-// FIX: Long files are not being read correctly
-// so Ill need to figure out how to read the file
-// in chunks
-int cat_file(char *object_hash) {
-    size_t ucompSize = 8192;
-    char *blob = retrieve_object(object_hash, &ucompSize);
-
-    printf("%s\n", blob + 10);
-
-    free(blob);
-
-    return 0;
-}
+    struct git_index index;
+    if (read_index(&index) == 1)
+        return 1;
 
-int ls_tree(char *tree_hash) {
-    size_t ucompSize = 4096;
-    char *tree = retrieve_object(tree_hash, &ucompSize);
-
-    // Skip the header
-    int header_end = 0;
-    while (tree[header_end] != '\0')
-        header_end++;
-    while (tree[header_end] == '\0')
-        header_end++;
-
-    // Count the number of entries by searching for the null terminator
-    size_t num_entries = 0;
-    for (size_t i = header_end; i < ucompSize - 1; i++)
-        if (tree[i] == '\0')
-            num_entries++;
-
-    // Account for the double null on all but the last entry
-    num_entries = (num_entries + 1) / 2;
-
-    // Read the entries into the struct
-    struct git_tree_entry entries[num_entries];
-    size_t entry_size = 0;
-    tree += header_end;
-    for (size_t i = 0; i < num_entries; i++) {
-        int entry_padding = 0;
-        if (tree[entry_size] == '4')
-            entry_padding = 1;
-
-        entries[i].mode = atoi(tree + entry_size);
-
-        while (tree[entry_size] != ' ')
-            entry_size++;
-        entries[i].path = tree + entry_size + 1;
-
-        while (tree[entry_size] != '\0')
-            entry_size++;
-        strncpy(entries[i].sha1, tree + entry_size + 1, 40);
-        entries[i].sha1[40] = '\0';
-
-        entry_size += 42 + entry_padding;
-    }
+    for (size_t i = 0; i < index.header.entries; i++)
+        printf("%s\n", index_entry_path(&index, &index.entries[i]));
 
-    for (size_t i = 0; i < num_entries; i++)
-        printf("%.6d %s %.40s\t%s\n", entries[i].mode,
-               entries[i].mode / 100000 == 0 ? "tree" : "blob", entries[i].sha1,
-               entries[i].path);
+    discard_index(&index);
 
     return 0;
 }
 
-struct config {
-    char name[30];
-    char email[40];
-};
-
-void read_config(struct config *config) {
-    FILE *config_file = fopen(".gblimi/config", "r");
-    char *config_str = malloc(1000);
-    fread(config_str, 1, 1000, config_file);
-
-    int i = 0;
-    while (config_str[i] != '\0') {
-        if (config_str[i] == '\n')
-            config_str[i] = '\0';
-        i++;
-    }
-
-    char *name = config_str + 7;
-    char *email = config_str + 8 + strlen(name) + 8;
-    strncpy(config->name, name, 30);
-    strncpy(config->email, email, 40);
-
-    fclose(config_file);
-    free(config_str);
-}
-
-void write_config(struct config *config) {
-    FILE *config_file = fopen(".gblimi/config", "w");
-    fprintf(config_file, "name = %s\nemail = %s", config->name, config->email);
-    fclose(config_file);
-}
-
-int config(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s config <key>\n", argv[0]);
+// Lists one tree, with recursive set subtrees are descended into and only
+// their blobs are shown with paths relative to the top tree in base
+static int show_tree(char *tree_hash, char *base, size_t base_len,
+                     int recursive) {
+    size_t size;
+    char *tree = retrieve_object(tree_hash, NULL, &size);
+    if (!tree)
         return 1;
-    }
-
-    if (strcmp(argv[2], "set") == 0) {
-        if (argc < 4) {
-            fprintf(stderr, "Usage: %s %s %s <name> <value>\n", argv[0],
-                    argv[1], argv[2]);
-            return 1;
-        }
-
-        struct config *config;
-        config = malloc(sizeof(struct config));
-        read_config(config);
-
-        if (!strcmp(argv[3], "name")) {
-            strncpy(config->name, argv[4], 30);
-        } else if (!strcmp(argv[3], "email")) {
-            strncpy(config->email, argv[4], 40);
-        } else {
-            fprintf(stderr, "Cannot set %s\n", config->name);
-            return 1;
-        }
-
-        write_config(config);
-
-        free(config);
-
-        return 0;
 
-    } else if (strcmp(argv[2], "get") == 0) {
-
-        if (argc < 3) {
-            fprintf(stderr, "Usage: %s get <name>\n", argv[0]);
-            return 1;
+    struct tree_desc desc;
+    struct git_tree_entry entry;
+    init_tree_desc(&desc, tree, size);
+
+    int ret;
+    while ((ret = next_tree_entry(&desc, &entry)) > 0) {
+        char hex[GIT_MAX_HEXSZ + 1];
+        sha1_to_hex(entry.sha1, hex);
+        int is_tree = entry.mode / 100000 == 0;
+
+        if (recursive && is_tree) {
+            if (base_len + entry.path_len + 1 >= PATH_MAX) {
+                fprintf(stderr, "Path too long in tree %s\n", tree_hash);
+                ret = -1;
+                break;
+            }
+            memcpy(base + base_len, entry.path, entry.path_len);
+            base[base_len + entry.path_len] = '/';
+            if (show_tree(hex, base, base_len + entry.path_len + 1, 1)) {
+                ret = -1;
+                break;
+            }
+            continue;
         }
 
-        struct config config;
-        read_config(&config);
-
-        if (!strcmp(argv[3], "name")) {
-            printf("%s\n", config.name);
-        } else if (!strcmp(argv[3], "email")) {
-            printf("%s\n", config.email);
-        } else {
-            fprintf(stderr, "Cannot get %s\n", argv[3]);
-            return 1;
-        }
+        printf("%.6u %s %s\t%.*s%.*s\n", entry.mode, is_tree ? "tree" : "blob",
+               hex, (int)base_len, base, (int)entry.path_len, entry.path);
+    }
 
-        return 0;
+    if (ret < 0)
+        fprintf(stderr, "Corrupt tree %s\n", tree_hash);
 
-    } else {
-        fprintf(stderr, "Unknown command: %s\n", argv[2]);
-        return 1;
-    }
-}
+    free(tree);
 
-void handle_commit_tree_opts(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s commit-tree <hash>\n", argv[0]);
-        exit(1);
-    }
+    return ret < 0;
 }
 
-int commit_tree(char *tree_hash) {
-    printf("commit-tree %s\n", tree_hash);
-    return 0;
+int ls_tree(char *tree_hash, int recursive) {
+    char base[PATH_MAX];
+    return show_tree(tree_hash, base, 0, recursive);
 }
 
 static int helpflag;
@@ -272,42 +169,20 @@ struct option options[] = {
     {"help", no_argument, &helpflag, 1},
 };
 
-int handle_hash_object_opts(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s hash-object <file>\n", argv[0]);
-        return 1;
-    }
-
-    struct option hash_options[] = {
-        {"write", no_argument, NULL, 'w'},
-        {NULL, 0, NULL, 0},
-    };
-    int hash_option_index = 0;
-
-    int hash_object_write_flag;
+int handle_ls_tree_opts(int argc, char **argv) {
+    int recursive = 0;
     int c;
-    while ((c = getopt_long(argc, argv, "w", hash_options,
-                            &hash_option_index)) != -1) {
-        if (c == -1)
-            break;
-
-        switch (c) {
-        case 'w':
-            hash_object_write_flag = 1;
-            break;
-        default:
-            break;
-        }
+    while ((c = getopt(argc, argv, "r")) != -1) {
+        if (c == 'r')
+            recursive = 1;
     }
 
-    return hash_object_write_flag;
-}
-
-void handle_ls_tree_opts(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s ls-tree <hash>\n", argv[0]);
+    if (optind + 1 >= argc) {
+        fprintf(stderr, "Usage: %s ls-tree [-r] <hash>\n", argv[0]);
         exit(1);
     }
+
+    return recursive;
 }
 
 int main(int argc, char **argv) {
@@ -320,12 +195,11 @@ int main(int argc, char **argv) {
 
     if (strcmp(cmd, "init") == 0) {
 
-        return init();
+        return init(argc, argv);
 
     } else if (strcmp(cmd, "hash-object") == 0) {
 
-        int write_flag = handle_hash_object_opts(argc, argv);
-        return hash_object(argv[optind + 1], write_flag);
+        return hash_object(argc, argv);
 
     } else if (strcmp(cmd, "write-tree") == 0) {
 
@@ -335,24 +209,66 @@ int main(int argc, char **argv) {
 
         return update_index(argc, argv);
 
+    } else if (strcmp(cmd, "add") == 0) {
+
+        return add(argc, argv);
+
     } else if (strcmp(cmd, "ls-files") == 0) {
 
         return ls_files();
 
     } else if (strcmp(cmd, "ls-tree") == 0) {
 
-        handle_ls_tree_opts(argc, argv);
-        return ls_tree(argv[2]);
+        int recursive = handle_ls_tree_opts(argc, argv);
+        return ls_tree(argv[optind + 1], recursive);
 
     } else if (strcmp(cmd, "cat-file") == 0) {
 
-        handle_cat_file_opts(argc, argv);
-        return cat_file(argv[2]);
+        return cat_file(argc, argv);
+
+    } else if (strcmp(cmd, "check-ignore") == 0) {
+
+        return check_ignore(argc, argv);
 
     } else if (strcmp(cmd, "commit-tree") == 0) {
 
-        handle_commit_tree_opts(argc, argv);
-        return commit_tree(argv[2]);
+        return commit_tree(argc, argv);
+
+    } else if (strcmp(cmd, "commit-graph") == 0) {
+
+        return commit_graph(argc, argv);
+
+    } else if (strcmp(cmd, "status") == 0) {
+
+        return status(argc, argv);
+
+    } else if (strcmp(cmd, "diff-tree") == 0) {
+
+        return diff_tree(argc, argv);
+
+    } else if (strcmp(cmd, "checkout") == 0) {
+
+        return checkout(argc, argv);
+
+    } else if (strcmp(cmd, "fsmonitor") == 0) {
+
+        return fsmonitor(argc, argv);
+
+    } else if (strcmp(cmd, "log") == 0) {
+
+        return show_log(argc, argv);
+
+    } else if (strcmp(cmd, "rev-list") == 0) {
+
+        return rev_list(argc, argv);
+
+    } else if (strcmp(cmd, "merge-base") == 0) {
+
+        return merge_base(argc, argv);
+
+    } else if (strcmp(cmd, "repack") == 0) {
+
+        return repack(argc, argv);
 
     } else if (strcmp(cmd, "config") == 0) {
 
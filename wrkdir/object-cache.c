@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "hash.h"
+#include "object-cache.h"
+
+// Entries sit in a hash chain for lookup and in one list ordered by last use,
+// the least recently used end is evicted first
+struct object_cache_entry {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    char type[16];
+    char *data;
+    size_t size;
+    struct object_cache_entry *chain;
+    struct object_cache_entry *prev;
+    struct object_cache_entry *next;
+};
+
+static struct object_cache_entry *buckets[OBJECT_CACHE_BUCKETS];
+static struct object_cache_entry *lru_head, *lru_tail;
+static size_t cached_bytes, cache_limit;
+static size_t cache_hits, cache_misses;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void print_cache_stats(void) {
+    size_t hits, misses;
+    object_cache_stats(&hits, &misses);
+    fprintf(stderr, "object cache: %zu hits, %zu misses, %zu bytes cached\n",
+            hits, misses, cached_bytes);
+}
+
+// Counters are reported on exit when GBLIMI_TRACE_OBJECT_CACHE is set
+static void load_cache_limit(void) {
+    cache_limit =
+        get_config_size("core.objectCacheLimit", DEFAULT_OBJECT_CACHE_LIMIT);
+    if (getenv("GBLIMI_TRACE_OBJECT_CACHE"))
+        atexit(print_cache_stats);
+}
+
+static struct object_cache_entry **bucket_of(const unsigned char *sha1) {
+    return &buckets[(sha1[0] << 8 | sha1[1]) % OBJECT_CACHE_BUCKETS];
+}
+
+static void lru_unlink(struct object_cache_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+}
+
+static void lru_push_front(struct object_cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = lru_head;
+    if (lru_head)
+        lru_head->prev = entry;
+    lru_head = entry;
+    if (!lru_tail)
+        lru_tail = entry;
+}
+
+static void evict(struct object_cache_entry *entry) {
+    struct object_cache_entry **p = bucket_of(entry->sha1);
+    while (*p != entry)
+        p = &(*p)->chain;
+    *p = entry->chain;
+
+    lru_unlink(entry);
+    cached_bytes -= entry->size;
+    free(entry->data);
+    free(entry);
+}
+
+// Returns a copy of the cached content, NUL terminated like
+// retrieve_object(), or NULL on a miss
+char *object_cache_get(const unsigned char *sha1, char *type, size_t *size) {
+    pthread_once(&cache_once, load_cache_limit);
+    if (!cache_limit)
+        return NULL;
+
+    char *data = NULL;
+    pthread_mutex_lock(&cache_lock);
+
+    size_t rawsz = hash_algo()->rawsz;
+    struct object_cache_entry *entry = *bucket_of(sha1);
+    while (entry && memcmp(entry->sha1, sha1, rawsz))
+        entry = entry->chain;
+
+    if (entry) {
+        data = malloc(entry->size + 1);
+        memcpy(data, entry->data, entry->size + 1);
+        *size = entry->size;
+        if (type)
+            memcpy(type, entry->type, sizeof(entry->type));
+
+        lru_unlink(entry);
+        lru_push_front(entry);
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    return data;
+}
+
+// Keeps a copy of an object that was just read. Objects over a quarter of the
+// budget are not cached so one big blob cannot flush every tree.
+void object_cache_put(const unsigned char *sha1, const char *type,
+                      const char *data, size_t size) {
+    pthread_once(&cache_once, load_cache_limit);
+    if (size > cache_limit / 4)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+
+    size_t rawsz = hash_algo()->rawsz;
+    struct object_cache_entry **bucket = bucket_of(sha1);
+    struct object_cache_entry *entry = *bucket;
+    while (entry && memcmp(entry->sha1, sha1, rawsz))
+        entry = entry->chain;
+
+    if (!entry) {
+        while (lru_tail && cached_bytes + size > cache_limit)
+            evict(lru_tail);
+
+        entry = malloc(sizeof(*entry));
+        memcpy(entry->sha1, sha1, rawsz);
+        snprintf(entry->type, sizeof(entry->type), "%s", type);
+        entry->data = malloc(size + 1);
+        memcpy(entry->data, data, size + 1);
+        entry->size = size;
+        entry->chain = *bucket;
+        *bucket = entry;
+        lru_push_front(entry);
+        cached_bytes += size;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void object_cache_stats(size_t *hits, size_t *misses) {
+    pthread_mutex_lock(&cache_lock);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+}
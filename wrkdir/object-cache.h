@@ -0,0 +1,18 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <stddef.h>
+
+// Budget for inflated objects kept in memory, core.objectCacheLimit
+// overrides it and 0 turns the cache off
+#define DEFAULT_OBJECT_CACHE_LIMIT (16 * 1024 * 1024)
+#define OBJECT_CACHE_BUCKETS 4096
+
+char *object_cache_get(const unsigned char *sha1, char *type, size_t *size);
+
+void object_cache_put(const unsigned char *sha1, const char *type,
+                      const char *data, size_t size);
+
+void object_cache_stats(size_t *hits, size_t *misses);
+
+#endif
@@ -0,0 +1,469 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "hash.h"
+#include "object-cache.h"
+#include "object.h"
+#include "packfile.h"
+#include "tree.h"
+
+static const char *type_names[] = {
+    [OBJ_COMMIT] = "commit",
+    [OBJ_TREE] = "tree",
+    [OBJ_BLOB] = "blob",
+    [OBJ_TAG] = "tag",
+};
+
+int type_from_string(const char *type) {
+    for (int i = OBJ_COMMIT; i <= OBJ_TAG; i++)
+        if (!strcmp(type, type_names[i]))
+            return i;
+
+    return OBJ_NONE;
+}
+
+const char *type_name(int type) {
+    if (type < OBJ_COMMIT || type > OBJ_TAG)
+        return NULL;
+
+    return type_names[type];
+}
+
+static int is_hex(const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (!strchr("0123456789abcdef", str[i]) || str[i] == '\0')
+            return 0;
+
+    return str[len] == '\0';
+}
+
+// Calls fn with the hash of every object under .gblimi/objects/xx/, stops
+// early and returns fn's result when it is non-zero
+int for_each_loose_object(int (*fn)(char *hash, void *data), void *data) {
+    DIR *objects = opendir(".gblimi/objects");
+    if (!objects)
+        return 0;
+
+    int ret = 0;
+    struct dirent *fanout;
+    while (!ret && (fanout = readdir(objects)) != NULL) {
+        if (!is_hex(fanout->d_name, 2))
+            continue;
+
+        char dir_path[32];
+        snprintf(dir_path, sizeof(dir_path), ".gblimi/objects/%.2s",
+                 fanout->d_name);
+        DIR *dir = opendir(dir_path);
+        if (!dir)
+            continue;
+
+        size_t hexsz = hash_algo()->hexsz;
+        struct dirent *object;
+        while (!ret && (object = readdir(dir)) != NULL) {
+            if (!is_hex(object->d_name, hexsz - 2))
+                continue;
+
+            char hash[GIT_MAX_HEXSZ + 1];
+            snprintf(hash, sizeof(hash), "%.2s%.*s", fanout->d_name,
+                     (int)hexsz - 2, object->d_name);
+            ret = fn(hash, data);
+        }
+
+        closedir(dir);
+    }
+
+    closedir(objects);
+
+    return ret;
+}
+
+// Inflates into out until it is full or the zlib stream ends, refilling the
+// input buffer from the object file as needed
+static ssize_t inflate_into(struct object_stream *os, unsigned char *out,
+                            size_t len) {
+    os->stream.next_out = out;
+    os->stream.avail_out = len;
+
+    while (os->stream.avail_out > 0 && !os->done) {
+        if (os->stream.avail_in == 0) {
+            size_t read = fread(os->in, 1, OBJECT_CHUNK_SIZE, os->file);
+            if (read == 0)
+                return -1;
+            os->stream.next_in = os->in;
+            os->stream.avail_in = read;
+        }
+
+        int ret = inflate(&os->stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+            os->done = 1;
+        else if (ret != Z_OK)
+            return -1;
+    }
+
+    return len - os->stream.avail_out;
+}
+
+// Sets up the buffers and inflate state of a stream so it can be pointed at
+// one object after another with reopen_object_stream()
+void init_object_stream(struct object_stream *os) {
+    memset(os, 0, sizeof(*os));
+    os->in = malloc(OBJECT_CHUNK_SIZE);
+    inflateInit(&os->stream);
+}
+
+// Points an initialized stream at a loose object and parses its
+// "<type> <size>\0" header, keeping the buffers and inflate state from the
+// previous object. Returns 1 when there is no such loose object and -1 when
+// it is corrupt, either way the stream can still be reopened.
+int reopen_object_stream(struct object_stream *os, char *hash) {
+    if (os->file)
+        fclose(os->file);
+    os->file = NULL;
+    os->done = 0;
+    os->size = os->consumed = 0;
+    os->pending_len = os->pending_pos = 0;
+    os->stream.avail_in = 0;
+    inflateReset(&os->stream);
+
+    if (strlen(hash) != hash_algo()->hexsz)
+        return 1;
+
+    char object_path[OBJECT_PATH_MAX];
+    snprintf(object_path, sizeof(object_path), ".gblimi/objects/%.2s/%s",
+             hash, hash + 2);
+
+    os->file = fopen(object_path, "rb");
+    if (!os->file)
+        return 1;
+
+    unsigned char header[OBJECT_HEADER_MAX];
+    ssize_t have = inflate_into(os, header, sizeof(header));
+    unsigned char *nul = have > 0 ? memchr(header, '\0', have) : NULL;
+    char *space = nul ? memchr(header, ' ', nul - header) : NULL;
+    if (!space || (size_t)(space - (char *)header) >= sizeof(os->type)) {
+        fprintf(stderr, "Corrupt object %s\n", hash);
+        fclose(os->file);
+        os->file = NULL;
+        return -1;
+    }
+
+    memset(os->type, 0, sizeof(os->type));
+    memcpy(os->type, header, space - (char *)header);
+    os->size = strtoull(space + 1, NULL, 10);
+
+    os->pending_len = have - (nul + 1 - header);
+    memcpy(os->pending, nul + 1, os->pending_len);
+
+    return 0;
+}
+
+// Opens a loose object and parses its "<type> <size>\0" header, the content
+// is then pulled with read_object_stream()
+int open_object_stream(struct object_stream *os, char *hash) {
+    init_object_stream(os);
+    int ret = reopen_object_stream(os, hash);
+    if (ret) {
+        if (ret > 0)
+            fprintf(stderr, "Not a valid object name %s\n", hash);
+        close_object_stream(os);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Reads up to len bytes of object content, returns the number of bytes read,
+// 0 at the end of the object and -1 if the object is corrupt
+ssize_t read_object_stream(struct object_stream *os, void *buf, size_t len) {
+    if (len > os->size - os->consumed)
+        len = os->size - os->consumed;
+    if (len == 0)
+        return 0;
+
+    size_t copied = os->pending_len - os->pending_pos;
+    if (copied > len)
+        copied = len;
+    memcpy(buf, os->pending + os->pending_pos, copied);
+    os->pending_pos += copied;
+
+    if (copied < len) {
+        ssize_t inflated =
+            inflate_into(os, (unsigned char *)buf + copied, len - copied);
+        if (inflated < 0 || (size_t)inflated != len - copied)
+            return -1;
+    }
+
+    os->consumed += len;
+    return len;
+}
+
+void close_object_stream(struct object_stream *os) {
+    if (os->file)
+        fclose(os->file);
+    inflateEnd(&os->stream);
+    free(os->in);
+    os->file = NULL;
+    os->in = NULL;
+}
+
+// Looks the object up in the packs, returns NULL when it isn't packed
+static char *retrieve_packed_object(char *hash, char *type, size_t *size) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    if (strlen(hash) != hash_algo()->hexsz || hex_to_sha1(hash, sha1))
+        return NULL;
+
+    int packed_type;
+    char *data = (char *)read_packed_object(sha1, &packed_type, size);
+    if (data && type)
+        snprintf(type, 16, "%s", type_name(packed_type));
+
+    return data;
+}
+
+// Reads the type and size of an object without its content, packs only need
+// their entry headers and loose objects their zlib header. Returns 1 when the
+// object does not exist.
+int object_info(char *hash, char *type, size_t *size) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    int packed_type;
+    if (strlen(hash) == hash_algo()->hexsz && !hex_to_sha1(hash, sha1) &&
+        !packed_object_info(sha1, &packed_type, size)) {
+        snprintf(type, 16, "%s", type_name(packed_type));
+        return 0;
+    }
+
+    struct object_stream os;
+    if (open_object_stream(&os, hash))
+        return 1;
+
+    memcpy(type, os.type, sizeof(os.type));
+    *size = os.size;
+    close_object_stream(&os);
+
+    return 0;
+}
+
+// Writes the content of an object to out, loose objects are streamed without
+// holding them in memory
+int stream_object(char *hash, FILE *out) {
+    size_t size;
+    char *packed = retrieve_packed_object(hash, NULL, &size);
+    if (packed) {
+        fwrite(packed, 1, size, out);
+        free(packed);
+        return 0;
+    }
+
+    struct object_stream os;
+    if (open_object_stream(&os, hash))
+        return 1;
+
+    unsigned char *buf = malloc(OBJECT_CHUNK_SIZE);
+    ssize_t len;
+    while ((len = read_object_stream(&os, buf, OBJECT_CHUNK_SIZE)) > 0)
+        fwrite(buf, 1, len, out);
+
+    if (len < 0)
+        fprintf(stderr, "Corrupt object %s\n", hash);
+
+    free(buf);
+    close_object_stream(&os);
+
+    return len < 0;
+}
+
+// Reads a whole object from the packs, or inflates it from its loose file into
+// a buffer allocated once from the size in its header
+static char *read_object(char *hash, char *type, size_t *size) {
+    char *packed = retrieve_packed_object(hash, type, size);
+    if (packed)
+        return packed;
+
+    struct object_stream os;
+    if (open_object_stream(&os, hash))
+        return NULL;
+
+    char *data = malloc(os.size + 1);
+    if (!data || read_object_stream(&os, data, os.size) != (ssize_t)os.size) {
+        fprintf(stderr, "Corrupt object %s\n", hash);
+        free(data);
+        close_object_stream(&os);
+        return NULL;
+    }
+    data[os.size] = '\0';
+
+    *size = os.size;
+    memcpy(type, os.type, sizeof(os.type));
+
+    close_object_stream(&os);
+
+    return data;
+}
+
+// Returns the content of an object, from the object cache when it was read
+// recently. The content is NUL terminated and type, if given, needs room for
+// 16 bytes.
+char *retrieve_object(char *hash, char *type, size_t *size) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    int cacheable =
+        strlen(hash) == hash_algo()->hexsz && !hex_to_sha1(hash, sha1);
+    if (cacheable) {
+        char *cached = object_cache_get(sha1, type, size);
+        if (cached)
+            return cached;
+    }
+
+    char object_type[16];
+    char *data = read_object(hash, object_type, size);
+    if (!data)
+        return NULL;
+
+    if (cacheable)
+        object_cache_put(sha1, object_type, data, *size);
+    if (type)
+        memcpy(type, object_type, sizeof(object_type));
+
+    return data;
+}
+
+int format_object_header(char *header, const char *type, size_t len) {
+    return snprintf(header, OBJECT_HEADER_MAX, "%s %zu", type, len) + 1;
+}
+
+// Computes the id an object with this content would have without writing it
+void hash_object_data(const char *type, const void *data, size_t len,
+                      unsigned char *sha1) {
+    char header[OBJECT_HEADER_MAX];
+    int header_len = format_object_header(header, type, len);
+
+    EVP_MD_CTX *ctx = hash_ctx_new();
+    EVP_DigestUpdate(ctx, header, header_len);
+    EVP_DigestUpdate(ctx, data, len);
+    hash_ctx_final(ctx, sha1);
+    EVP_MD_CTX_free(ctx);
+}
+
+// Returns 1 when the object is in a pack or stored loose
+int has_object(const unsigned char *sha1) {
+    if (has_packed_object(sha1))
+        return 1;
+
+    char hash[GIT_MAX_HEXSZ + 1], object_path[OBJECT_PATH_MAX];
+    sha1_to_hex(sha1, hash);
+    snprintf(object_path, sizeof(object_path), ".gblimi/objects/%.2s/%s",
+             hash, hash + 2);
+
+    struct stat st;
+    return stat(object_path, &st) == 0;
+}
+
+// Creates a temporary file in the object's fan-out directory, so the final
+// rename stays within one directory and readers never see a partial object
+FILE *create_tmp_object(const char *hash, char *tmp_path, size_t len) {
+    char dir[32];
+    snprintf(dir, sizeof(dir), ".gblimi/objects/%.2s", hash);
+    mkdir(dir, 0777);
+
+    snprintf(tmp_path, len, "%s/tmp_obj_XXXXXX", dir);
+    // mkstemp() makes the file owner-only, objects are read-only for all
+    // as with git
+    int fd = mkstemp(tmp_path);
+    FILE *file = fd >= 0 && fchmod(fd, 0444) == 0 ? fdopen(fd, "wb") : NULL;
+    if (!file) {
+        perror("Failed to create temporary object");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+    }
+
+    return file;
+}
+
+// Closes the temporary object and renames it to the object's path, failed
+// is set when writing it went wrong and the file is only removed
+int commit_tmp_object(FILE *file, const char *tmp_path, const char *hash,
+                      int failed) {
+    if (fclose(file) != 0)
+        failed = 1;
+
+    char object_path[OBJECT_PATH_MAX];
+    snprintf(object_path, sizeof(object_path), ".gblimi/objects/%.2s/%s",
+             hash, hash + 2);
+    if (!failed && rename(tmp_path, object_path) != 0) {
+        perror("Failed to move object into place");
+        failed = 1;
+    }
+
+    if (failed) {
+        fprintf(stderr, "Failed to write object %s\n", hash);
+        unlink(tmp_path);
+    }
+
+    return failed;
+}
+
+// Runs everything currently in the stream's input through deflate and writes
+// the output to the object file, out needs room for OBJECT_CHUNK_SIZE bytes
+int deflate_object_chunk(z_stream *stream, unsigned char *out, FILE *object,
+                         int flush) {
+    do {
+        stream->next_out = out;
+        stream->avail_out = OBJECT_CHUNK_SIZE;
+
+        int ret = deflate(stream, flush);
+        if (ret == Z_STREAM_ERROR)
+            return 1;
+
+        size_t have = OBJECT_CHUNK_SIZE - stream->avail_out;
+        if (fwrite(out, 1, have, object) != have)
+            return 1;
+    } while (stream->avail_out == 0);
+
+    return 0;
+}
+
+// Hashes "<type> <size>\0" followed by data and stores the compressed object
+// under that hash, sha1 receives the object's id. Objects that already exist
+// are not compressed or written again.
+int write_object(const char *type, const void *data, size_t len,
+                 unsigned char *sha1) {
+    hash_object_data(type, data, len, sha1);
+    if (has_object(sha1))
+        return 0;
+
+    char hash[GIT_MAX_HEXSZ + 1], tmp_path[OBJECT_PATH_MAX];
+    sha1_to_hex(sha1, hash);
+    FILE *file = create_tmp_object(hash, tmp_path, sizeof(tmp_path));
+    if (!file)
+        return 1;
+
+    char header[OBJECT_HEADER_MAX];
+    int header_len = format_object_header(header, type, len);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, object_compression_level(data, len));
+    unsigned char *out = malloc(OBJECT_CHUNK_SIZE);
+
+    stream.next_in = (Bytef *)header;
+    stream.avail_in = header_len;
+    int ret = deflate_object_chunk(&stream, out, file, Z_NO_FLUSH);
+
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = len;
+    if (!ret)
+        ret = deflate_object_chunk(&stream, out, file, Z_FINISH);
+
+    deflateEnd(&stream);
+    free(out);
+
+    return commit_tmp_object(file, tmp_path, hash, ret);
+}
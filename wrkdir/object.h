@@ -0,0 +1,86 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#define OBJECT_CHUNK_SIZE (128 * 1024)
+
+// Longest possible "<type> <size>\0" header
+#define OBJECT_HEADER_MAX 32
+
+// Room for .gblimi/objects/xx/ followed by the rest of the longest hex id
+#define OBJECT_PATH_MAX 128
+
+// Type numbers as used in pack entry headers
+enum object_type {
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+};
+
+struct object_stream {
+    FILE *file;
+    z_stream stream;
+    unsigned char *in;
+    int done;
+
+    char type[16];
+    size_t size;
+    size_t consumed;
+
+    // Content bytes that were inflated along with the header
+    unsigned char pending[OBJECT_HEADER_MAX];
+    size_t pending_len;
+    size_t pending_pos;
+};
+
+int type_from_string(const char *type);
+
+const char *type_name(int type);
+
+int for_each_loose_object(int (*fn)(char *hash, void *data), void *data);
+
+void init_object_stream(struct object_stream *os);
+
+int reopen_object_stream(struct object_stream *os, char *hash);
+
+int open_object_stream(struct object_stream *os, char *hash);
+
+ssize_t read_object_stream(struct object_stream *os, void *buf, size_t len);
+
+void close_object_stream(struct object_stream *os);
+
+int object_info(char *hash, char *type, size_t *size);
+
+int stream_object(char *hash, FILE *out);
+
+char *retrieve_object(char *hash, char *type, size_t *size);
+
+int format_object_header(char *header, const char *type, size_t len);
+
+void hash_object_data(const char *type, const void *data, size_t len,
+                      unsigned char *sha1);
+
+int has_object(const unsigned char *sha1);
+
+FILE *create_tmp_object(const char *hash, char *tmp_path, size_t len);
+
+int commit_tmp_object(FILE *file, const char *tmp_path, const char *hash,
+                      int failed);
+
+int deflate_object_chunk(z_stream *stream, unsigned char *out, FILE *object,
+                         int flush);
+
+int write_object(const char *type, const void *data, size_t len,
+                 unsigned char *sha1);
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "oidmap.h"
+
+#define OIDMAP_INITIAL_SIZE 64
+
+void oidmap_init(struct oidmap *map) {
+    map->entries = NULL;
+    map->size = 0;
+    map->count = 0;
+}
+
+// Object ids are uniformly distributed already, their first bytes make a
+// good enough hash
+static size_t oid_hash(const unsigned char *oid) {
+    uint64_t hash;
+    memcpy(&hash, oid, sizeof(hash));
+    return hash;
+}
+
+static struct oidmap_entry *find_entry(const struct oidmap *map,
+                                       const unsigned char *oid) {
+    size_t rawsz = hash_algo()->rawsz;
+    size_t mask = map->size - 1;
+    for (size_t i = oid_hash(oid) & mask;; i = (i + 1) & mask) {
+        struct oidmap_entry *entry = &map->entries[i];
+        if (!entry->oid || !memcmp(entry->oid, oid, rawsz))
+            return entry;
+    }
+}
+
+void *oidmap_get(const struct oidmap *map, const unsigned char *oid) {
+    if (!map->size)
+        return NULL;
+
+    return find_entry(map, oid)->value;
+}
+
+static void grow(struct oidmap *map) {
+    struct oidmap_entry *old = map->entries;
+    size_t old_size = map->size;
+
+    map->size = old_size ? old_size * 2 : OIDMAP_INITIAL_SIZE;
+    map->entries = calloc(map->size, sizeof(*map->entries));
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i].oid)
+            *find_entry(map, old[i].oid) = old[i];
+
+    free(old);
+}
+
+// Adds oid or replaces its value, the table is kept at most 3/4 full
+void oidmap_put(struct oidmap *map, const unsigned char *oid, void *value) {
+    if ((map->count + 1) * 4 > map->size * 3)
+        grow(map);
+
+    struct oidmap_entry *entry = find_entry(map, oid);
+    if (!entry->oid) {
+        entry->oid = oid;
+        map->count++;
+    }
+    entry->value = value;
+}
+
+void oidmap_clear(struct oidmap *map) {
+    free(map->entries);
+    oidmap_init(map);
+}
@@ -0,0 +1,27 @@
+#ifndef OIDMAP_H
+#define OIDMAP_H
+
+#include <stddef.h>
+
+// Open addressing hash map keyed by raw object ids. Keys are not copied, they
+// must live as long as their entry.
+struct oidmap_entry {
+    const unsigned char *oid;
+    void *value;
+};
+
+struct oidmap {
+    struct oidmap_entry *entries;
+    size_t size;
+    size_t count;
+};
+
+void oidmap_init(struct oidmap *map);
+
+void *oidmap_get(const struct oidmap *map, const unsigned char *oid);
+
+void oidmap_put(struct oidmap *map, const unsigned char *oid, void *value);
+
+void oidmap_clear(struct oidmap *map);
+
+#endif
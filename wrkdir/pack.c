@@ -0,0 +1,408 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "hash.h"
+#include "hashfile.h"
+#include "object.h"
+#include "pack.h"
+#include "tree.h"
+
+struct window_slot {
+    struct pack_object *obj;
+    unsigned char *data;
+    struct delta_index *index;
+};
+
+struct loose_list {
+    struct pack_object *objects;
+    size_t num_objects;
+    size_t alloc;
+};
+
+static int collect_loose_object(char *hash, void *data) {
+    struct loose_list *list = data;
+
+    struct object_stream os;
+    if (open_object_stream(&os, hash))
+        return 1;
+
+    if (list->num_objects == list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 256;
+        list->objects =
+            realloc(list->objects, list->alloc * sizeof(struct pack_object));
+    }
+
+    struct pack_object *obj = &list->objects[list->num_objects++];
+    memset(obj, 0, sizeof(*obj));
+    snprintf(obj->hash, sizeof(obj->hash), "%s", hash);
+    hex_to_sha1(hash, obj->sha1);
+    obj->type = type_from_string(os.type);
+    obj->size = os.size;
+
+    close_object_stream(&os);
+
+    return obj->type == OBJ_NONE;
+}
+
+// Groups objects by type and puts the biggest first, so the window sees
+// similar objects together and deltas remove data from the smaller ones
+static int compare_pack_order(const void *a, const void *b) {
+    const struct pack_object *oa = a, *ob = b;
+    if (oa->type != ob->type)
+        return oa->type - ob->type;
+    if (oa->size != ob->size)
+        return oa->size < ob->size ? 1 : -1;
+
+    return memcmp(oa->sha1, ob->sha1, hash_algo()->rawsz);
+}
+
+static int compare_sha1(const void *a, const void *b) {
+    const struct pack_object *const *oa = a, *const *ob = b;
+    return memcmp((*oa)->sha1, (*ob)->sha1, hash_algo()->rawsz);
+}
+
+static int encode_entry_header(unsigned char *header, int type, size_t size) {
+    int len = 0;
+    unsigned char c = (type << 4) | (size & 15);
+    size >>= 4;
+    while (size) {
+        header[len++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    header[len++] = c;
+
+    return len;
+}
+
+// The distance back to the base is stored big-endian in 7-bit groups, each
+// continuation adding one so no encoding is redundant
+static int encode_ofs(unsigned char *out, off_t ofs) {
+    unsigned char buf[16];
+    int pos = sizeof(buf) - 1;
+    buf[pos] = ofs & 127;
+    while (ofs >>= 7)
+        buf[--pos] = 128 | (--ofs & 127);
+
+    memcpy(out, buf + pos, sizeof(buf) - pos);
+    return sizeof(buf) - pos;
+}
+
+static int write_pack_entry(struct hashfile *f, struct pack_object *obj,
+                            int type, size_t size, off_t base_offset,
+                            const unsigned char *data, size_t len) {
+    unsigned char header[32];
+    int header_len = encode_entry_header(header, type, size);
+    if (type == OBJ_OFS_DELTA)
+        header_len +=
+            encode_ofs(header + header_len, obj->offset - base_offset);
+
+    uLongf compressed_len = compressBound(len);
+    unsigned char *compressed = malloc(compressed_len);
+    if (compress2(compressed, &compressed_len, data, len,
+                  object_compression_level(data, len)) != Z_OK) {
+        free(compressed);
+        return 1;
+    }
+
+    obj->crc = crc32(0, header, header_len);
+    obj->crc = crc32(obj->crc, compressed, compressed_len);
+
+    hashfile_write(f, header, header_len);
+    hashfile_write(f, compressed, compressed_len);
+    free(compressed);
+
+    return 0;
+}
+
+static void clear_slot(struct window_slot *slot) {
+    free(slot->data);
+    free_delta_index(slot->index);
+    memset(slot, 0, sizeof(*slot));
+}
+
+// Tries every object in the window as a delta base for obj and keeps the
+// smallest delta, which has to beat half the object's size to be worth it
+static unsigned char *find_delta(struct window_slot *window, int window_size,
+                                 struct pack_object *obj, unsigned char *data,
+                                 int max_depth, struct pack_object **base,
+                                 size_t *delta_len) {
+    unsigned char *best = NULL;
+    size_t max_len = obj->size / 2 > 20 ? obj->size / 2 - 20 : 0;
+
+    for (int i = 0; i < window_size; i++) {
+        struct window_slot *slot = &window[i];
+        if (!slot->data || slot->obj->type != obj->type ||
+            slot->obj->depth >= max_depth ||
+            obj->size < slot->obj->size / 32 || max_len == 0)
+            continue;
+
+        if (!slot->index) {
+            slot->index = create_delta_index(slot->data, slot->obj->size);
+            if (!slot->index)
+                continue;
+        }
+
+        size_t len;
+        unsigned char *delta =
+            create_delta(slot->index, data, obj->size, &len, max_len);
+        if (!delta)
+            continue;
+
+        free(best);
+        best = delta;
+        *delta_len = len;
+        *base = slot->obj;
+        max_len = len - 1;
+    }
+
+    return best;
+}
+
+static int write_pack_idx(struct pack_object *objects, size_t num_objects,
+                          unsigned char *pack_sha1, char *idx_path) {
+    int fd = mkstemp(idx_path);
+    if (fd < 0 || fchmod(fd, 0444) != 0) {
+        perror("Failed to create pack index");
+        if (fd >= 0) {
+            close(fd);
+            unlink(idx_path);
+        }
+        return 1;
+    }
+
+    struct pack_object **sorted =
+        malloc((num_objects + 1) * sizeof(struct pack_object *));
+    for (size_t i = 0; i < num_objects; i++)
+        sorted[i] = &objects[i];
+    qsort(sorted, num_objects, sizeof(*sorted), compare_sha1);
+
+    struct hashfile f;
+    hashfile_init(&f, fd);
+    hashfile_be32(&f, PACK_IDX_SIGNATURE);
+    hashfile_be32(&f, PACK_IDX_VERSION);
+
+    // fanout[b] counts the objects whose first byte is at most b
+    size_t count = 0;
+    for (int b = 0; b < 256; b++) {
+        while (count < num_objects && sorted[count]->sha1[0] <= b)
+            count++;
+        hashfile_be32(&f, count);
+    }
+
+    size_t rawsz = hash_algo()->rawsz;
+    for (size_t i = 0; i < num_objects; i++)
+        hashfile_write(&f, sorted[i]->sha1, rawsz);
+    for (size_t i = 0; i < num_objects; i++)
+        hashfile_be32(&f, sorted[i]->crc);
+
+    // Offsets past 2 GiB go in a separate table of 64-bit offsets
+    uint32_t large = 0;
+    for (size_t i = 0; i < num_objects; i++) {
+        if (sorted[i]->offset < 0x80000000)
+            hashfile_be32(&f, sorted[i]->offset);
+        else
+            hashfile_be32(&f, 0x80000000 | large++);
+    }
+    for (size_t i = 0; i < num_objects; i++) {
+        if (sorted[i]->offset >= 0x80000000) {
+            hashfile_be32(&f, (uint64_t)sorted[i]->offset >> 32);
+            hashfile_be32(&f, sorted[i]->offset & 0xffffffff);
+        }
+    }
+
+    hashfile_write(&f, pack_sha1, rawsz);
+    int ret = hashfile_finish(&f, NULL);
+    if (close(fd) != 0)
+        ret = 1;
+
+    free(sorted);
+
+    return ret;
+}
+
+// Writes the objects, in the given order, into a v2 pack under
+// .gblimi/objects/pack along with its index. Every object is tried as a
+// delta against the previous window objects of the same type.
+int write_pack(struct pack_object *objects, size_t num_objects, int window,
+               int depth, char *pack_hash) {
+    mkdir(".gblimi/objects/pack", 0777);
+
+    char pack_tmp[] = ".gblimi/objects/pack/tmp_pack_XXXXXX";
+    char idx_tmp[] = ".gblimi/objects/pack/tmp_idx_XXXXXX";
+    int fd = mkstemp(pack_tmp);
+    if (fd < 0 || fchmod(fd, 0444) != 0) {
+        perror("Failed to create pack");
+        if (fd >= 0) {
+            close(fd);
+            unlink(pack_tmp);
+        }
+        return 1;
+    }
+
+    struct hashfile f;
+    hashfile_init(&f, fd);
+    hashfile_be32(&f, PACK_SIGNATURE);
+    hashfile_be32(&f, PACK_VERSION);
+    hashfile_be32(&f, num_objects);
+
+    struct window_slot *slots =
+        calloc(window > 0 ? window : 1, sizeof(struct window_slot));
+    int ret = 0;
+    size_t num_deltas = 0;
+
+    for (size_t i = 0; i < num_objects && !ret; i++) {
+        struct pack_object *obj = &objects[i];
+        obj->offset = f.total;
+
+        size_t size;
+        unsigned char *data =
+            (unsigned char *)retrieve_object(obj->hash, NULL, &size);
+        if (!data) {
+            ret = 1;
+            break;
+        }
+
+        struct pack_object *base = NULL;
+        size_t delta_len = 0;
+        unsigned char *delta = NULL;
+        if (window > 0 && obj->size <= DELTA_SIZE_LIMIT)
+            delta = find_delta(slots, window, obj, data, depth, &base,
+                               &delta_len);
+
+        if (delta) {
+            ret = write_pack_entry(&f, obj, OBJ_OFS_DELTA, delta_len,
+                                   base->offset, delta, delta_len);
+            obj->depth = base->depth + 1;
+            num_deltas++;
+            free(delta);
+        } else {
+            ret = write_pack_entry(&f, obj, obj->type, obj->size, 0, data,
+                                   obj->size);
+        }
+
+        if (window > 0 && obj->size <= DELTA_SIZE_LIMIT) {
+            struct window_slot *slot = &slots[i % window];
+            clear_slot(slot);
+            slot->obj = obj;
+            slot->data = data;
+        } else {
+            free(data);
+        }
+    }
+
+    for (int i = 0; i < window; i++)
+        clear_slot(&slots[i]);
+    free(slots);
+
+    unsigned char pack_sha1[GIT_MAX_RAWSZ];
+    if (hashfile_finish(&f, pack_sha1))
+        ret = 1;
+    if (close(fd) != 0)
+        ret = 1;
+
+    if (!ret)
+        ret = write_pack_idx(objects, num_objects, pack_sha1, idx_tmp);
+
+    if (!ret) {
+        sha1_to_hex(pack_sha1, pack_hash);
+
+        // The pack has to be in place before the index that makes it visible
+        char pack_path[128], idx_path[128];
+        snprintf(pack_path, sizeof(pack_path),
+                 ".gblimi/objects/pack/pack-%s.pack", pack_hash);
+        snprintf(idx_path, sizeof(idx_path),
+                 ".gblimi/objects/pack/pack-%s.idx", pack_hash);
+        if (rename(pack_tmp, pack_path) != 0 ||
+            rename(idx_tmp, idx_path) != 0) {
+            perror("Failed to move pack into place");
+            unlink(pack_path);
+            ret = 1;
+        }
+    }
+
+    if (ret) {
+        fprintf(stderr, "Failed to write pack\n");
+        unlink(pack_tmp);
+        unlink(idx_tmp);
+    } else {
+        printf("Packed %zu objects (%zu deltas) into pack-%s.pack\n",
+               num_objects, num_deltas, pack_hash);
+    }
+
+    return ret;
+}
+
+static void remove_loose_objects(struct pack_object *objects,
+                                 size_t num_objects) {
+    char path[OBJECT_PATH_MAX];
+    for (size_t i = 0; i < num_objects; i++) {
+        snprintf(path, sizeof(path), ".gblimi/objects/%.2s/%s",
+                 objects[i].hash, objects[i].hash + 2);
+        unlink(path);
+    }
+
+    // Only empty fan-out directories go away
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, sizeof(path), ".gblimi/objects/%02x", i);
+        rmdir(path);
+    }
+}
+
+int repack(int argc, char **argv) {
+    int window = DEFAULT_DELTA_WINDOW;
+    int depth = DEFAULT_DELTA_DEPTH;
+
+    struct option repack_options[] = {
+        {"window", required_argument, NULL, 'w'},
+        {"depth", required_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", repack_options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s repack [--window=<n>] [--depth=<n>]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    struct loose_list list = {NULL, 0, 0};
+    if (for_each_loose_object(collect_loose_object, &list)) {
+        free(list.objects);
+        return 1;
+    }
+
+    if (list.num_objects == 0) {
+        printf("Nothing new to pack\n");
+        return 0;
+    }
+
+    qsort(list.objects, list.num_objects, sizeof(struct pack_object),
+          compare_pack_order);
+
+    char pack_hash[GIT_MAX_HEXSZ + 1];
+    int ret =
+        write_pack(list.objects, list.num_objects, window, depth, pack_hash);
+    if (!ret)
+        remove_loose_objects(list.objects, list.num_objects);
+
+    free(list.objects);
+
+    return ret;
+}
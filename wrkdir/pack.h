@@ -0,0 +1,37 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+#define PACK_SIGNATURE 0x5041434b // "PACK"
+#define PACK_VERSION 2
+
+#define PACK_IDX_SIGNATURE 0xff744f63 // "\377tOc"
+#define PACK_IDX_VERSION 2
+
+#define DEFAULT_DELTA_WINDOW 10
+#define DEFAULT_DELTA_DEPTH 50
+
+// Objects bigger than this are stored whole instead of being delta candidates
+#define DELTA_SIZE_LIMIT (64 * 1024 * 1024)
+
+struct pack_object {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    char hash[GIT_MAX_HEXSZ + 1];
+    int type;
+    size_t size;
+    off_t offset;
+    uint32_t crc;
+    int depth;
+};
+
+int write_pack(struct pack_object *objects, size_t num_objects, int window,
+               int depth, char *pack_hash);
+
+int repack(int argc, char **argv);
+
+#endif
@@ -0,0 +1,542 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "hash.h"
+#include "object.h"
+#include "pack.h"
+#include "packfile.h"
+#include "tree.h"
+#include "uint-util.h"
+
+struct delta_base_entry {
+    struct packed_git *pack;
+    off_t offset;
+    unsigned char *data;
+    size_t size;
+    int type;
+};
+
+struct delta_step {
+    off_t offset;
+    size_t data_offset;
+    size_t delta_size;
+};
+
+static struct packed_git *packed_git;
+static pthread_once_t packed_git_once = PTHREAD_ONCE_INIT;
+
+static struct delta_base_entry delta_base_cache[DELTA_BASE_CACHE_SLOTS];
+static size_t delta_base_cached;
+static pthread_mutex_t delta_base_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *size = st.st_size;
+    return map;
+}
+
+// Maps pack-<hash>.idx and its pack, only accepting the pair when the index
+// is a v2 index that was written for exactly this pack
+static struct packed_git *open_pack(const char *idx_name) {
+    char path[160];
+    snprintf(path, sizeof(path), ".gblimi/objects/pack/%s", idx_name);
+
+    struct packed_git *pack = calloc(1, sizeof(struct packed_git));
+    snprintf(pack->name, sizeof(pack->name), "%s", idx_name);
+
+    size_t rawsz = pack->rawsz = hash_algo()->rawsz;
+    pack->idx = map_file(path, &pack->idx_size);
+    if (!pack->idx || pack->idx_size < 8 + 1024 + 2 * rawsz ||
+        get_be32(pack->idx) != PACK_IDX_SIGNATURE ||
+        get_be32(pack->idx + 4) != PACK_IDX_VERSION)
+        goto fail;
+
+    pack->fanout = pack->idx + 8;
+    pack->num_objects = get_be32(pack->fanout + 255 * 4);
+    pack->sha1s = pack->fanout + 1024;
+    size_t n = pack->num_objects;
+    if (pack->idx_size < 8 + 1024 + n * (rawsz + 8) + 2 * rawsz)
+        goto fail;
+    pack->offsets = pack->sha1s + n * (rawsz + 4);
+    pack->large_offsets = pack->offsets + n * 4;
+    pack->num_large_offsets =
+        (pack->idx_size - 8 - 1024 - n * (rawsz + 8) - 2 * rawsz) / 8;
+
+    snprintf(path + strlen(path) - 4, 6, ".pack");
+    pack->pack = map_file(path, &pack->pack_size);
+    if (!pack->pack || pack->pack_size < 12 + rawsz ||
+        get_be32(pack->pack) != PACK_SIGNATURE ||
+        get_be32(pack->pack + 8) != pack->num_objects ||
+        memcmp(pack->pack + pack->pack_size - rawsz,
+               pack->idx + pack->idx_size - 2 * rawsz, rawsz) != 0)
+        goto fail;
+
+    return pack;
+
+fail:
+    fprintf(stderr, "Ignoring unusable pack %s\n", idx_name);
+    if (pack->idx)
+        munmap((void *)pack->idx, pack->idx_size);
+    if (pack->pack)
+        munmap((void *)pack->pack, pack->pack_size);
+    free(pack);
+    return NULL;
+}
+
+static void load_packed_git(void) {
+    DIR *dir = opendir(".gblimi/objects/pack");
+    if (!dir)
+        return;
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t len = strlen(dirent->d_name);
+        if (len < 4 || strcmp(dirent->d_name + len - 4, ".idx") != 0 ||
+            len >= sizeof(((struct packed_git *)0)->name))
+            continue;
+
+        struct packed_git *pack = open_pack(dirent->d_name);
+        if (pack) {
+            pack->next = packed_git;
+            packed_git = pack;
+        }
+    }
+
+    closedir(dir);
+}
+
+// Packs are only scanned for once, after that every lookup is done in memory
+void prepare_packed_git(void) {
+    pthread_once(&packed_git_once, load_packed_git);
+}
+
+struct packed_git *get_packed_git(void) {
+    prepare_packed_git();
+    return packed_git;
+}
+
+// Returns -1 when the entry points past the large offset table, which only
+// a corrupt index does
+static off_t entry_offset(struct packed_git *pack, uint32_t pos) {
+    uint32_t offset = get_be32(pack->offsets + (size_t)pos * 4);
+    if (!(offset & 0x80000000))
+        return offset;
+
+    size_t large_pos = offset & 0x7fffffff;
+    if (large_pos >= pack->num_large_offsets)
+        return -1;
+
+    const unsigned char *large = pack->large_offsets + large_pos * 8;
+    return ((off_t)get_be32(large) << 32) | get_be32(large + 4);
+}
+
+// The fanout table narrows the search to objects sharing the first byte, the
+// rest is a binary search over the sorted hashes
+int find_pack_entry(const unsigned char *sha1, struct packed_git **pack,
+                    off_t *offset) {
+    for (struct packed_git *p = get_packed_git(); p; p = p->next) {
+        uint32_t low = sha1[0] ? get_be32(p->fanout + (sha1[0] - 1) * 4) : 0;
+        uint32_t high = get_be32(p->fanout + sha1[0] * 4);
+        if (high > p->num_objects)
+            high = p->num_objects;
+
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            int cmp =
+                memcmp(p->sha1s + (size_t)mid * p->rawsz, sha1, p->rawsz);
+            if (cmp == 0) {
+                *pack = p;
+                *offset = entry_offset(p, mid);
+                if (*offset < 0)
+                    break;
+                return 1;
+            }
+            if (cmp < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+    }
+
+    return 0;
+}
+
+int has_packed_object(const unsigned char *sha1) {
+    struct packed_git *pack;
+    off_t offset;
+    return find_pack_entry(sha1, &pack, &offset);
+}
+
+static size_t delta_base_slot(struct packed_git *pack, off_t offset) {
+    return ((uintptr_t)pack / sizeof(struct packed_git) + offset) %
+           DELTA_BASE_CACHE_SLOTS;
+}
+
+static unsigned char *get_cached_base(struct packed_git *pack, off_t offset,
+                                      int *type, size_t *size) {
+    unsigned char *data = NULL;
+
+    pthread_mutex_lock(&delta_base_lock);
+    struct delta_base_entry *entry =
+        &delta_base_cache[delta_base_slot(pack, offset)];
+    if (entry->data && entry->pack == pack && entry->offset == offset) {
+        data = malloc(entry->size + 1);
+        memcpy(data, entry->data, entry->size + 1);
+        *type = entry->type;
+        *size = entry->size;
+    }
+    pthread_mutex_unlock(&delta_base_lock);
+
+    return data;
+}
+
+static void evict_base(struct delta_base_entry *entry) {
+    if (!entry->data)
+        return;
+
+    delta_base_cached -= entry->size;
+    free(entry->data);
+    entry->data = NULL;
+}
+
+static void cache_base(struct packed_git *pack, off_t offset,
+                       const unsigned char *data, int type, size_t size) {
+    if (size > DELTA_BASE_CACHE_LIMIT / 4)
+        return;
+
+    pthread_mutex_lock(&delta_base_lock);
+    struct delta_base_entry *entry =
+        &delta_base_cache[delta_base_slot(pack, offset)];
+    evict_base(entry);
+
+    // Make room by dropping whatever else is cached, oldest slots first
+    for (size_t i = 0; delta_base_cached + size > DELTA_BASE_CACHE_LIMIT &&
+                       i < DELTA_BASE_CACHE_SLOTS;
+         i++)
+        evict_base(&delta_base_cache[i]);
+
+    entry->pack = pack;
+    entry->offset = offset;
+    entry->type = type;
+    entry->size = size;
+    entry->data = malloc(size + 1);
+    memcpy(entry->data, data, size + 1);
+    delta_base_cached += size;
+    pthread_mutex_unlock(&delta_base_lock);
+}
+
+static int parse_entry_header(struct packed_git *pack, off_t offset,
+                              int *type, size_t *size, size_t *header_len) {
+    const unsigned char *p = pack->pack + offset;
+    const unsigned char *end = pack->pack + pack->pack_size - pack->rawsz;
+    if (offset < 12 || p >= end)
+        return 1;
+
+    unsigned char c = *p++;
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (p == end || shift > 57)
+            return 1;
+        c = *p++;
+        *size += (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    *header_len = p - (pack->pack + offset);
+    return 0;
+}
+
+static int parse_ofs(struct packed_git *pack, size_t pos, off_t *ofs,
+                     size_t *len) {
+    const unsigned char *p = pack->pack + pos;
+    const unsigned char *end = pack->pack + pack->pack_size - pack->rawsz;
+    if (p >= end)
+        return 1;
+
+    unsigned char c = *p++;
+    *ofs = c & 127;
+    while (c & 128) {
+        if (p == end || *ofs >= ((off_t)1 << 55))
+            return 1;
+        c = *p++;
+        *ofs = ((*ofs + 1) << 7) + (c & 127);
+    }
+
+    *len = p - (pack->pack + pos);
+    return 0;
+}
+
+static unsigned char *inflate_at(struct packed_git *pack, size_t pos,
+                                 size_t size) {
+    if (pos >= pack->pack_size - pack->rawsz)
+        return NULL;
+
+    unsigned char *data = malloc(size + 1);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+
+    size_t avail = pack->pack_size - pack->rawsz - pos;
+    stream.next_in = (Bytef *)(pack->pack + pos);
+    stream.avail_in = avail > UINT32_MAX ? UINT32_MAX : avail;
+    stream.next_out = data;
+    stream.avail_out = size;
+
+    // Give inflate room to see the end of the stream on empty objects too
+    unsigned char spare;
+    int ret = inflate(&stream, Z_FINISH);
+    if (ret == Z_BUF_ERROR && stream.avail_out == 0) {
+        stream.next_out = &spare;
+        stream.avail_out = 1;
+        ret = inflate(&stream, Z_FINISH);
+    }
+    inflateEnd(&stream);
+
+    if (ret != Z_STREAM_END || stream.total_out != size) {
+        free(data);
+        return NULL;
+    }
+
+    data[size] = '\0';
+    return data;
+}
+
+static unsigned char *read_ref_delta_base(const unsigned char *sha1,
+                                          int *type, size_t *size) {
+    unsigned char *data = read_packed_object(sha1, type, size);
+    if (data)
+        return data;
+
+    char hash[GIT_MAX_HEXSZ + 1], type_str[16];
+    sha1_to_hex(sha1, hash);
+    data = (unsigned char *)retrieve_object(hash, type_str, size);
+    if (data)
+        *type = type_from_string(type_str);
+
+    return data;
+}
+
+// Walks back along the delta chain until it reaches a whole object or a
+// cached base, then applies the deltas forwards again. The result is NUL
+// terminated.
+unsigned char *unpack_entry(struct packed_git *pack, off_t offset, int *type,
+                            size_t *size) {
+    struct delta_step *steps = NULL;
+    size_t num_steps = 0, alloc = 0;
+
+    unsigned char *base = NULL;
+    size_t base_size = 0;
+    int base_type = OBJ_NONE;
+    off_t base_offset = offset;
+
+    for (;;) {
+        base = get_cached_base(pack, base_offset, &base_type, &base_size);
+        if (base)
+            break;
+
+        int entry_type;
+        size_t entry_size, header_len;
+        if (parse_entry_header(pack, base_offset, &entry_type, &entry_size,
+                               &header_len))
+            break;
+
+        size_t data_offset = base_offset + header_len;
+        if (entry_type == OBJ_OFS_DELTA || entry_type == OBJ_REF_DELTA) {
+            if (num_steps == alloc) {
+                alloc = alloc ? alloc * 2 : 16;
+                steps = realloc(steps, alloc * sizeof(struct delta_step));
+            }
+            struct delta_step *step = &steps[num_steps++];
+            step->offset = base_offset;
+            step->delta_size = entry_size;
+
+            if (entry_type == OBJ_REF_DELTA) {
+                step->data_offset = data_offset + pack->rawsz;
+                if (step->data_offset >= pack->pack_size - pack->rawsz)
+                    break;
+                base = read_ref_delta_base(pack->pack + data_offset,
+                                           &base_type, &base_size);
+                base_offset = -1;
+                break;
+            }
+
+            off_t ofs;
+            size_t ofs_len;
+            if (parse_ofs(pack, data_offset, &ofs, &ofs_len) ||
+                ofs >= base_offset)
+                break;
+            step->data_offset = data_offset + ofs_len;
+            base_offset -= ofs;
+            continue;
+        }
+
+        base = inflate_at(pack, data_offset, entry_size);
+        base_type = entry_type;
+        base_size = entry_size;
+        break;
+    }
+
+    while (base && num_steps > 0) {
+        struct delta_step *step = &steps[--num_steps];
+        unsigned char *delta =
+            inflate_at(pack, step->data_offset, step->delta_size);
+        if (!delta) {
+            free(base);
+            base = NULL;
+            break;
+        }
+
+        if (base_offset >= 0)
+            cache_base(pack, base_offset, base, base_type, base_size);
+
+        size_t result_size;
+        unsigned char *result = patch_delta(base, base_size, delta,
+                                            step->delta_size, &result_size);
+        free(delta);
+        free(base);
+        base = result;
+        base_size = result_size;
+        base_offset = step->offset;
+    }
+
+    free(steps);
+
+    if (!base) {
+        fprintf(stderr, "Corrupt entry at offset %lld in %s\n",
+                (long long)offset, pack->name);
+        return NULL;
+    }
+
+    *type = base_type;
+    *size = base_size;
+    return base;
+}
+
+// Returns NULL when the object isn't in any pack
+unsigned char *read_packed_object(const unsigned char *sha1, int *type,
+                                  size_t *size) {
+    struct packed_git *pack;
+    off_t offset;
+    if (!find_pack_entry(sha1, &pack, &offset))
+        return NULL;
+
+    return unpack_entry(pack, offset, type, size);
+}
+
+// A delta starts with the sizes of its base and its result, only those first
+// bytes are inflated to learn the size of the object it produces
+static int delta_result_size(struct packed_git *pack, size_t pos,
+                             size_t *size) {
+    if (pos >= pack->pack_size - pack->rawsz)
+        return 1;
+
+    unsigned char buf[32];
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+
+    size_t avail = pack->pack_size - pack->rawsz - pos;
+    stream.next_in = (Bytef *)(pack->pack + pos);
+    stream.avail_in = avail > UINT32_MAX ? UINT32_MAX : avail;
+    stream.next_out = buf;
+    stream.avail_out = sizeof(buf);
+    int ret = inflate(&stream, Z_SYNC_FLUSH);
+    size_t have = sizeof(buf) - stream.avail_out;
+    inflateEnd(&stream);
+    if (ret != Z_OK && ret != Z_STREAM_END)
+        return 1;
+
+    // Skip the base size, then decode the result size
+    size_t i = 0;
+    while (i < have && (buf[i] & 0x80))
+        i++;
+    i++;
+
+    *size = 0;
+    for (int shift = 0; i < have && shift < 64; shift += 7) {
+        *size |= (size_t)(buf[i] & 0x7f) << shift;
+        if (!(buf[i++] & 0x80))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Finds the type and size of a packed object from the entry headers alone,
+// following a delta chain only as far as the first whole object for its type.
+// Returns 1 when the object is not packed or its entry is corrupt.
+int packed_object_info(const unsigned char *sha1, int *type, size_t *size) {
+    struct packed_git *pack;
+    off_t offset;
+    if (!find_pack_entry(sha1, &pack, &offset))
+        return 1;
+
+    int first = 1;
+    for (;;) {
+        int entry_type;
+        size_t entry_size, header_len;
+        if (parse_entry_header(pack, offset, &entry_type, &entry_size,
+                               &header_len))
+            break;
+
+        size_t data_offset = offset + header_len;
+        if (entry_type == OBJ_REF_DELTA) {
+            if (first &&
+                delta_result_size(pack, data_offset + pack->rawsz, size))
+                break;
+
+            char hash[GIT_MAX_HEXSZ + 1], type_str[16];
+            size_t base_size;
+            sha1_to_hex(pack->pack + data_offset, hash);
+            if (object_info(hash, type_str, &base_size))
+                break;
+            *type = type_from_string(type_str);
+            return 0;
+        }
+
+        if (entry_type == OBJ_OFS_DELTA) {
+            off_t ofs;
+            size_t ofs_len;
+            if (parse_ofs(pack, data_offset, &ofs, &ofs_len) || ofs >= offset)
+                break;
+            if (first &&
+                delta_result_size(pack, data_offset + ofs_len, size))
+                break;
+            offset -= ofs;
+            first = 0;
+            continue;
+        }
+
+        *type = entry_type;
+        if (first)
+            *size = entry_size;
+        return 0;
+    }
+
+    fprintf(stderr, "Corrupt entry at offset %lld in %s\n", (long long)offset,
+            pack->name);
+    return 1;
+}
@@ -0,0 +1,51 @@
+#ifndef PACKFILE_H
+#define PACKFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Inflated delta bases kept around so chains sharing a base don't rebuild it
+#define DELTA_BASE_CACHE_SLOTS 256
+#define DELTA_BASE_CACHE_LIMIT (32 * 1024 * 1024)
+
+// A pack and its index, both mapped for the life of the process
+struct packed_git {
+    struct packed_git *next;
+
+    const unsigned char *idx;
+    size_t idx_size;
+    uint32_t num_objects;
+    const unsigned char *fanout;
+    const unsigned char *sha1s;
+    const unsigned char *offsets;
+    const unsigned char *large_offsets;
+    size_t num_large_offsets;
+
+    const unsigned char *pack;
+    size_t pack_size;
+
+    // Size of the object ids in the index and of the trailing checksums
+    size_t rawsz;
+
+    char name[128];
+};
+
+void prepare_packed_git(void);
+
+struct packed_git *get_packed_git(void);
+
+int find_pack_entry(const unsigned char *sha1, struct packed_git **pack,
+                    off_t *offset);
+
+int has_packed_object(const unsigned char *sha1);
+
+unsigned char *unpack_entry(struct packed_git *pack, off_t offset, int *type,
+                            size_t *size);
+
+unsigned char *read_packed_object(const unsigned char *sha1, int *type,
+                                  size_t *size);
+
+int packed_object_info(const unsigned char *sha1, int *type, size_t *size);
+
+#endif
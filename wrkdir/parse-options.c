@@ -0,0 +1,12 @@
+#include <getopt.h>
+
+#include "parse-options.h"
+
+// Once getopt has run, argv is permuted so the options come first, then the
+// command name at argv[optind] and its operands. Points operands at those
+// and returns how many there are.
+int command_operands(int argc, char **argv, char ***operands) {
+    *operands = argv + optind + 1;
+
+    return argc - optind - 1;
+}
@@ -0,0 +1,6 @@
+#ifndef PARSE_OPTIONS_H
+#define PARSE_OPTIONS_H
+
+int command_operands(int argc, char **argv, char ***operands);
+
+#endif
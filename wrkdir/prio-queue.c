@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "prio-queue.h"
+
+void prio_queue_init(struct prio_queue *queue, prio_queue_compare_fn compare) {
+    queue->compare = compare;
+    queue->insertion_ctr = 0;
+    queue->array = NULL;
+    queue->nr = 0;
+    queue->alloc = 0;
+}
+
+static int compare(struct prio_queue *queue, size_t i, size_t j) {
+    int cmp = queue->compare(queue->array[i].data, queue->array[j].data);
+    if (cmp)
+        return cmp;
+
+    return queue->array[i].ctr < queue->array[j].ctr ? -1 : 1;
+}
+
+static void swap(struct prio_queue *queue, size_t i, size_t j) {
+    struct prio_queue_entry tmp = queue->array[i];
+    queue->array[i] = queue->array[j];
+    queue->array[j] = tmp;
+}
+
+void prio_queue_put(struct prio_queue *queue, void *data) {
+    if (queue->nr == queue->alloc) {
+        queue->alloc = queue->alloc ? queue->alloc * 2 : 64;
+        queue->array =
+            realloc(queue->array, queue->alloc * sizeof(*queue->array));
+    }
+
+    size_t i = queue->nr++;
+    queue->array[i].ctr = queue->insertion_ctr++;
+    queue->array[i].data = data;
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (compare(queue, parent, i) <= 0)
+            break;
+        swap(queue, parent, i);
+        i = parent;
+    }
+}
+
+void *prio_queue_get(struct prio_queue *queue) {
+    if (!queue->nr)
+        return NULL;
+
+    void *result = queue->array[0].data;
+    queue->array[0] = queue->array[--queue->nr];
+
+    size_t i = 0, child;
+    while ((child = 2 * i + 1) < queue->nr) {
+        if (child + 1 < queue->nr && compare(queue, child + 1, child) < 0)
+            child++;
+        if (compare(queue, i, child) <= 0)
+            break;
+        swap(queue, i, child);
+        i = child;
+    }
+
+    return result;
+}
+
+void *prio_queue_peek(struct prio_queue *queue) {
+    return queue->nr ? queue->array[0].data : NULL;
+}
+
+void clear_prio_queue(struct prio_queue *queue) {
+    free(queue->array);
+    prio_queue_init(queue, queue->compare);
+}
@@ -0,0 +1,33 @@
+#ifndef PRIO_QUEUE_H
+#define PRIO_QUEUE_H
+
+#include <stddef.h>
+
+// Binary heap returning the item compare() orders first. Items that compare
+// equal come out in insertion order.
+typedef int (*prio_queue_compare_fn)(const void *a, const void *b);
+
+struct prio_queue_entry {
+    size_t ctr;
+    void *data;
+};
+
+struct prio_queue {
+    prio_queue_compare_fn compare;
+    size_t insertion_ctr;
+    struct prio_queue_entry *array;
+    size_t nr;
+    size_t alloc;
+};
+
+void prio_queue_init(struct prio_queue *queue, prio_queue_compare_fn compare);
+
+void prio_queue_put(struct prio_queue *queue, void *data);
+
+void *prio_queue_get(struct prio_queue *queue);
+
+void *prio_queue_peek(struct prio_queue *queue);
+
+void clear_prio_queue(struct prio_queue *queue);
+
+#endif
@@ -0,0 +1,585 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit-graph.h"
+#include "commit.h"
+#include "object.h"
+#include "oidmap.h"
+#include "parse-options.h"
+#include "revision.h"
+#include "tree.h"
+
+// Every commit looked up so far, by id and in lookup order so flags can be
+// cleared between walks
+static struct oidmap commits;
+static struct commit **all_commits;
+static size_t num_commits, alloc_commits;
+
+struct commit *lookup_commit(const unsigned char *oid) {
+    struct commit *commit = oidmap_get(&commits, oid);
+    if (commit)
+        return commit;
+
+    commit = calloc(1, sizeof(struct commit));
+    memcpy(commit->oid, oid, hash_algo()->rawsz);
+    commit->graph_pos = GRAPH_POS_UNKNOWN;
+    commit->generation = GENERATION_NUMBER_INFINITY;
+    oidmap_put(&commits, commit->oid, commit);
+
+    if (num_commits == alloc_commits) {
+        alloc_commits = alloc_commits ? alloc_commits * 2 : 64;
+        all_commits =
+            realloc(all_commits, alloc_commits * sizeof(*all_commits));
+    }
+    all_commits[num_commits++] = commit;
+
+    return commit;
+}
+
+static void clear_commit_flags(unsigned flags) {
+    for (size_t i = 0; i < num_commits; i++)
+        all_commits[i]->flags &= ~flags;
+}
+
+static void add_parent(struct commit *commit, struct commit *parent) {
+    commit->parents = realloc(commit->parents, (commit->num_parents + 1) *
+                                                   sizeof(*commit->parents));
+    commit->parents[commit->num_parents++] = parent;
+}
+
+static int parse_commit_from_graph(struct commit *commit,
+                                   const struct commit_graph *graph) {
+    uint32_t pos = commit->graph_pos, parent;
+    commit->generation = commit_graph_generation(graph, pos);
+    commit->date = commit_graph_date(graph, pos);
+
+    int ret;
+    while ((ret = commit_graph_parent(graph, pos, commit->num_parents,
+                                      &parent)) > 0) {
+        struct commit *p = lookup_commit(commit_graph_oid(graph, parent));
+        p->graph_pos = parent;
+        add_parent(commit, p);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Corrupt %s\n", COMMIT_GRAPH_PATH);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Fills in the parents and date, without inflating anything for commits in
+// the commit-graph
+int parse_commit(struct commit *commit) {
+    if (commit->parsed)
+        return 0;
+
+    struct commit_graph *graph = get_commit_graph();
+    if (graph && commit->graph_pos == GRAPH_POS_UNKNOWN &&
+        !commit_graph_pos(graph, commit->oid, &commit->graph_pos))
+        commit->graph_pos = GRAPH_PARENT_NONE;
+
+    if (graph && commit->graph_pos != GRAPH_PARENT_NONE) {
+        if (parse_commit_from_graph(commit, graph))
+            return 1;
+    } else {
+        struct commit_info info;
+        if (read_commit_info(commit->oid, &info))
+            return 1;
+
+        size_t rawsz = hash_algo()->rawsz;
+        commit->date = info.date;
+        for (int i = 0; i < info.num_parents; i++)
+            add_parent(commit, lookup_commit(info.parents + i * rawsz));
+        clear_commit_info(&info);
+    }
+
+    commit->parsed = 1;
+    return 0;
+}
+
+// Commits outside the commit-graph get their generation from their parents,
+// which means reading history down to the graph, or to the roots without one
+static int compute_generation(struct commit *commit) {
+    if (parse_commit(commit))
+        return 1;
+    if (commit->generation != GENERATION_NUMBER_INFINITY)
+        return 0;
+
+    size_t num = 0, alloc = 64;
+    struct commit **stack = malloc(alloc * sizeof(*stack));
+    stack[num++] = commit;
+
+    int ret = 0;
+    while (!ret && num > 0) {
+        struct commit *top = stack[num - 1];
+        if (top->generation != GENERATION_NUMBER_INFINITY) {
+            num--;
+            continue;
+        }
+
+        uint32_t max = 0;
+        int ready = 1;
+        for (int i = 0; !ret && i < top->num_parents; i++) {
+            struct commit *parent = top->parents[i];
+            if (parse_commit(parent)) {
+                ret = 1;
+            } else if (parent->generation == GENERATION_NUMBER_INFINITY) {
+                ready = 0;
+                if (num == alloc)
+                    stack = realloc(stack, (alloc *= 2) * sizeof(*stack));
+                stack[num++] = parent;
+            } else if (parent->generation > max) {
+                max = parent->generation;
+            }
+        }
+
+        if (!ret && ready) {
+            top->generation = max < GENERATION_NUMBER_MAX ? max + 1 : max;
+            num--;
+        }
+    }
+
+    free(stack);
+
+    return ret;
+}
+
+// Higher generations first, so a commit always comes out before its
+// parents, then newer commits first
+static int compare_commits(const void *a, const void *b) {
+    const struct commit *x = a, *y = b;
+    if (x->generation != y->generation)
+        return x->generation > y->generation ? -1 : 1;
+    if (x->date != y->date)
+        return x->date > y->date ? -1 : 1;
+
+    return 0;
+}
+
+static int read_ref(const char *path, unsigned char *sha1, int depth) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 1;
+
+    char line[PATH_MAX];
+    int ret = 1;
+    if (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!strncmp(line, "ref: ", 5) && depth < 5) {
+            char target[PATH_MAX + 16];
+            snprintf(target, sizeof(target), ".gblimi/%s", line + 5);
+            ret = read_ref(target, sha1, depth + 1);
+        } else if (strlen(line) == hash_algo()->hexsz) {
+            ret = hex_to_sha1(line, sha1);
+        }
+    }
+    fclose(file);
+
+    return ret;
+}
+
+// Accepts a full object id, HEAD or a ref, either spelled out or as a short
+// name looked up under refs/, refs/tags/ and refs/heads/ in that order.
+// Returns 1 without a message when the name cannot be resolved.
+int resolve_revision(const char *name, unsigned char *sha1) {
+    if (strlen(name) == hash_algo()->hexsz && !hex_to_sha1(name, sha1))
+        return 0;
+
+    static const char *prefixes[] = {"", "refs/", "refs/tags/",
+                                     "refs/heads/"};
+    if (*name && !strstr(name, "..") && name[0] != '/') {
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(*prefixes); i++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), ".gblimi/%s%s", prefixes[i], name);
+            if (!read_ref(path, sha1, 0))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+int get_commit_oid(const char *name, unsigned char *sha1) {
+    if (!resolve_revision(name, sha1))
+        return 0;
+
+    fprintf(stderr, "Unknown revision %s\n", name);
+    return 1;
+}
+
+// Resolves name to a commit or tree and gives the tree, for a commit the one
+// it records. oid is what name itself names.
+int get_tree_oid(const char *name, unsigned char *oid, unsigned char *tree) {
+    char hex[GIT_MAX_HEXSZ + 1], type[16];
+    size_t size;
+    if (get_commit_oid(name, oid))
+        return 1;
+    sha1_to_hex(oid, hex);
+    if (object_info(hex, type, &size)) {
+        fprintf(stderr, "Missing object %s\n", hex);
+        return 1;
+    }
+
+    if (!strcmp(type, "tree")) {
+        memcpy(tree, oid, hash_algo()->rawsz);
+        return 0;
+    }
+    if (strcmp(type, "commit") != 0) {
+        fprintf(stderr, "%s is a %s, not a tree or commit\n", name, type);
+        return 1;
+    }
+
+    struct commit_info info;
+    if (read_commit_info(oid, &info))
+        return 1;
+    memcpy(tree, info.tree, hash_algo()->rawsz);
+    clear_commit_info(&info);
+
+    return 0;
+}
+
+void init_revisions(struct rev_info *revs) {
+    memset(revs, 0, sizeof(*revs));
+    prio_queue_init(&revs->queue, compare_commits);
+    revs->max_count = -1;
+}
+
+static int add_tip(struct rev_info *revs, const char *name, unsigned flags) {
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    if (get_commit_oid(name, sha1))
+        return 1;
+
+    struct commit *commit = lookup_commit(sha1);
+    if (parse_commit(commit))
+        return 1;
+
+    commit->flags |= flags;
+    if (flags & UNINTERESTING)
+        revs->limited = 1;
+
+    revs->tips =
+        realloc(revs->tips, (revs->num_tips + 1) * sizeof(*revs->tips));
+    revs->tips[revs->num_tips++] = commit;
+
+    return 0;
+}
+
+// Takes <rev>, ^<rev> to exclude its history, or <a>..<b> for what is in b
+// but not in a, where a missing side means HEAD
+int add_revision(struct rev_info *revs, const char *arg) {
+    const char *dots = strstr(arg, "..");
+    if (!dots) {
+        if (arg[0] == '^')
+            return add_tip(revs, arg + 1, UNINTERESTING);
+        return add_tip(revs, arg, 0);
+    }
+
+    char *left = strndup(arg, dots - arg);
+    const char *right = dots + 2;
+    int ret = add_tip(revs, *left ? left : "HEAD", UNINTERESTING) ||
+              add_tip(revs, *right ? right : "HEAD", 0);
+    free(left);
+
+    return ret;
+}
+
+static int queue_commit(struct rev_info *revs, struct commit *commit) {
+    if (commit->flags & SEEN)
+        return 0;
+    if (parse_commit(commit) || (revs->limited && compute_generation(commit)))
+        return 1;
+
+    commit->flags |= SEEN | QUEUED;
+    if (!(commit->flags & UNINTERESTING))
+        revs->interesting++;
+    prio_queue_put(&revs->queue, commit);
+
+    return 0;
+}
+
+int prepare_revision_walk(struct rev_info *revs) {
+    for (size_t i = 0; i < revs->num_tips; i++)
+        if (queue_commit(revs, revs->tips[i]))
+            return 1;
+
+    return 0;
+}
+
+// Returns the next commit to show, or NULL at the end of the walk or on
+// error in which case revs->error is set. Commits come out in generation
+// order, so by the time one is popped every descendant has been, and with
+// it every chance of it being excluded. A limited walk ends as soon as only
+// excluded commits are left and no further history is read.
+struct commit *get_revision(struct rev_info *revs) {
+    struct commit *commit;
+    while ((revs->max_count < 0 || revs->count < revs->max_count) &&
+           (!revs->limited || revs->interesting) &&
+           (commit = prio_queue_get(&revs->queue))) {
+        commit->flags &= ~QUEUED;
+        int uninteresting = commit->flags & UNINTERESTING;
+        if (!uninteresting)
+            revs->interesting--;
+
+        for (int i = 0; i < commit->num_parents; i++) {
+            struct commit *parent = commit->parents[i];
+            if (uninteresting && !(parent->flags & UNINTERESTING)) {
+                parent->flags |= UNINTERESTING;
+                if (parent->flags & QUEUED)
+                    revs->interesting--;
+            }
+            if (queue_commit(revs, parent)) {
+                revs->error = 1;
+                return NULL;
+            }
+        }
+
+        if (!uninteresting) {
+            revs->count++;
+            return commit;
+        }
+    }
+
+    return NULL;
+}
+
+void release_revisions(struct rev_info *revs) {
+    clear_prio_queue(&revs->queue);
+    free(revs->tips);
+    clear_commit_flags(SEEN | QUEUED | UNINTERESTING);
+}
+
+// Walks down from commit, never below the generation of ancestor since no
+// commit there can reach it. Returns 1 if ancestor is reachable from commit,
+// 0 if not and -1 on error.
+int is_ancestor(struct commit *ancestor, struct commit *commit) {
+    if (compute_generation(ancestor) || compute_generation(commit))
+        return -1;
+
+    struct prio_queue queue;
+    prio_queue_init(&queue, compare_commits);
+    commit->flags |= ANCESTOR_SEEN;
+    prio_queue_put(&queue, commit);
+
+    int ret = 0;
+    struct commit *c;
+    while (!ret && (c = prio_queue_get(&queue))) {
+        if (c == ancestor) {
+            ret = 1;
+            break;
+        }
+
+        for (int i = 0; i < c->num_parents; i++) {
+            struct commit *parent = c->parents[i];
+            if (parent->flags & ANCESTOR_SEEN)
+                continue;
+            if (compute_generation(parent)) {
+                ret = -1;
+                break;
+            }
+            parent->flags |= ANCESTOR_SEEN;
+            if (parent->generation >= ancestor->generation)
+                prio_queue_put(&queue, parent);
+        }
+    }
+
+    clear_prio_queue(&queue);
+    clear_commit_flags(ANCESTOR_SEEN);
+
+    return ret;
+}
+
+static int queue_has_nonstale(struct prio_queue *queue) {
+    for (size_t i = 0; i < queue->nr; i++) {
+        struct commit *commit = queue->array[i].data;
+        if (!(commit->flags & STALE))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Paints the history of one and two until only commits reachable from a
+// common ancestor found already are left, those are the candidates
+static int paint_down_to_common(struct commit *one, struct commit *two,
+                                struct commit ***result, int *num_result) {
+    struct prio_queue queue;
+    prio_queue_init(&queue, compare_commits);
+    one->flags |= PARENT1;
+    two->flags |= PARENT2;
+    prio_queue_put(&queue, one);
+    prio_queue_put(&queue, two);
+
+    int ret = 0;
+    while (!ret && queue_has_nonstale(&queue)) {
+        struct commit *commit = prio_queue_get(&queue);
+        unsigned flags = commit->flags & (PARENT1 | PARENT2 | STALE);
+        if (flags == (PARENT1 | PARENT2)) {
+            if (!(commit->flags & RESULT)) {
+                commit->flags |= RESULT;
+                *result = realloc(*result,
+                                  (*num_result + 1) * sizeof(**result));
+                (*result)[(*num_result)++] = commit;
+            }
+            flags |= STALE;
+        }
+
+        for (int i = 0; i < commit->num_parents; i++) {
+            struct commit *parent = commit->parents[i];
+            if ((parent->flags & flags) == flags)
+                continue;
+            if (compute_generation(parent)) {
+                ret = 1;
+                break;
+            }
+            parent->flags |= flags;
+            prio_queue_put(&queue, parent);
+        }
+    }
+
+    clear_prio_queue(&queue);
+    clear_commit_flags(PARENT1 | PARENT2 | STALE | RESULT);
+
+    return ret;
+}
+
+// Finds the best common ancestors of one and two, dropping candidates that
+// are ancestors of other candidates. Returns their number or -1 on error.
+int get_merge_bases(struct commit *one, struct commit *two,
+                    struct commit ***bases) {
+    *bases = NULL;
+    if (compute_generation(one) || compute_generation(two))
+        return -1;
+
+    int num = 0;
+    if (paint_down_to_common(one, two, bases, &num)) {
+        free(*bases);
+        *bases = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < num; i++) {
+        for (int j = 0; j < num; j++) {
+            if (i == j || !(*bases)[j])
+                continue;
+            int ret = is_ancestor((*bases)[i], (*bases)[j]);
+            if (ret < 0)
+                return -1;
+            if (ret) {
+                (*bases)[i] = NULL;
+                break;
+            }
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < num; i++)
+        if ((*bases)[i])
+            (*bases)[kept++] = (*bases)[i];
+
+    return kept;
+}
+
+int rev_list(int argc, char **argv) {
+    struct option rev_list_options[] = {
+        {"max-count", required_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0},
+    };
+
+    struct rev_info revs;
+    init_revisions(&revs);
+
+    int bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "n:", rev_list_options, NULL)) !=
+           -1) {
+        if (c == 'n')
+            revs.max_count = atoi(optarg);
+        else
+            bad_usage = 1;
+    }
+
+    char **args;
+    int num_args = command_operands(argc, argv, &args);
+    if (bad_usage || num_args < 1) {
+        fprintf(stderr, "Usage: %s rev-list [-n <n>] <rev>...\n", argv[0]);
+        release_revisions(&revs);
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i = 0; !ret && i < num_args; i++)
+        ret = add_revision(&revs, args[i]);
+    if (!ret)
+        ret = prepare_revision_walk(&revs);
+
+    struct commit *commit;
+    char hex[GIT_MAX_HEXSZ + 1];
+    while (!ret && (commit = get_revision(&revs))) {
+        sha1_to_hex(commit->oid, hex);
+        puts(hex);
+    }
+    ret |= revs.error;
+
+    release_revisions(&revs);
+
+    return ret;
+}
+
+// merge-base [--all] <a> <b> prints the best common ancestor, or all of
+// them, merge-base --is-ancestor <a> <b> exits with 0 if a is an ancestor
+// of b and 1 if not
+int merge_base(int argc, char **argv) {
+    struct option merge_base_options[] = {
+        {"all", no_argument, NULL, 'a'},
+        {"is-ancestor", no_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int all = 0, ancestor = 0, bad_usage = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "a", merge_base_options, NULL)) !=
+           -1) {
+        if (c == 'a')
+            all = 1;
+        else if (c == 'i')
+            ancestor = 1;
+        else
+            bad_usage = 1;
+    }
+
+    char **args;
+    if (bad_usage || command_operands(argc, argv, &args) != 2 ||
+        (all && ancestor)) {
+        fprintf(stderr, "Usage: %s merge-base [--all] <a> <b>\n", argv[0]);
+        fprintf(stderr, "       %s merge-base --is-ancestor <a> <b>\n",
+                argv[0]);
+        return 1;
+    }
+
+    unsigned char one[GIT_MAX_RAWSZ], two[GIT_MAX_RAWSZ];
+    if (get_commit_oid(args[0], one) || get_commit_oid(args[1], two))
+        return 1;
+
+    if (ancestor) {
+        int ret = is_ancestor(lookup_commit(one), lookup_commit(two));
+        return ret < 0 ? 128 : !ret;
+    }
+
+    struct commit **bases;
+    int num = get_merge_bases(lookup_commit(one), lookup_commit(two), &bases);
+    if (num < 0)
+        return 1;
+
+    char hex[GIT_MAX_HEXSZ + 1];
+    for (int i = 0; i < (all ? num : (num > 0)); i++) {
+        sha1_to_hex(bases[i]->oid, hex);
+        puts(hex);
+    }
+    free(bases);
+
+    return num == 0;
+}
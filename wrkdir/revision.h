@@ -0,0 +1,80 @@
+#ifndef REVISION_H
+#define REVISION_H
+
+#include <stdint.h>
+
+#include "hash.h"
+#include "prio-queue.h"
+
+// Generation of commits that are not in the commit-graph and have not had
+// one computed, they are treated as newer than everything in the graph
+#define GENERATION_NUMBER_INFINITY 0xFFFFFFFF
+#define GRAPH_POS_UNKNOWN 0xFFFFFFFF
+
+#define SEEN (1u << 0)
+#define QUEUED (1u << 1)
+#define UNINTERESTING (1u << 2)
+#define PARENT1 (1u << 3)
+#define PARENT2 (1u << 4)
+#define STALE (1u << 5)
+#define RESULT (1u << 6)
+#define ANCESTOR_SEEN (1u << 7)
+
+// A commit as far as history walks are concerned. Parents, generation and
+// date come from the commit-graph when the commit is in it, the object is
+// only read for commits that are not.
+struct commit {
+    unsigned char oid[GIT_MAX_RAWSZ];
+    unsigned flags;
+    int parsed;
+    uint32_t graph_pos;
+    uint32_t generation;
+    int64_t date;
+    struct commit **parents;
+    int num_parents;
+};
+
+struct rev_info {
+    struct prio_queue queue;
+    struct commit **tips;
+    size_t num_tips;
+    int max_count;
+    int count;
+
+    // Set once a tip is excluded, the walk then needs exact generations and
+    // ends when no interesting commit is left in the queue
+    int limited;
+    size_t interesting;
+    int error;
+};
+
+struct commit *lookup_commit(const unsigned char *oid);
+
+int parse_commit(struct commit *commit);
+
+int resolve_revision(const char *name, unsigned char *sha1);
+
+int get_commit_oid(const char *name, unsigned char *sha1);
+
+int get_tree_oid(const char *name, unsigned char *oid, unsigned char *tree);
+
+void init_revisions(struct rev_info *revs);
+
+int add_revision(struct rev_info *revs, const char *arg);
+
+int prepare_revision_walk(struct rev_info *revs);
+
+struct commit *get_revision(struct rev_info *revs);
+
+void release_revisions(struct rev_info *revs);
+
+int is_ancestor(struct commit *ancestor, struct commit *commit);
+
+int get_merge_bases(struct commit *one, struct commit *two,
+                    struct commit ***bases);
+
+int rev_list(int argc, char **argv);
+
+int merge_base(int argc, char **argv);
+
+#endif
@@ -0,0 +1,740 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blob.h"
+#include "commit.h"
+#include "diff-tree.h"
+#include "fsmonitor.h"
+#include "ignore.h"
+#include "index.h"
+#include "object.h"
+#include "revision.h"
+#include "status.h"
+#include "thread-pool.h"
+#include "tree.h"
+#include "untracked-cache.h"
+
+// Directories changed after the scan started are not trusted from the cache,
+// the coarse clock is enough as it lags behind file timestamps if anything
+#ifdef CLOCK_REALTIME_COARSE
+#define SCAN_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define SCAN_CLOCK CLOCK_REALTIME
+#endif
+
+struct scan_dir;
+
+// has_stat is clear when only the type is known, from readdir() or from the
+// index, and the file is stat'ed later if its entry needs it. untracked is
+// set once the merge with the index found no entry for the file.
+struct scan_entry {
+    char *name;
+    size_t name_len;
+    struct stat st;
+    int has_stat;
+    int untracked;
+    struct scan_dir *dir;
+};
+
+// One directory of the working tree. Its handle stays open until every
+// subdirectory has been opened relative to it, so no path is ever resolved
+// from the root again. tracked is clear for directories without any index
+// entry below them, those are only reported as a whole. ignored ones are
+// only looked into for their tracked files.
+//
+// cache is what the untracked cache holds for the directory. When it is
+// reused its entries come from there and from the index instead of
+// readdir(). rules_changed is set below an ignore file that changed.
+struct scan_dir {
+    struct scan_dir *parent;
+    const char *name;
+    char *path;
+    size_t path_len;
+    DIR *handle;
+    int refs;
+    int tracked;
+    int ignored;
+    int error;
+    struct untracked_dir *cache;
+    struct untracked_stat stat;
+    struct untracked_stat ignore_stat;
+    int reused;
+    int rules_changed;
+    struct scan_entry *entries;
+    size_t num_entries;
+    size_t alloc_entries;
+};
+
+struct status_item {
+    char *path;
+    char x;
+    char y;
+};
+
+struct item_list {
+    struct status_item *items;
+    size_t num;
+    size_t alloc;
+};
+
+struct hash_job {
+    struct git_index_entry *entry;
+    struct stat st;
+    char *path;
+    unsigned char sha1[GIT_MAX_RAWSZ];
+    int failed;
+};
+
+// use_fsmonitor is set while the index holds a token fsmonitor answered,
+// cache_changed once the untracked cache differs from the one read
+struct status_state {
+    struct git_index index;
+    struct ignore_tree *ignores;
+    int use_cache;
+    int use_fsmonitor;
+    struct timespec scan_start;
+    int cache_changed;
+    struct item_list staged;
+    struct item_list changed;
+    struct item_list untracked;
+};
+
+static void add_item(struct item_list *list, char *path, char x, char y) {
+    if (list->num == list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 64;
+        list->items = realloc(list->items, list->alloc * sizeof(*list->items));
+    }
+    list->items[list->num].path = path;
+    list->items[list->num].x = x;
+    list->items[list->num++].y = y;
+}
+
+static char *join_path(const char *base, size_t base_len, const char *name,
+                       size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    char *path = malloc(base_len + len + suffix_len + 1);
+    memcpy(path, base, base_len);
+    memcpy(path + base_len, name, len);
+    memcpy(path + base_len + len, suffix, suffix_len + 1);
+
+    return path;
+}
+
+static int compare_scan_entries(const void *a, const void *b) {
+    const struct scan_entry *x = a, *y = b;
+    return compare_tree_names(x->name, x->name_len, x->dir != NULL, y->name,
+                              y->name_len, y->dir != NULL);
+}
+
+static void release_scan_dir(struct scan_dir *dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0 &&
+        dir->handle) {
+        closedir(dir->handle);
+        dir->handle = NULL;
+    }
+}
+
+static struct scan_entry *add_scan_entry(struct scan_dir *dir,
+                                         const char *name, size_t len,
+                                         int is_dir) {
+    if (dir->num_entries == dir->alloc_entries) {
+        dir->alloc_entries = dir->alloc_entries ? dir->alloc_entries * 2 : 16;
+        dir->entries =
+            realloc(dir->entries, dir->alloc_entries * sizeof(*dir->entries));
+    }
+    struct scan_entry *entry = &dir->entries[dir->num_entries++];
+    entry->name_len = len;
+    entry->name = malloc(len + 1);
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->dir = is_dir ? calloc(1, sizeof(struct scan_dir)) : NULL;
+    entry->has_stat = 0;
+    entry->untracked = 0;
+
+    return entry;
+}
+
+static void stat_ignore_file(struct scan_dir *dir) {
+    char path[PATH_MAX];
+    struct stat st;
+    memset(&dir->ignore_stat, 0, sizeof(dir->ignore_stat));
+    if ((size_t)snprintf(path, sizeof(path), "%s%s", dir->path, IGNORE_FILE) <
+            sizeof(path) &&
+        lstat(path, &st) == 0)
+        fill_untracked_stat(&dir->ignore_stat, &st);
+}
+
+// Whether the listing the untracked cache holds for the directory is still
+// what readdir() would give. With fsmonitor vouching for the directory not
+// even its stat data is looked at.
+static int can_reuse_dir(struct status_state *s, struct scan_dir *dir,
+                         int parent_fd, const char *name) {
+    struct untracked_dir *cache = dir->cache;
+    if (!cache || dir->rules_changed || !(cache->flags & UNTRACKED_VALID))
+        return 0;
+
+    if (s->use_fsmonitor && (cache->flags & UNTRACKED_FSMONITOR_VALID)) {
+        dir->stat = cache->stat;
+        dir->ignore_stat = cache->ignore_stat;
+        return 1;
+    }
+
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISDIR(st.st_mode))
+        return 0;
+    fill_untracked_stat(&dir->stat, &st);
+    stat_ignore_file(dir);
+    if (!untracked_stat_equal(&dir->ignore_stat, &cache->ignore_stat)) {
+        dir->rules_changed = 1;
+        return 0;
+    }
+    if (!untracked_stat_equal(&dir->stat, &cache->stat))
+        return 0;
+
+    if (s->use_fsmonitor)
+        __atomic_store_n(&s->cache_changed, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Lists a directory that did not change from its cached untracked files and
+// subdirectories, and the index entries directly in it. Those are stat'ed
+// here unless fsmonitor vouches for them, and dropped if they are gone.
+static void reuse_scan_dir(struct status_state *s, struct scan_dir *dir) {
+    struct git_index *index = &s->index;
+    struct untracked_dir *cache = dir->cache;
+    dir->reused = 1;
+
+    for (size_t i = 0; i < cache->num_files; i++) {
+        struct scan_entry *entry = add_scan_entry(
+            dir, cache->files[i], strlen(cache->files[i]), 0);
+        entry->st.st_mode = S_IFREG;
+    }
+    for (size_t i = 0; i < cache->num_dirs; i++) {
+        struct untracked_dir *sub = cache->dirs[i];
+        struct scan_entry *entry =
+            add_scan_entry(dir, sub->name, strlen(sub->name), 1);
+        entry->dir->cache = sub;
+        entry->dir->ignored = (sub->flags & UNTRACKED_IGNORED) != 0;
+    }
+
+    if (!dir->tracked)
+        return;
+
+    int pos = index_pos(index, dir->path);
+    size_t i = pos < 0 ? (size_t)(-pos - 1) : (size_t)pos;
+    while (i < index->header.entries) {
+        struct git_index_entry *ie = &index->entries[i];
+        char *path = index_entry_path(index, ie);
+        if (strncmp(path, dir->path, dir->path_len) != 0)
+            break;
+
+        char *name = path + dir->path_len, *slash = strchr(name, '/');
+        if (slash) {
+            // Skip the subdirectory, "sub0" sorts right after "sub/..."
+            char *key = strndup(path, slash - path + 1);
+            key[slash - path] = '/' + 1;
+            pos = index_pos(index, key);
+            i = pos < 0 ? (size_t)(-pos - 1) : (size_t)pos;
+            free(key);
+            continue;
+        }
+
+        struct scan_entry *entry = add_scan_entry(dir, name, strlen(name), 0);
+        entry->st.st_mode = ie->mode == 120000 ? S_IFLNK : S_IFREG;
+        if (!ie->fsmonitor_valid) {
+            if (lstat(path, &entry->st) == 0) {
+                entry->has_stat = 1;
+            } else {
+                free(entry->name);
+                dir->num_entries--;
+            }
+        }
+        i++;
+    }
+}
+
+// Lists a directory with readdir(), stat'ing what d_type does not settle
+// with fstatat() relative to its handle. Ignored entries are dropped unless
+// they are tracked, or hold tracked files in the case of a directory.
+static void read_scan_dir(struct status_state *s, struct scan_dir *dir,
+                          int fd) {
+    struct git_index *index = &s->index;
+    struct ignore_dir *rules =
+        get_ignore_dir(s->ignores, dir->path, dir->path_len);
+    char path[PATH_MAX];
+    memcpy(path, dir->path, dir->path_len);
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir->handle)) != NULL) {
+        const char *name = dirent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") ||
+            (!dir->parent && !strcmp(name, ".gblimi")))
+            continue;
+
+        struct stat st;
+        int is_dir = dirent->d_type == DT_DIR, has_stat = 0;
+        if (s->use_fsmonitor &&
+            (dirent->d_type == DT_REG || dirent->d_type == DT_LNK)) {
+            st.st_mode = dirent->d_type == DT_REG ? S_IFREG : S_IFLNK;
+        } else if (!is_dir) {
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+            if (!is_dir && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+                continue;
+            has_stat = 1;
+        }
+
+        // A directory needs room for its trailing '/' as well
+        size_t name_len = strlen(name), len = dir->path_len + name_len;
+        if (len + 1 + is_dir > sizeof(path))
+            continue;
+        memcpy(path + dir->path_len, name, name_len + 1);
+
+        int ignored = dir->ignored;
+        if (!ignored) {
+            const struct ignore_rule *rule =
+                match_ignore_dir(rules, path, len, is_dir);
+            ignored = rule && !rule->negated;
+        }
+        if (ignored) {
+            if (!dir->tracked)
+                continue;
+            if (is_dir) {
+                path[len] = '/';
+                path[len + 1] = '\0';
+                if (!index_has_dir(index, path, len + 1))
+                    continue;
+            } else if (index_pos(index, path) < 0) {
+                continue;
+            }
+        }
+
+        struct scan_entry *entry = add_scan_entry(dir, name, name_len, is_dir);
+        entry->has_stat = has_stat;
+        if (is_dir)
+            entry->dir->ignored = ignored;
+        else
+            entry->st = st;
+    }
+}
+
+// Lists one directory, from the untracked cache when it is still valid and
+// with readdir() otherwise, then queues its subdirectories. Those open
+// themselves with openat() relative to its handle, or by path below a
+// directory that was not opened. With fsmonitor running, files are not
+// stat'ed when readdir() gives their type.
+static void scan_dir_job(void *item, struct steal_worker *worker,
+                         void *data) {
+    struct scan_dir *dir = item;
+    struct status_state *s = data;
+    struct git_index *index = &s->index;
+
+    struct scan_dir *parent = dir->parent;
+    int parent_fd = parent && parent->handle ? dirfd(parent->handle)
+                                             : AT_FDCWD;
+    const char *name = !parent          ? "."
+                       : parent->handle ? dir->name
+                                        : dir->path;
+
+    if (can_reuse_dir(s, dir, parent_fd, name)) {
+        if (parent)
+            release_scan_dir(parent);
+        reuse_scan_dir(s, dir);
+    } else {
+        int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (parent)
+            release_scan_dir(parent);
+        if (fd < 0 || !(dir->handle = fdopendir(fd))) {
+            dir->error = errno;
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        if (s->use_cache) {
+            struct stat st;
+            if (fstat(fd, &st) == 0)
+                fill_untracked_stat(&dir->stat, &st);
+            stat_ignore_file(dir);
+            if (dir->cache && !untracked_stat_equal(&dir->ignore_stat,
+                                                    &dir->cache->ignore_stat))
+                dir->rules_changed = 1;
+            __atomic_store_n(&s->cache_changed, 1, __ATOMIC_RELAXED);
+        }
+        read_scan_dir(s, dir, fd);
+    }
+
+    qsort(dir->entries, dir->num_entries, sizeof(*dir->entries),
+          compare_scan_entries);
+
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        struct scan_dir *child = dir->entries[i].dir;
+        if (!child)
+            continue;
+
+        child->parent = dir;
+        child->name = dir->entries[i].name;
+        child->path = join_path(dir->path, dir->path_len, child->name,
+                                dir->entries[i].name_len, "/");
+        child->path_len = dir->path_len + dir->entries[i].name_len + 1;
+        child->tracked =
+            dir->tracked && index_has_dir(index, child->path, child->path_len);
+        child->rules_changed = dir->rules_changed;
+        if (!dir->reused)
+            child->cache = untracked_dir_find(dir->cache, child->name,
+                                              dir->entries[i].name_len);
+        child->refs = 1;
+
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL);
+        steal_pool_push(worker, child);
+    }
+
+    release_scan_dir(dir);
+}
+
+static void free_scan_dir(struct scan_dir *dir) {
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        if (dir->entries[i].dir)
+            free_scan_dir(dir->entries[i].dir);
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+    free(dir->path);
+    free(dir);
+}
+
+static int has_files(struct scan_dir *dir) {
+    for (size_t i = 0; i < dir->num_entries; i++)
+        if (!dir->entries[i].dir || has_files(dir->entries[i].dir))
+            return 1;
+
+    return 0;
+}
+
+struct wt_file {
+    char *path;
+    struct scan_entry *entry;
+};
+
+struct wt_list {
+    struct wt_file *files;
+    size_t num;
+    size_t alloc;
+};
+
+// Flattens the scanned tree into index order. Untracked directories are
+// reported as one item when they contain any file and are not listed.
+static void collect_files(struct scan_dir *dir, struct wt_list *list,
+                          struct item_list *untracked) {
+    if (dir->error)
+        fprintf(stderr, "Unable to read %s: %s\n",
+                dir->path_len ? dir->path : ".", strerror(dir->error));
+
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        struct scan_entry *entry = &dir->entries[i];
+        if (entry->dir) {
+            if (entry->dir->tracked)
+                collect_files(entry->dir, list, untracked);
+            else if (has_files(entry->dir))
+                add_item(untracked, strdup(entry->dir->path), '?', '?');
+            continue;
+        }
+
+        if (list->num == list->alloc) {
+            list->alloc = list->alloc ? list->alloc * 2 : 1024;
+            list->files =
+                realloc(list->files, list->alloc * sizeof(*list->files));
+        }
+        list->files[list->num].path = join_path(
+            dir->path, dir->path_len, entry->name, entry->name_len, "");
+        list->files[list->num++].entry = entry;
+    }
+}
+
+static void hash_file_job(size_t i, void *data) {
+    struct hash_job *job = &((struct hash_job *)data)[i];
+    if (!S_ISLNK(job->st.st_mode)) {
+        job->failed = blob_and_hash_file(job->path, job->sha1);
+        return;
+    }
+
+    // A symlink's blob is its target, not what it points to
+    char target[PATH_MAX];
+    ssize_t len = readlink(job->path, target, sizeof(target));
+    job->failed = len < 0;
+    if (!job->failed)
+        hash_object_data("blob", target, len, job->sha1);
+}
+
+// Merges the working tree with the sorted index. Only files whose stat data
+// disagrees with their entry are hashed, on the worker pool, and those that
+// turn out unchanged get fresh stat data. Entries fsmonitor vouches for are
+// skipped outright. Returns 1 if the index should be written back for that.
+static int diff_worktree(struct status_state *s, struct wt_list *files) {
+    struct git_index *index = &s->index;
+    size_t num_entries = index->header.entries;
+    struct hash_job *jobs = malloc((num_entries + 1) * sizeof(*jobs));
+    size_t num_jobs = 0, i = 0, j = 0;
+    int refreshed = 0;
+
+    while (i < num_entries || j < files->num) {
+        struct git_index_entry *entry = &index->entries[i];
+        int cmp = i == num_entries ? 1
+                  : j == files->num
+                      ? -1
+                      : strcmp(index_entry_path(index, entry),
+                               files->files[j].path);
+        if (cmp < 0) {
+            add_item(&s->changed, strdup(index_entry_path(index, entry)), ' ',
+                     'D');
+            entry->fsmonitor_valid = 0;
+            i++;
+        } else if (cmp > 0) {
+            add_item(&s->untracked, files->files[j].path, '?', '?');
+            files->files[j].entry->untracked = 1;
+            files->files[j++].path = NULL;
+        } else if (entry->fsmonitor_valid) {
+            i++;
+            j++;
+        } else {
+            struct scan_entry *file = files->files[j].entry;
+            char *path = files->files[j].path;
+            if (!file->has_stat && lstat(path, &file->st) != 0) {
+                add_item(&s->changed, strdup(path), ' ', 'D');
+            } else if (index_mode(&file->st) != entry->mode) {
+                add_item(&s->changed, strdup(path), ' ', 'T');
+            } else if (entry_stat_changed(&index->header, entry, &file->st)) {
+                jobs[num_jobs].entry = entry;
+                jobs[num_jobs].st = file->st;
+                jobs[num_jobs++].path = path;
+            } else if (index->fsmonitor_token) {
+                entry->fsmonitor_valid = 1;
+                refreshed = 1;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    run_parallel(num_jobs, hash_file_job, jobs);
+
+    for (size_t k = 0; k < num_jobs; k++) {
+        struct hash_job *job = &jobs[k];
+        if (job->failed ||
+            memcmp(job->sha1, job->entry->sha1, hash_algo()->rawsz)) {
+            add_item(&s->changed, strdup(job->path), ' ', 'M');
+        } else {
+            fill_index_stat(job->entry, &job->st);
+            job->entry->fsmonitor_valid = 1;
+            refreshed = 1;
+        }
+    }
+    free(jobs);
+
+    return refreshed;
+}
+
+static int add_staged_change(const struct tree_change *change, void *data) {
+    struct status_state *s = data;
+    char x = !change->new_mode ? 'D' : !change->old_mode ? 'A' : 'M';
+    add_item(&s->staged, strdup(change->path), x, ' ');
+
+    return 0;
+}
+
+static int diff_head(struct status_state *s) {
+    unsigned char head[GIT_MAX_RAWSZ];
+    struct commit_info info;
+    if (resolve_revision("HEAD", head))
+        return diff_tree_index(NULL, &s->index, add_staged_change, s);
+
+    if (read_commit_info(head, &info))
+        return 1;
+    clear_commit_info(&info);
+
+    return diff_tree_index(info.tree, &s->index, add_staged_change, s);
+}
+
+static int compare_untracked_dirs(const void *a, const void *b) {
+    return strcmp((*(struct untracked_dir *const *)a)->name,
+                  (*(struct untracked_dir *const *)b)->name);
+}
+
+static int is_racy(struct status_state *s, const struct untracked_stat *ust) {
+    uint32_t sec = (uint32_t)s->scan_start.tv_sec;
+    return ust->mtime_sec > sec ||
+           (ust->mtime_sec == sec &&
+            ust->mtime_nsec >= (uint32_t)s->scan_start.tv_nsec);
+}
+
+// Records what the scan found in a directory for the next status. One that
+// changed within the timestamp granularity of the scan may change again
+// without its mtime moving, so it is not marked valid and is read again.
+static struct untracked_dir *build_untracked_dir(struct status_state *s,
+                                                 struct scan_dir *dir,
+                                                 const char *name,
+                                                 size_t len) {
+    if (dir->error)
+        return NULL;
+
+    struct untracked_dir *cache = untracked_dir_new(name, len);
+    cache->stat = dir->stat;
+    cache->ignore_stat = dir->ignore_stat;
+    if (dir->reused)
+        cache->flags = dir->cache->flags & UNTRACKED_VALID;
+    else if (!is_racy(s, &dir->stat) && !is_racy(s, &dir->ignore_stat))
+        cache->flags = UNTRACKED_VALID;
+    if (s->use_fsmonitor)
+        cache->flags |= UNTRACKED_FSMONITOR_VALID;
+    if (dir->ignored)
+        cache->flags |= UNTRACKED_IGNORED;
+
+    cache->files = malloc((dir->num_entries + 1) * sizeof(*cache->files));
+    cache->dirs = malloc((dir->num_entries + 1) * sizeof(*cache->dirs));
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        struct scan_entry *entry = &dir->entries[i];
+        if (entry->dir) {
+            struct untracked_dir *sub = build_untracked_dir(
+                s, entry->dir, entry->name, entry->name_len);
+            if (sub)
+                cache->dirs[cache->num_dirs++] = sub;
+        } else if (!dir->tracked || entry->untracked) {
+            cache->files[cache->num_files++] = strdup(entry->name);
+        }
+    }
+    qsort(cache->dirs, cache->num_dirs, sizeof(*cache->dirs),
+          compare_untracked_dirs);
+
+    return cache;
+}
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const struct status_item *)a)->path,
+                  ((const struct status_item *)b)->path);
+}
+
+static void print_items(struct item_list *staged, struct item_list *changed,
+                        struct item_list *untracked) {
+    size_t i = 0, j = 0;
+    while (i < staged->num || j < changed->num) {
+        int cmp = i == staged->num   ? 1
+                  : j == changed->num ? -1
+                                      : strcmp(staged->items[i].path,
+                                               changed->items[j].path);
+        if (cmp < 0) {
+            printf("%c  %s\n", staged->items[i].x, staged->items[i].path);
+            i++;
+        } else if (cmp > 0) {
+            printf(" %c %s\n", changed->items[j].y, changed->items[j].path);
+            j++;
+        } else {
+            printf("%c%c %s\n", staged->items[i].x, changed->items[j].y,
+                   staged->items[i].path);
+            i++;
+            j++;
+        }
+    }
+
+    for (i = 0; i < untracked->num; i++)
+        printf("?? %s\n", untracked->items[i].path);
+}
+
+static void clear_items(struct item_list *list) {
+    for (size_t i = 0; i < list->num; i++)
+        free(list->items[i].path);
+    free(list->items);
+}
+
+// Prints changes in the short format: the first column compares the index
+// with HEAD, the second the working tree with the index, and untracked
+// files and directories come last as "??"
+int status(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s status\n", argv[0]);
+        return 1;
+    }
+
+    struct status_state s;
+    memset(&s, 0, sizeof(s));
+    if (read_index(&s.index) == 1)
+        return 1;
+    sort_entries(&s.index);
+    refresh_fsmonitor(&s.index);
+    s.use_fsmonitor = s.index.fsmonitor_token != NULL;
+    s.use_cache = untracked_cache_enabled();
+    s.ignores = ignore_tree_new();
+    clock_gettime(SCAN_CLOCK, &s.scan_start);
+
+    // The exclude file applies everywhere, so the cache is only good while
+    // it is unchanged
+    struct untracked_stat exclude_stat;
+    struct stat st;
+    memset(&exclude_stat, 0, sizeof(exclude_stat));
+    if (lstat(EXCLUDE_FILE, &st) == 0)
+        fill_untracked_stat(&exclude_stat, &st);
+    struct untracked_cache *uc = s.index.untracked;
+    if (uc && (!s.use_cache ||
+               !untracked_stat_equal(&uc->exclude_stat, &exclude_stat))) {
+        untracked_cache_free(uc);
+        s.index.untracked = uc = NULL;
+        s.cache_changed = 1;
+    }
+
+    struct scan_dir *root = calloc(1, sizeof(struct scan_dir));
+    root->path = strdup("");
+    root->tracked = 1;
+    root->refs = 1;
+    root->cache = uc ? uc->root : NULL;
+    void *items[] = {root};
+    run_work_stealing(items, 1, scan_dir_job, &s);
+
+    struct wt_list files = {NULL, 0, 0};
+    collect_files(root, &files, &s.untracked);
+
+    int ret = diff_head(&s);
+    int refreshed = diff_worktree(&s, &files);
+    qsort(s.changed.items, s.changed.num, sizeof(*s.changed.items),
+          compare_items);
+    qsort(s.untracked.items, s.untracked.num, sizeof(*s.untracked.items),
+          compare_items);
+
+    if (!ret)
+        print_items(&s.staged, &s.changed, &s.untracked);
+
+    if (s.use_cache) {
+        uc = calloc(1, sizeof(*uc));
+        uc->exclude_stat = exclude_stat;
+        uc->root = build_untracked_dir(&s, root, "", 0);
+        untracked_cache_free(s.index.untracked);
+        s.index.untracked = uc;
+    }
+
+    // Stat data of files found unchanged is saved so the next status does
+    // not hash them again, and so is the fsmonitor token once it cleared
+    // entries and the untracked cache once a directory was read. Losing the
+    // race for the lock is harmless.
+    if (refreshed || s.index.fsmonitor_changed || s.cache_changed)
+        write_index_file(&s.index);
+
+    for (size_t i = 0; i < files.num; i++)
+        free(files.files[i].path);
+    free(files.files);
+    free_scan_dir(root);
+    ignore_tree_free(s.ignores);
+    clear_items(&s.staged);
+    clear_items(&s.changed);
+    clear_items(&s.untracked);
+    discard_index(&s.index);
+
+    return ret;
+}
@@ -0,0 +1,6 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+int status(int argc, char **argv);
+
+#endif
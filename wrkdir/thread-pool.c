@@ -0,0 +1,224 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thread-pool.h"
+
+struct parallel_ctx {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t jobs;
+    void (*job)(size_t i, void *data);
+    void *data;
+};
+
+int online_cpus(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+static void *parallel_worker(void *arg) {
+    struct parallel_ctx *ctx = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        size_t i = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (i >= ctx->jobs)
+            break;
+        ctx->job(i, ctx->data);
+    }
+
+    return NULL;
+}
+
+// Runs job(0..jobs-1) on one thread per core, each worker pulls the next job
+// index as soon as it finishes the last one so uneven jobs balance out
+void run_parallel(size_t jobs, void (*job)(size_t i, void *data), void *data) {
+    struct parallel_ctx ctx = {
+        .next = 0, .jobs = jobs, .job = job, .data = data};
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    size_t num_threads = online_cpus();
+    if (num_threads > jobs)
+        num_threads = jobs;
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    size_t started = 0;
+    while (started + 1 < num_threads &&
+           pthread_create(&threads[started], NULL, parallel_worker, &ctx) == 0)
+        started++;
+
+    // The calling thread works too, so a single core needs no extra threads
+    parallel_worker(&ctx);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&ctx.lock);
+}
+
+// Each worker owns a deque of items, it pushes and pops at the back so it
+// works depth first on what it just produced, idle workers steal the oldest
+// item from the front of someone else's, which tends to be the biggest
+struct steal_deque {
+    pthread_mutex_t lock;
+    void **items;
+    size_t head;
+    size_t tail;
+    size_t alloc;
+};
+
+struct steal_pool {
+    struct steal_worker *workers;
+    size_t num_workers;
+    steal_job_fn job;
+    void *data;
+
+    // Items pushed but not finished, and pushed but not taken yet
+    size_t pending;
+    size_t available;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct steal_worker {
+    struct steal_pool *pool;
+    struct steal_deque deque;
+    size_t id;
+};
+
+void steal_pool_push(struct steal_worker *worker, void *item) {
+    struct steal_pool *pool = worker->pool;
+    struct steal_deque *deque = &worker->deque;
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->alloc) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(void *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->alloc) {
+            deque->alloc = deque->alloc ? deque->alloc * 2 : 64;
+            deque->items =
+                realloc(deque->items, deque->alloc * sizeof(void *));
+        }
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->lock);
+
+    // Wakeups are sent under the pool lock so a worker going to sleep
+    // cannot miss one
+    pthread_mutex_lock(&pool->lock);
+    pool->available++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *take_item(struct steal_deque *deque, int steal) {
+    void *item = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail)
+        item = steal ? deque->items[deque->head++]
+                     : deque->items[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+static void *next_item(struct steal_worker *worker) {
+    struct steal_pool *pool = worker->pool;
+    void *item = take_item(&worker->deque, 0);
+    for (size_t i = 1; !item && i < pool->num_workers; i++)
+        item = take_item(
+            &pool->workers[(worker->id + i) % pool->num_workers].deque, 1);
+
+    if (item) {
+        pthread_mutex_lock(&pool->lock);
+        pool->available--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return item;
+}
+
+static void *steal_worker_main(void *arg) {
+    struct steal_worker *worker = arg;
+    struct steal_pool *pool = worker->pool;
+
+    for (;;) {
+        void *item = next_item(worker);
+        if (item) {
+            pool->job(item, worker, pool->data);
+            if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) ==
+                0) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->available &&
+               __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        int done = !__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+// Runs job on every item, and on every item jobs push while running, on one
+// thread per core. Suits walks like directory scans where work is only
+// discovered as it is done. Returns once everything has been processed.
+void run_work_stealing(void **items, size_t num_items, steal_job_fn job,
+                       void *data) {
+    struct steal_pool pool = {
+        .job = job, .data = data, .pending = 0, .available = 0};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    pool.num_workers = online_cpus();
+    pool.workers = calloc(pool.num_workers, sizeof(struct steal_worker));
+    for (size_t i = 0; i < pool.num_workers; i++) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].id = i;
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+    }
+
+    for (size_t i = 0; i < num_items; i++)
+        steal_pool_push(&pool.workers[i % pool.num_workers], items[i]);
+
+    pthread_t *threads = malloc(pool.num_workers * sizeof(pthread_t));
+    size_t started = 0;
+    while (started + 1 < pool.num_workers &&
+           pthread_create(&threads[started], NULL, steal_worker_main,
+                          &pool.workers[started + 1]) == 0)
+        started++;
+
+    steal_worker_main(&pool.workers[0]);
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < pool.num_workers; i++) {
+        free(pool.workers[i].deque.items);
+        pthread_mutex_destroy(&pool.workers[i].deque.lock);
+    }
+    free(pool.workers);
+    free(threads);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+}
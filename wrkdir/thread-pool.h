@@ -0,0 +1,22 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <unistd.h>
+
+int online_cpus(void);
+
+void run_parallel(size_t jobs, void (*job)(size_t i, void *data), void *data);
+
+struct steal_worker;
+
+typedef void (*steal_job_fn)(void *item, struct steal_worker *worker,
+                             void *data);
+
+void run_work_stealing(void **items, size_t num_items, steal_job_fn job,
+                       void *data);
+
+void steal_pool_push(struct steal_worker *worker, void *item);
+
+#endif
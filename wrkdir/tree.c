@@ -1,124 +1,158 @@
-#include <openssl/sha.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <zlib.h>
 
+#include "cache-tree.h"
+#include "hash.h"
 #include "index.h"
+#include "object.h"
 #include "tree.h"
 
-struct git_tree_entry *prep_tree_entries(struct git_index_header header,
-                                         struct git_index_entry *entries,
-                                         size_t *size) {
-    *size = 0;
-    struct stat file_stat;
-    for (size_t i = 0; i < header.entries; i++)
-        if (stat(entries[i].path, &file_stat) == 0)
-            *size += file_stat.st_size;
-
-    struct git_tree_entry *tree_entries =
-        malloc(header.entries * sizeof(struct git_tree_entry));
-
-    for (size_t i = 0; i < header.entries; i++) {
-        tree_entries[i].mode = entries[i].mode;
-        tree_entries[i].path = entries[i].path;
-        for (int j = 0; j < 20; j++)
-            snprintf(tree_entries[i].sha1 + (j * 2), 3, "%02x",
-                     entries[i].sha1[j]);
+// Serializes the entries, which must be in tree order, into the content of a
+// tree object. Each entry is "<mode> <name>\0" followed by the raw object
+// id, as in git.
+char *create_tree(struct git_tree_entry *tree_entries, size_t num_entries,
+                  size_t *size) {
+    size_t rawsz = hash_algo()->rawsz;
+    size_t content_size = 0;
+    for (size_t i = 0; i < num_entries; i++)
+        content_size += snprintf(NULL, 0, "%u", tree_entries[i].mode) + 1 +
+                        tree_entries[i].path_len + 1 + rawsz;
+
+    char *tree = malloc(content_size + 1);
+
+    size_t offset = 0;
+    for (size_t i = 0; i < num_entries; i++) {
+        offset += sprintf(tree + offset, "%u %.*s", tree_entries[i].mode,
+                          (int)tree_entries[i].path_len,
+                          tree_entries[i].path) +
+                  1;
+        memcpy(tree + offset, tree_entries[i].sha1, rawsz);
+        offset += rawsz;
     }
+    *size = offset;
 
-    return tree_entries;
+    return tree;
 }
 
-char *create_tree(size_t *size, struct git_tree_entry *tree_entries,
-                  struct git_index_header header,
-                  struct git_index_entry *entries) {
-    int header_offset = 4 + 1 + 4 + 1;
-    size_t ucompSize = 0;
-
-    ucompSize += header_offset;
-    for (size_t i = 0; i < header.entries; i++)
-        ucompSize += 4 + 1 + entries[i].flags + 1 + 43;
-
-    char *tree = malloc(ucompSize * sizeof(char));
-    sprintf(tree, "tree %zu%c", *size, '\0');
-
-    size_t entry_size = 0;
-    for (size_t i = 0; i < header.entries; i++) {
-        sprintf(tree + header_offset + (entry_size), "%u %s%c%s",
-                tree_entries[i].mode, tree_entries[i].path, '\0',
-                tree_entries[i].sha1);
-        entry_size += 4 + 1 + entries[i].flags + 1 + 43;
-    }
-    *size = ucompSize;
-
-    return tree;
+void init_tree_desc(struct tree_desc *desc, const void *buf, size_t size) {
+    desc->buf = buf;
+    desc->size = size;
 }
 
-char *create_object_store(char *hash) {
-    char dir[3] = {hash[0], hash[1], '\0'};
-    char *tree_path = malloc(16 + 2 + 1 + strlen(hash + 2) * sizeof(char));
+// Fills entry with the next entry of the tree, pointing into the tree buffer.
+// Returns 1 for an entry, 0 at the end of the tree and -1 if it is corrupt.
+int next_tree_entry(struct tree_desc *desc, struct git_tree_entry *entry) {
+    if (desc->size == 0)
+        return 0;
+
+    const unsigned char *buf = desc->buf, *end = buf + desc->size;
+    uint32_t mode = 0;
+    while (buf < end && *buf >= '0' && *buf <= '9')
+        mode = mode * 10 + (*buf++ - '0');
+    if (buf == desc->buf || buf == end || *buf++ != ' ')
+        return -1;
+
+    size_t rawsz = hash_algo()->rawsz;
+    const unsigned char *nul = memchr(buf, '\0', end - buf);
+    if (!nul || nul == buf || (size_t)(end - (nul + 1)) < rawsz)
+        return -1;
+
+    entry->mode = mode;
+    entry->path = (const char *)buf;
+    entry->path_len = nul - buf;
+    entry->sha1 = nul + 1;
+
+    desc->size -= nul + 1 + rawsz - desc->buf;
+    desc->buf = nul + 1 + rawsz;
+
+    return 1;
+}
 
-    snprintf(tree_path,
-             strlen(".gblimi/objects/") + strlen(dir) + 1 + strlen(hash + 2) +
-                 1,
-             ".gblimi/objects/%s/%s", dir, hash + 2);
+// Compares names in tree order, where a directory sorts as if its name
+// ended with a slash. This is the order of full paths in the index too.
+int compare_tree_names(const char *a, size_t a_len, int a_dir, const char *b,
+                       size_t b_len, int b_dir) {
+    size_t len = a_len < b_len ? a_len : b_len;
+    int cmp = memcmp(a, b, len);
+    if (cmp)
+        return cmp;
+
+    unsigned char ca = a_len > len ? a[len] : a_dir ? '/' : '\0';
+    unsigned char cb = b_len > len ? b[len] : b_dir ? '/' : '\0';
+    return ca - cb;
+}
 
-    tree_path[18] = '\0';
-    mkdir(tree_path, 0777);
-    tree_path[18] = '/';
+// Reads a tree object, NULL with a message when it is missing or is not a
+// tree
+char *read_tree_object(const unsigned char *sha1, size_t *size) {
+    char hex[GIT_MAX_HEXSZ + 1], type[16];
+    sha1_to_hex(sha1, hex);
+    char *buf = retrieve_object(hex, type, size);
+    if (buf && strcmp(type, "tree") != 0) {
+        fprintf(stderr, "%s is a %s, not a tree\n", hex, type);
+        free(buf);
+        return NULL;
+    }
 
-    return tree_path;
+    return buf;
 }
 
-char *create_object_hash(char *tree, size_t size) {
-    unsigned char hash[20];
-    SHA1((unsigned char *)tree, size, hash);
-    char *hash_str = malloc(41);
-    for (int i = 0; i < 20; i++)
-        sprintf(hash_str + i * 2, "%02x", hash[i]);
-
-    return hash_str;
+void sha1_to_hex(const unsigned char *sha1, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    size_t rawsz = hash_algo()->rawsz;
+    for (size_t i = 0; i < rawsz; i++) {
+        hex[i * 2] = digits[sha1[i] >> 4];
+        hex[i * 2 + 1] = digits[sha1[i] & 0xf];
+    }
+    hex[rawsz * 2] = '\0';
 }
 
-char *compress_object(char *data, size_t size, size_t *compressed_size) {
-    *compressed_size = compressBound(size);
-    char *compressed = malloc(*compressed_size);
-    compress((Bytef *)compressed, compressed_size, (Bytef *)data, size);
+int hex_to_sha1(const char *hex, unsigned char *sha1) {
+    size_t rawsz = hash_algo()->rawsz;
+    for (size_t i = 0; i < rawsz; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[i * 2]) ||
+            !isxdigit((unsigned char)hex[i * 2 + 1]) ||
+            sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return 1;
+        sha1[i] = byte;
+    }
 
-    return compressed;
+    return 0;
 }
 
+// Writes one tree per directory of the index. Directories the cache-tree
+// still holds a hash for are reused, so only trees along changed paths are
+// rebuilt, and the updated cache-tree is saved back into the index.
 int write_tree(void) {
-    struct git_index_header header;
-    struct git_index_entry *entries;
-    read_index(&header, &entries);
-
-    size_t content_size;
-    struct git_tree_entry *tree_entries =
-        prep_tree_entries(header, entries, &content_size);
-
-    char *tree = create_tree(&content_size, tree_entries, header, entries);
-    free(entries);
-
-    char *hash = create_object_hash(tree, content_size);
-
-    size_t compressed_size;
-    char *compressed = compress_object(tree, content_size, &compressed_size);
+    struct git_index index;
+    if (read_index(&index) == 1)
+        return 1;
+
+    if (!index.cache_tree)
+        index.cache_tree = cache_tree_new();
+
+    int trees_written = 0;
+    if (cache_tree_update(&index, &trees_written)) {
+        fprintf(stderr, "Failed to write tree\n");
+        discard_index(&index);
+        return 1;
+    }
 
-    char *tree_path = create_object_store(hash);
+    int ret = 0;
+    if (trees_written)
+        ret = write_index_file(&index);
 
-    FILE *object = fopen(tree_path, "w");
-    fwrite(compressed, 1, compressed_size, object);
-    fclose(object);
+    char hash[GIT_MAX_HEXSZ + 1];
+    sha1_to_hex(index.cache_tree->sha1, hash);
     printf("%s\n", hash);
 
-    free(compressed);
-    free(tree);
-    free(tree_path);
+    discard_index(&index);
 
-    return 0;
+    return ret;
 }
@@ -1,30 +1,43 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "index.h"
 
+// A view of one tree entry. Neither path nor sha1 are copied: path is not
+// necessarily NUL terminated and both point into the tree or index they were
+// taken from.
 struct git_tree_entry {
     uint32_t mode;
-    char *path;
-    char sha1[41];
+    const char *path;
+    size_t path_len;
+    const unsigned char *sha1;
 };
 
-struct git_tree_entry *prep_tree_entries(struct git_index_header header,
-                                         struct git_index_entry *entries,
-                                         size_t *size);
+// Walks the entries of an inflated tree object in place
+struct tree_desc {
+    const unsigned char *buf;
+    size_t size;
+};
 
-char *create_tree(size_t *size, struct git_tree_entry *tree_entries,
-                  struct git_index_header header,
-                  struct git_index_entry *entries);
+char *create_tree(struct git_tree_entry *tree_entries, size_t num_entries,
+                  size_t *size);
 
-char *create_object_hash(char *data, size_t size);
+void init_tree_desc(struct tree_desc *desc, const void *buf, size_t size);
 
-char *compress_object(char *tree, size_t size, size_t *compressed_size);
+int next_tree_entry(struct tree_desc *desc, struct git_tree_entry *entry);
 
-int write_tree(void);
+int compare_tree_names(const char *a, size_t a_len, int a_dir, const char *b,
+                       size_t b_len, int b_dir);
+
+char *read_tree_object(const unsigned char *sha1, size_t *size);
 
-char *create_object_store(char *hash);
+void sha1_to_hex(const unsigned char *sha1, char *hex);
+
+int hex_to_sha1(const char *hex, unsigned char *sha1);
+
+int write_tree(void);
 
 #endif
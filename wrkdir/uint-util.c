@@ -27,3 +27,12 @@ void write_uint16(FILE *fp, uint16_t value) {
     buf[1] = value & 0xFF;
     fwrite(buf, 1, 2, fp);
 }
+
+uint32_t get_be32(const unsigned char *buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+           ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+uint16_t get_be16(const unsigned char *buf) {
+    return (buf[0] << 8) | buf[1];
+}
@@ -12,4 +12,8 @@ void write_uint16(FILE *fp, uint16_t value);
 
 void read_uint32(FILE *fp, uint32_t *value);
 
+uint32_t get_be32(const unsigned char *buf);
+
+uint16_t get_be16(const unsigned char *buf);
+
 #endif
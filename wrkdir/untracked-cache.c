@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "ignore.h"
+#include "index.h"
+#include "uint-util.h"
+#include "untracked-cache.h"
+
+// Off unless core.untrackedCache is true
+int untracked_cache_enabled(void) {
+    char *value = get_config("core.untrackedCache");
+    int enabled = value && !strcmp(value, "true");
+    free(value);
+
+    return enabled;
+}
+
+void fill_untracked_stat(struct untracked_stat *ust, const struct stat *st) {
+    ust->mtime_sec = (uint32_t)st->st_mtime;
+    ust->mtime_nsec = (uint32_t)ST_MTIME_NSEC(st);
+    ust->ino = (uint32_t)st->st_ino;
+    ust->size = (uint32_t)st->st_size;
+}
+
+int untracked_stat_equal(const struct untracked_stat *a,
+                         const struct untracked_stat *b) {
+    return a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->ino == b->ino && a->size == b->size;
+}
+
+struct untracked_dir *untracked_dir_new(const char *name, size_t len) {
+    struct untracked_dir *dir = calloc(1, sizeof(*dir));
+    dir->name = malloc(len + 1);
+    memcpy(dir->name, name, len);
+    dir->name[len] = '\0';
+
+    return dir;
+}
+
+void untracked_dir_free(struct untracked_dir *dir) {
+    if (!dir)
+        return;
+
+    for (size_t i = 0; i < dir->num_files; i++)
+        free(dir->files[i]);
+    for (size_t i = 0; i < dir->num_dirs; i++)
+        untracked_dir_free(dir->dirs[i]);
+    free(dir->files);
+    free(dir->dirs);
+    free(dir->name);
+    free(dir);
+}
+
+void untracked_cache_free(struct untracked_cache *uc) {
+    if (!uc)
+        return;
+
+    untracked_dir_free(uc->root);
+    free(uc);
+}
+
+struct untracked_dir *untracked_dir_find(const struct untracked_dir *dir,
+                                         const char *name, size_t len) {
+    size_t low = 0, high = dir ? dir->num_dirs : 0;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const char *sub = dir->dirs[mid]->name;
+        int cmp = strncmp(sub, name, len);
+        if (cmp == 0)
+            cmp = sub[len] != '\0';
+        if (cmp == 0)
+            return dir->dirs[mid];
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return NULL;
+}
+
+static void clear_flags(struct untracked_dir *dir, unsigned flags,
+                        int recursive) {
+    dir->flags &= ~flags;
+    for (size_t i = 0; recursive && i < dir->num_dirs; i++)
+        clear_flags(dir->dirs[i], flags, 1);
+}
+
+void untracked_cache_invalidate_all(struct untracked_cache *uc,
+                                    unsigned flags) {
+    if (uc && uc->root)
+        clear_flags(uc->root, flags, 1);
+}
+
+// Clears flags on the directory holding path, or the deepest one above it
+// that is cached. A path ending in '/' is a directory that came or went as a
+// whole, and a changed ignore file affects everything below it.
+void untracked_cache_invalidate_path(struct untracked_cache *uc,
+                                     const char *path, unsigned flags) {
+    if (!uc || !uc->root)
+        return;
+
+    struct untracked_dir *dir = uc->root;
+    const char *name = path, *slash;
+    while ((slash = strchr(name, '/')) && slash[1] != '\0') {
+        struct untracked_dir *sub = untracked_dir_find(dir, name, slash - name);
+        if (!sub)
+            break;
+        dir = sub;
+        name = slash + 1;
+    }
+    clear_flags(dir, flags, 0);
+
+    if (slash && slash[1] == '\0') {
+        struct untracked_dir *sub = untracked_dir_find(dir, name, slash - name);
+        if (sub)
+            clear_flags(sub, flags, 1);
+    } else if (!slash && !strcmp(name, IGNORE_FILE)) {
+        clear_flags(dir, UNTRACKED_VALID | flags, 1);
+    }
+}
+
+struct buffer {
+    unsigned char *data;
+    size_t len;
+    size_t alloc;
+};
+
+static void buffer_add(struct buffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->alloc) {
+        buf->alloc = (buf->len + len) * 2;
+        buf->data = realloc(buf->data, buf->alloc);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buffer_be32(struct buffer *buf, uint32_t value) {
+    unsigned char be[4] = {value >> 24, value >> 16, value >> 8, value};
+    buffer_add(buf, be, 4);
+}
+
+static void buffer_stat(struct buffer *buf, const struct untracked_stat *ust) {
+    buffer_be32(buf, ust->mtime_sec);
+    buffer_be32(buf, ust->mtime_nsec);
+    buffer_be32(buf, ust->ino);
+    buffer_be32(buf, ust->size);
+}
+
+// Each directory is its name NUL terminated, its stat data, that of its
+// ignore file, flags and the number of files and subdirectories as be32,
+// then the file names NUL terminated and the subdirectories in the same form
+static void serialize_dir(struct buffer *buf, struct untracked_dir *dir) {
+    buffer_add(buf, dir->name, strlen(dir->name) + 1);
+    buffer_stat(buf, &dir->stat);
+    buffer_stat(buf, &dir->ignore_stat);
+    buffer_be32(buf, dir->flags);
+    buffer_be32(buf, dir->num_files);
+    buffer_be32(buf, dir->num_dirs);
+    for (size_t i = 0; i < dir->num_files; i++)
+        buffer_add(buf, dir->files[i], strlen(dir->files[i]) + 1);
+    for (size_t i = 0; i < dir->num_dirs; i++)
+        serialize_dir(buf, dir->dirs[i]);
+}
+
+void write_untracked_extension(struct hashfile *f,
+                               struct untracked_cache *uc) {
+    struct buffer buf = {NULL, 0, 0};
+    buffer_stat(&buf, &uc->exclude_stat);
+    if (uc->root)
+        serialize_dir(&buf, uc->root);
+
+    hashfile_write(f, UNTRACKED_EXTENSION, 4);
+    hashfile_be32(f, buf.len);
+    hashfile_write(f, buf.data, buf.len);
+
+    free(buf.data);
+}
+
+static int read_stat(const unsigned char **data, size_t *size,
+                     struct untracked_stat *ust) {
+    if (*size < 16)
+        return 1;
+
+    ust->mtime_sec = get_be32(*data);
+    ust->mtime_nsec = get_be32(*data + 4);
+    ust->ino = get_be32(*data + 8);
+    ust->size = get_be32(*data + 12);
+    *data += 16;
+    *size -= 16;
+
+    return 0;
+}
+
+static char *read_name(const unsigned char **data, size_t *size) {
+    const unsigned char *nul = memchr(*data, '\0', *size);
+    if (!nul)
+        return NULL;
+
+    char *name = strdup((const char *)*data);
+    *size -= nul + 1 - *data;
+    *data = nul + 1;
+
+    return name;
+}
+
+static struct untracked_dir *read_dir(const unsigned char **data,
+                                      size_t *size) {
+    char *name = read_name(data, size);
+    if (!name)
+        return NULL;
+
+    struct untracked_dir *dir = calloc(1, sizeof(*dir));
+    dir->name = name;
+    if (read_stat(data, size, &dir->stat) ||
+        read_stat(data, size, &dir->ignore_stat) || *size < 12) {
+        untracked_dir_free(dir);
+        return NULL;
+    }
+
+    dir->flags = get_be32(*data);
+    uint32_t num_files = get_be32(*data + 4);
+    uint32_t num_dirs = get_be32(*data + 8);
+    *data += 12;
+    *size -= 12;
+    if (num_files > *size || num_dirs > *size) {
+        untracked_dir_free(dir);
+        return NULL;
+    }
+
+    dir->files = malloc((num_files + 1) * sizeof(*dir->files));
+    for (; dir->num_files < num_files; dir->num_files++) {
+        if (!(dir->files[dir->num_files] = read_name(data, size))) {
+            untracked_dir_free(dir);
+            return NULL;
+        }
+    }
+
+    dir->dirs = malloc((num_dirs + 1) * sizeof(*dir->dirs));
+    for (; dir->num_dirs < num_dirs; dir->num_dirs++) {
+        if (!(dir->dirs[dir->num_dirs] = read_dir(data, size))) {
+            untracked_dir_free(dir);
+            return NULL;
+        }
+    }
+
+    return dir;
+}
+
+// Parses the extension, returns NULL if it is malformed in which case
+// status simply reads every directory again
+struct untracked_cache *read_untracked_extension(const unsigned char *data,
+                                                 size_t size) {
+    struct untracked_cache *uc = calloc(1, sizeof(*uc));
+    if (read_stat(&data, &size, &uc->exclude_stat)) {
+        free(uc);
+        return NULL;
+    }
+
+    if (size) {
+        uc->root = read_dir(&data, &size);
+        if (!uc->root || size) {
+            untracked_cache_free(uc);
+            return NULL;
+        }
+    }
+
+    return uc;
+}
@@ -0,0 +1,80 @@
+#ifndef UNTRACKED_CACHE_H
+#define UNTRACKED_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "hashfile.h"
+
+// The listing of a directory can be reused while its stat data matches
+#define UNTRACKED_VALID 1
+// fsmonitor reported nothing in the directory since the index's token, so
+// not even its stat data has to be checked
+#define UNTRACKED_FSMONITOR_VALID 2
+// The directory is ignored and only looked into for its tracked files
+#define UNTRACKED_IGNORED 4
+
+// Index extension the cache is saved in. The layout is our own, not that of
+// git's UNTR, and the uppercase signature makes git skip it.
+#define UNTRACKED_EXTENSION "GBUC"
+
+// Enough of a stat to notice a directory's listing or a file changing, all
+// zero for a file that does not exist
+struct untracked_stat {
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+    uint32_t size;
+};
+
+// What status found in one directory: the files that are neither tracked
+// nor ignored, and every subdirectory it looked into, sorted by name. stat
+// is the directory's own and ignore_stat that of the ignore file in it.
+struct untracked_dir {
+    char *name;
+    struct untracked_stat stat;
+    struct untracked_stat ignore_stat;
+    unsigned flags;
+    char **files;
+    size_t num_files;
+    struct untracked_dir **dirs;
+    size_t num_dirs;
+};
+
+// Persisted as an index extension. The whole cache is dropped when the
+// exclude file changes, as its rules apply everywhere.
+struct untracked_cache {
+    struct untracked_stat exclude_stat;
+    struct untracked_dir *root;
+};
+
+int untracked_cache_enabled(void);
+
+void fill_untracked_stat(struct untracked_stat *ust, const struct stat *st);
+
+int untracked_stat_equal(const struct untracked_stat *a,
+                         const struct untracked_stat *b);
+
+struct untracked_dir *untracked_dir_new(const char *name, size_t len);
+
+void untracked_dir_free(struct untracked_dir *dir);
+
+void untracked_cache_free(struct untracked_cache *uc);
+
+struct untracked_dir *untracked_dir_find(const struct untracked_dir *dir,
+                                         const char *name, size_t len);
+
+void untracked_cache_invalidate_all(struct untracked_cache *uc,
+                                    unsigned flags);
+
+void untracked_cache_invalidate_path(struct untracked_cache *uc,
+                                     const char *path, unsigned flags);
+
+void write_untracked_extension(struct hashfile *f,
+                               struct untracked_cache *uc);
+
+struct untracked_cache *read_untracked_extension(const unsigned char *data,
+                                                 size_t size);
+
+#endif